@@ -0,0 +1,297 @@
+/* Copyright 2014-2017 Arch D. Robison
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/******************************************************************************
+ Headless host for Seismic Duck.
+
+ Runs the full game loop against an in-memory NimblePixMap, with no window,
+ no vsync, and no input devices.  Intended for profiling and regression
+ testing on machines without a display.
+*******************************************************************************/
+
+#include "../../Source/Config.h"
+#include "../../Source/Host.h"
+#include "../../Source/Game.h"
+#include "../../Source/Wavefield.h"
+#include "../../Source/BuiltFromResource.h"
+#include "../../Source/Parallel.h"
+#include "../../Source/TraceLib.h"
+#include <png.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+//! Directory containing the .png resources.
+static std::string ResourcePath =
+#if defined(HOST_RESOURCE_PATH)
+    HOST_RESOURCE_PATH;
+#else
+    "../../../Resource";
+#endif
+
+static void ReportResourceError( const char* routine, const char* resourceName, const char* error ) {
+    std::printf( "Internal error: %s failed %s: %s\n", routine, resourceName, error );
+    HostExit();
+}
+
+void HostLoadResource( BuiltFromResourcePixMap& item ) {
+    std::string path = ResourcePath + "/" + item.resourceName() + ".png";
+    png_image image;
+    std::memset( &image, 0, sizeof(image) );
+    image.version = PNG_IMAGE_VERSION;
+    if( !png_image_begin_read_from_file( &image, path.c_str() ) ) {
+        ReportResourceError( "png_image_begin_read_from_file", path.c_str(), image.message );
+        return;
+    }
+    // BGRA byte order is the little-endian layout of an ARGB8888 NimblePixel.
+    image.format = PNG_FORMAT_BGRA;
+    std::vector<NimblePixel> pixels( image.width*image.height );
+    if( !png_image_finish_read( &image, nullptr, pixels.data(), 0, nullptr ) ) {
+        ReportResourceError( "png_image_finish_read", path.c_str(), image.message );
+        png_image_free( &image );
+        return;
+    }
+    NimblePixMap map( image.width, image.height, 8*sizeof(NimblePixel), pixels.data(), image.width*sizeof(NimblePixel) );
+    item.buildFrom( map );
+}
+
+//! If true, HostClockTime advances by exactly 1/60 second per frame.
+/** Makes runs reproducible, which is what regression tests want. */
+static bool FixedClock = false;
+
+//! Number of frames completed so far.
+static int FrameCount;
+
+double HostClockTime() {
+    if( FixedClock )
+        return FrameCount*(1.0/60);
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+static float LastBusyFrac;
+
+float HostBusyFrac() {
+    return LastBusyFrac;
+}
+
+void HostSetFrameIntervalRate( int ) {
+    // There is no display to synchronize with, so always run at full speed.
+}
+
+static bool Quit;
+
+void HostExit() {
+    Quit = true;
+}
+
+//! [k] is true if key k is currently considered to be down.
+static bool KeyIsDown[HOST_KEY_LAST];
+
+bool HostIsKeyDown( int key ) {
+    return unsigned(key)<HOST_KEY_LAST && KeyIsDown[key];
+}
+
+void HostShowCursor( bool ) {
+}
+
+//! A key press scheduled for a particular frame.
+struct ScriptedKey {
+    int frame;
+    int key;
+};
+
+static std::vector<ScriptedKey> KeyScript;
+
+//! Write map as binary PPM file.  Return true if successful.
+static bool WritePPM( const char* filename, const NimblePixMap& map ) {
+    FILE* f = std::fopen( filename, "wb" );
+    if( !f )
+        return false;
+    std::fprintf( f, "P6\n%d %d\n255\n", map.width(), map.height() );
+    std::vector<byte> row( 3*map.width() );
+    for( int y=0; y<map.height(); ++y ) {
+        for( int x=0; x<map.width(); ++x ) {
+            NimbleColor c = map.color( x, y );
+            row[3*x+0] = c.red;
+            row[3*x+1] = c.green;
+            row[3*x+2] = c.blue;
+        }
+        std::fwrite( row.data(), 1, row.size(), f );
+    }
+    return std::fclose(f)==0;
+}
+
+static void Usage( const char* program ) {
+    std::fprintf( stderr,
+        "Usage: %s [options]\n"
+        "  -w width      width of virtual display (default 1024)\n"
+        "  -h height     height of virtual display (default 768)\n"
+        "  -n frames     number of frames to run (default 1000)\n"
+        "  -r dir        directory containing resource .png files\n"
+        "  -k frame:key  press key at given frame; key is a character or 'return'/'escape'\n"
+        "  -o file.ppm   write last frame to file\n"
+        "  -f            fixed clock of 60 frames per second, and every worker thread, for reproducible runs\n"
+        "  -p            draw each frame while the next one is computed, a frame behind\n"
+#if TRACE_EVENTS
+        "  -T file.json  write timeline of recent frames to file, in Chrome trace format\n"
+#endif
+#if HAVE_WORKER_THROTTLE
+        "  -t slow:fast:lookback:miss:settle\n"
+        "                thread throttling policy (default 0.8:0.5:15:3:15)\n"
+        "  -q            do not report changes in thread count\n"
+#endif
+#if USE_THREAD_POOL
+        "  -N            pin threads to NUMA nodes and place each panel's rows on the node that updates it\n"
+#endif
+        ,
+        program );
+    std::exit(1);
+}
+
+static int ParseKey( const char* s ) {
+    if( std::strcmp(s,"return")==0 ) return HOST_KEY_RETURN;
+    if( std::strcmp(s,"escape")==0 ) return HOST_KEY_ESCAPE;
+    if( std::strcmp(s,"space")==0 ) return ' ';
+    return s[0] && !s[1] ? s[0] : -1;
+}
+
+int main( int argc, char* argv[] ) {
+    int w = DISPLAY_WIDTH_MIN;
+    int h = DISPLAY_HEIGHT_MIN;
+    int nFrame = 1000;
+    const char* outputFile = nullptr;
+    const char* traceFile = nullptr;
+    bool pipelined = false;
+    for( int i=1; i<argc; ++i ) {
+        const char* arg = argv[i];
+        if( std::strcmp(arg,"-f")==0 ) {
+            FixedClock = true;
+            continue;
+        }
+        if( std::strcmp(arg,"-p")==0 ) {
+            pipelined = true;
+            continue;
+        }
+#if HAVE_WORKER_THROTTLE
+        if( std::strcmp(arg,"-q")==0 ) {
+            ThrottleSettings s = GetThrottleSettings();
+            s.log = false;
+            SetThrottleSettings(s);
+            continue;
+        }
+#endif
+#if USE_THREAD_POOL
+        if( std::strcmp(arg,"-N")==0 ) {
+            if( !SetNumaPlacement(true) )
+                std::fprintf( stderr, "NUMA placement is unavailable on this host\n" );
+            continue;
+        }
+#endif
+        if( i+1>=argc || arg[0]!='-' || arg[1]==0 || arg[2]!=0 )
+            Usage(argv[0]);
+        const char* value = argv[++i];
+        switch( arg[1] ) {
+            case 'w': w = std::atoi(value); break;
+            case 'h': h = std::atoi(value); break;
+            case 'n': nFrame = std::atoi(value); break;
+            case 'r': ResourcePath = value; break;
+            case 'o': outputFile = value; break;
+#if TRACE_EVENTS
+            case 'T': traceFile = value; break;
+#endif
+#if HAVE_WORKER_THROTTLE
+            case 't': {
+                ThrottleSettings s = GetThrottleSettings();
+                if( std::sscanf( value, "%f:%f:%d:%d:%d", &s.busyFracSlow, &s.busyFracFast, &s.lookBack, &s.missTolerance, &s.settle )!=5
+                    || !(0<=s.busyFracFast && s.busyFracFast<=s.busyFracSlow)
+                    || s.lookBack<=0 || s.lookBack>=32 || s.missTolerance<0 || s.missTolerance>=s.lookBack || s.settle<0 )
+                    Usage(argv[0]);
+                SetThrottleSettings(s);
+                break;
+            }
+#endif
+            case 'k': {
+                const char* colon = std::strchr(value,':');
+                ScriptedKey k = {std::atoi(value), colon ? ParseKey(colon+1) : -1};
+                if( k.key<0 )
+                    Usage(argv[0]);
+                KeyScript.push_back(k);
+                break;
+            }
+            default:
+                Usage(argv[0]);
+        }
+    }
+    if( w<DISPLAY_WIDTH_MIN || w>DISPLAY_WIDTH_MAX || h<DISPLAY_HEIGHT_MIN || h>DISPLAY_HEIGHT_MAX ) {
+        std::fprintf( stderr, "Display size must be between %dx%d and %dx%d\n",
+                      DISPLAY_WIDTH_MIN, DISPLAY_HEIGHT_MIN, DISPLAY_WIDTH_MAX, DISPLAY_HEIGHT_MAX );
+        return 1;
+    }
+
+    std::vector<NimblePixel> pixels( w*h );
+    NimblePixMap screen( w, h, 8*sizeof(NimblePixel), pixels.data(), w*sizeof(NimblePixel) );
+    if( !GameInitialize(w,h) || Quit ) {
+        std::printf("GameInitialize() failed\n");
+        return 1;
+    }
+    GameResizeOrMove(screen);
+    WavefieldSetPipelinedDraw(pipelined);
+#if TRACE_EVENTS
+    if( traceFile )
+        TraceEventsEnable(true);
+#endif
+
+#if HAVE_WORKER_THROTTLE
+    // The fixed clock stops during a frame, so ThrottleWorkers would see every frame take no time and cut the
+    // workers down to one.  Pin the count instead, which also keeps the busy meter from depending on timing.
+    if( FixedClock && WorkerCount()<MaxWorkerCount() )
+        SetWorkerCount( MaxWorkerCount() );
+#endif
+    double start = HostClockTime();
+    double busy = 0;
+    for( FrameCount=0; FrameCount<nFrame && !Quit; ++FrameCount ) {
+        for( const ScriptedKey& k: KeyScript )
+            if( k.frame==FrameCount )
+                GameKeyDown(k.key);
+        double t0 = HostClockTime();
+        GameUpdateDraw( screen, NimbleUpdate|NimbleDraw );
+        double t1 = HostClockTime();
+#if HAVE_WORKER_THROTTLE
+        if( !FixedClock )
+            ThrottleWorkers(t0,t1);
+#endif
+        busy += t1-t0;
+    }
+    double elapsed = HostClockTime()-start;
+    if( !FixedClock && elapsed>0 ) {
+        LastBusyFrac = float(busy/elapsed);
+        std::printf( "%d frames in %.3f sec = %.1f frames/sec\n", FrameCount, elapsed, FrameCount/elapsed );
+    }
+#if TRACE_EVENTS
+    if( traceFile && !TraceEventsWrite(traceFile) ) {
+        std::printf( "Internal error: cannot write %s\n", traceFile );
+        return 1;
+    }
+#endif
+    if( outputFile && !WritePPM(outputFile,screen) ) {
+        std::printf( "Internal error: cannot write %s\n", outputFile );
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,170 @@
+/* Copyright 2014-2017 Arch D. Robison
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "SharedHalo.h"
+#include "../../Source/AssertLib.h"
+#include "../../Source/Utility.h"
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+//! Number of messages that a ring holds.  Two lets a part send its next frame's halo before the other part has received the last one.
+static const int SlotCount = 2;
+
+//! Milliseconds that a part waits for a message or a free slot before checking that the other parts are alive.
+static const int LivenessCheckInterval = 100;
+
+//! Ring buffer in shared memory.  The message data follows it.
+struct SharedHalo::Ring {
+    //! Number of messages sent.  The receiver waits on it.
+    alignas(64) std::atomic<std::uint32_t> head;
+    //! Number of messages received.  The sender waits on it.
+    alignas(64) std::atomic<std::uint32_t> tail;
+    //! Size of the message in each slot.
+    size_t bytes[SlotCount];
+    //! Data of slot k.
+    char* slot( int k, size_t maxBytes ) {return reinterpret_cast<char*>(this+1)+k*maxBytes;}
+};
+
+static_assert( sizeof(std::atomic<std::uint32_t>)==sizeof(int), "futex needs a 32-bit word" );
+
+//! Wait until counter a might differ from v, or until the timeout expires.  Wakeups may be spurious.
+static void FutexWait( std::atomic<std::uint32_t>& a, std::uint32_t v, const timespec& timeout ) {
+    syscall( SYS_futex, reinterpret_cast<int*>(&a), FUTEX_WAIT, int(v), &timeout, nullptr, 0 );
+}
+
+//! Wake every process waiting on counter a.
+static void FutexWake( std::atomic<std::uint32_t>& a ) {
+    syscall( SYS_futex, reinterpret_cast<int*>(&a), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0 );
+}
+
+bool SharedHalo::create( int n, size_t maxBytes ) {
+    Assert( !myBase && n>=1 );
+    myPartCount = n;
+    myMaxBytes = maxBytes;
+    myParent = getpid();
+    myRingBytes = (sizeof(Ring)+SlotCount*maxBytes+63) & ~size_t(63);
+    mySize = Max( 1, 2*(n-1) )*myRingBytes;
+    char name[64];
+    std::snprintf( name, sizeof(name), "/seismic-duck-halo-%d", int(getpid()) );
+    int fd = shm_open( name, O_CREAT|O_EXCL|O_RDWR, 0600 );
+    if( fd<0 ) {
+        std::perror( "shm_open" );
+        return false;
+    }
+    // The mapping outlives the name, so remove the name now, lest a crash leave it behind.
+    shm_unlink( name );
+    void* p = MAP_FAILED;
+    if( ftruncate( fd, off_t(mySize) )==0 )
+        p = mmap( nullptr, mySize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0 );
+    close(fd);
+    if( p==MAP_FAILED ) {
+        std::perror( "shared memory for halos" );
+        return false;
+    }
+    myBase = static_cast<char*>(p);
+    for( int k=0; k<2*(n-1); ++k ) {
+        Ring* r = new( myBase+k*myRingBytes ) Ring;
+        r->head.store(0);
+        r->tail.store(0);
+    }
+    return true;
+}
+
+SharedHalo::~SharedHalo() {
+    if( myBase )
+        munmap( myBase, mySize );
+}
+
+SharedHalo::Ring& SharedHalo::ring( int k, bool up ) const {
+    Assert( 0<k && k<myPartCount );
+    return *reinterpret_cast<Ring*>(myBase+(2*(k-1)+up)*myRingBytes);
+}
+
+void SharedHalo::wait( std::atomic<std::uint32_t>& a, std::uint32_t v ) const {
+    const timespec timeout = {0, LivenessCheckInterval*1000000L};
+    FutexWait( a, v, timeout );
+    if( a.load( std::memory_order_acquire )==v )
+        checkPeers();
+}
+
+void SharedHalo::checkPeers() const {
+    if( myPart>0 ) {
+        // A child whose parent has died has been adopted by another process.
+        if( getppid()!=myParent ) {
+            std::fprintf( stderr, "part %d of a split shot lost its parent process\n", myPart );
+            _exit(1);
+        }
+        // The parent notices if a sibling died, and kills this process.
+        return;
+    }
+    for( size_t k=0; k<myChildren.size(); ++k ) {
+        // WNOWAIT leaves the child for the caller of create to reap.
+        siginfo_t info;
+        info.si_pid = 0;
+        if( waitid( P_PID, id_t(myChildren[k]), &info, WEXITED|WNOHANG|WNOWAIT )!=0 || info.si_pid==0 )
+            continue;
+        // A part that finished normally has sent all of its messages, so the others do not wait for it.
+        if( info.si_code==CLD_EXITED && info.si_status==0 )
+            continue;
+        std::fprintf( stderr, "part %d of a split shot died; stopping the others\n", int(k+1) );
+        for( pid_t c: myChildren )
+            kill( c, SIGKILL );
+        _exit(1);
+    }
+}
+
+void SharedHalo::send( bool up, const void* data, size_t n ) {
+    Assert( n<=myMaxBytes );
+    // The boundary is the one above this part if the message goes up, and otherwise the one below.
+    Ring& r = ring( up ? myPart : myPart+1, up );
+    const std::uint32_t h = r.head.load( std::memory_order_relaxed );
+    for(;;) {
+        std::uint32_t t = r.tail.load( std::memory_order_acquire );
+        if( h-t<SlotCount )
+            break;
+        wait( r.tail, t );
+    }
+    std::memcpy( r.slot( h%SlotCount, myMaxBytes ), data, n );
+    r.bytes[h%SlotCount] = n;
+    r.head.store( h+1, std::memory_order_release );
+    FutexWake( r.head );
+}
+
+void SharedHalo::receive( bool up, void* data, size_t n ) {
+    // A message from above came down across the boundary above this part, and one from below came up across the boundary below.
+    Ring& r = ring( up ? myPart : myPart+1, !up );
+    const std::uint32_t t = r.tail.load( std::memory_order_relaxed );
+    for(;;) {
+        std::uint32_t h = r.head.load( std::memory_order_acquire );
+        if( h!=t )
+            break;
+        wait( r.head, h );
+    }
+    Assert( r.bytes[t%SlotCount]==n );
+    std::memcpy( data, r.slot( t%SlotCount, myMaxBytes ), n );
+    r.tail.store( t+1, std::memory_order_release );
+    FutexWake( r.tail );
+}
@@ -0,0 +1,80 @@
+/* Copyright 2014-2017 Arch D. Robison
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/******************************************************************************
+ Overlap-zone exchange between processes on one Linux host.
+
+ Each boundary between adjacent parts has a ring buffer in each direction, in
+ POSIX shared memory.  A ring has a few slots of one message each.  The sender
+ waits on a futex while the ring is full, and the receiver while it is empty.
+ The waits time out now and then to check that the other processes are still
+ alive, because a part that died would leave its peers waiting forever.
+*******************************************************************************/
+
+#pragma once
+#ifndef SharedHalo_H
+#define SharedHalo_H
+
+#include "../../Source/Wavefield.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <sys/types.h>
+
+//! WavefieldHaloLink between processes that inherit one shared mapping from their parent.
+class SharedHalo: public WavefieldHaloLink {
+public:
+    SharedHalo() : myBase(nullptr), mySize(0), myRingBytes(0), myMaxBytes(0), myPartCount(0), myPart(0), myParent(0) {}
+    ~SharedHalo();
+    SharedHalo( const SharedHalo& ) = delete;
+    void operator=( const SharedHalo& ) = delete;
+
+    //! Map rings for n parts, for messages of up to maxBytes.  Return false if shared memory is unavailable.
+    /** Call in the process that forks the other parts, which inherit the mapping. */
+    bool create( int n, size_t maxBytes );
+
+    //! Record that the calling process, which called create, forked the part with the given process id.
+    void addChild( pid_t pid ) {myChildren.push_back(pid);}
+
+    //! Set which part the calling process is.
+    void setPart( int k ) {myPart = k;}
+
+    //! Process that called create.
+    pid_t parent() const {return myParent;}
+
+    void send( bool up, const void* data, size_t n ) override;
+    void receive( bool up, void* data, size_t n ) override;
+private:
+    struct Ring;
+    //! Ring that carries messages up or down across the boundary above part k.
+    Ring& ring( int k, bool up ) const;
+    //! Wait until counter a might differ from v, checking now and then that the other parts are alive.
+    void wait( std::atomic<std::uint32_t>& a, std::uint32_t v ) const;
+    //! If another part has died, report it and exit, after killing the other children if this is the parent.
+    void checkPeers() const;
+    char* myBase;
+    size_t mySize;
+    size_t myRingBytes;
+    size_t myMaxBytes;
+    int myPartCount;
+    int myPart;
+    //! Process that called create.
+    pid_t myParent;
+    //! Processes forked by the parent.  Only the parent uses it.
+    std::vector<pid_t> myChildren;
+};
+
+#endif /* SharedHalo_H */
@@ -0,0 +1,595 @@
+/* Copyright 2014-2017 Arch D. Robison
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/******************************************************************************
+ Batch generator of synthetic shot gathers.
+
+ Runs the wave simulation for a list of shot positions over one geology, with no
+ rendering, and writes the surface trace recorded at each time step to a binary
+ gather file per shot.
+
+ Gather file layout, in host byte order:
+    GatherHeader
+    float trace[traceCount][sampleCount]
+ Trace k is the receiver at visible x coordinate k.
+
+ With -c, each gather is also compared with a reference gather from an earlier
+ run, such as one by a build with different field precision, and the error
+ relative to the reference is reported.  The reference must have the same spatial
+ order, because -S 4 also shortens the timestep, which changes both when each
+ sample is taken and the amplitude of the pulse.
+
+ With -P n, each shot is split by depth across n processes, which exchange the
+ overlap zones between their panels through shared memory.  The first process
+ owns the surface and writes the gathers.  If any process dies, the others
+ stop too.
+
+ With -Q, tiles where the wavefield is quiescent are skipped, as in the game.
+ That is faster but not exact, and -P does not support it.  With -K, each shot
+ updates only the tiles in its causal cone, which is exact down to the noise
+ that the wavefield starts with.  -P does not support it either.
+
+ With -C k, every k samples each shot writes a checkpoint: the samples so far
+ are appended to prefix-x.part, and the wavefield is saved to prefix-x.snap,
+ or to a delta snapshot prefix-x.snap.1, .2, ... on top of it if at most half of
+ the wavefield changed, which without -Q is rare.  With -R, a shot
+ with a checkpoint resumes from it.  The files are removed once the gather has been
+ written.
+*******************************************************************************/
+
+#include "../../Source/AssertLib.h"
+#include "../../Source/Config.h"
+#include "../../Source/Airgun.h"
+#include "../../Source/NimbleDraw.h"
+#include "../../Source/Geology.h"
+#include "../../Source/Wavefield.h"
+#include "../../Source/Parallel.h"
+#include "SharedHalo.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+//! Header at start of each gather file.
+struct GatherHeader {
+    char magic[8];                  // "SDGATHR2"
+    std::int32_t traceCount;        // number of receivers
+    std::int32_t sampleCount;       // number of samples per trace
+    std::int32_t stepsPerSample;    // simulation time steps between samples
+    std::int32_t shotX;             // visible x coordinate of airgun
+    std::int32_t shotY;             // depth of airgun
+    std::int32_t spatialOrder;      // order of accuracy in space, 2 or 4
+    float timestep;                 // length of a time step, relative to that of the second-order stencil
+    std::int32_t reserved;
+};
+
+//! Settings from the command line that are common to all shots.
+struct SurveySettings {
+    int width = 1024-PANEL_MIN_WIDTH;
+    int height = 768/2;
+    int sampleCount = 1000;
+    int stepsPerSample = 1;
+    int shotY = 8;
+    AirgunParameters airgun;
+    std::string outputPrefix = "gather";
+    std::string referencePrefix;    // if not empty, compare with gathers that have this prefix
+    int spatialOrder = 2;
+    int part = 0;                   // which of the processes this is
+    int partCount = 1;              // number of processes that split each shot
+    SharedHalo* halo = nullptr;     // link between the processes if partCount>1
+    int checkpointInterval = 0;     // samples between checkpoints, or 0 for none
+    bool resume = false;            // resume shots from their checkpoints
+    bool skipQuiescent = false;     // skip quiescent tiles, which is not exact
+    bool trackCone = false;         // update only the causal cone of the shot
+};
+
+//! Most processes that -P can split a shot across.
+static const int PartCountMax = 8;
+
+//! Number of delta snapshots between full snapshots.  More deltas make checkpoints cheaper and resuming slower.
+static const int DeltasPerFull = 7;
+
+//! Checkpoint files of one shot.
+struct Checkpoint {
+    std::string samples;    // samples recorded so far, time-major
+    std::string snapshot;   // full snapshot; delta k is snapshot+"."+k
+
+    Checkpoint( const SurveySettings& s, int shotX ) {
+        std::string prefix = s.outputPrefix+"-"+std::to_string(shotX);
+        samples = prefix+".part";
+        snapshot = prefix+".snap";
+    }
+    std::string delta( int k ) const {return snapshot+"."+std::to_string(k);}
+
+    //! Remove delta k and the ones after it.
+    void removeDeltas( int k ) const {
+        while( std::remove( delta(k++).c_str() )==0 )
+            continue;
+    }
+};
+
+//! Restore the engine and the first samples from checkpoint c.  Return the number of samples restored, or 0 if none.
+static int ResumeShot( WavefieldEngine& engine, const SurveySettings& s, const Checkpoint& c, std::vector<float>& samples, int& deltaCount ) {
+    if( !engine.restoreSnapshot( c.snapshot.c_str() ) )
+        return 0;
+    const size_t w = s.width;
+    // A delta that does not follow the one before, such as one left by a run that crashed, ends the chain.
+    deltaCount = 0;
+    while( engine.restoreSnapshot( c.delta(deltaCount+1).c_str() ) )
+        ++deltaCount;
+    const size_t t0 = size_t(engine.frameCount());
+    FILE* f = std::fopen( c.samples.c_str(), "rb" );
+    // The snapshot carries the pump factor and spatial order, which must match the samples.
+    bool ok = f && engine.pumpFactor()==s.stepsPerSample && engine.spatialOrder()==s.spatialOrder && t0<=samples.size()/w
+              && std::fread( samples.data(), sizeof(float)*w, t0, f )==t0;
+    if( f )
+        std::fclose(f);
+    return ok ? int(t0) : 0;
+}
+
+//! Smallest height that leaves every panel a few rows above the bottom PML region.
+static const int HeightMin = 64;
+
+//! Compare samples, which are time-major, with the reference gather for shotX, and report the error.
+/** Return true if the reference gather was readable and has the same shape, spatial order, and timestep. */
+static bool CompareShot( const SurveySettings& s, int shotX, float timestep, const std::vector<float>& samples ) {
+    char filename[1024];
+    std::snprintf( filename, sizeof(filename), "%s-%d.bin", s.referencePrefix.c_str(), shotX );
+    FILE* f = std::fopen( filename, "rb" );
+    if( !f ) {
+        std::fprintf( stderr, "cannot open %s\n", filename );
+        return false;
+    }
+    const int w = s.width;
+    const int n = s.sampleCount;
+    GatherHeader h;
+    std::vector<float> reference( size_t(w)*n );
+    bool ok = std::fread( &h, sizeof(h), 1, f )==1
+              && std::memcmp( h.magic, "SDGATHR2", sizeof(h.magic) )==0
+              && h.traceCount==w && h.sampleCount==n && h.stepsPerSample==s.stepsPerSample
+              && std::fread( reference.data(), sizeof(float), reference.size(), f )==reference.size();
+    std::fclose(f);
+    if( !ok ) {
+        std::fprintf( stderr, "%s is not a gather of the same shape\n", filename );
+        return false;
+    }
+    // Samples at different times, or of a pulse scaled by a different timestep, are not comparable.
+    if( h.spatialOrder!=s.spatialOrder || h.timestep!=timestep ) {
+        std::fprintf( stderr, "%s is a gather of spatial order %d with timestep %g, not order %d with timestep %g\n",
+                      filename, int(h.spatialOrder), h.timestep, s.spatialOrder, timestep );
+        return false;
+    }
+    double errorSquared = 0, referenceSquared = 0, errorMax = 0, referenceMax = 0;
+    for( int k=0; k<w; ++k )
+        for( int t=0; t<n; ++t ) {
+            double r = reference[size_t(k)*n+t];
+            double e = samples[size_t(t)*w+k]-r;
+            errorSquared += e*e;
+            referenceSquared += r*r;
+            errorMax = std::fmax( errorMax, std::fabs(e) );
+            referenceMax = std::fmax( referenceMax, std::fabs(r) );
+        }
+    std::printf( "shot %d: relative RMS error %.3g, maximum error %.3g, reference peak %.3g\n", shotX,
+                 referenceSquared>0 ? std::sqrt(errorSquared/referenceSquared) : 0, errorMax, referenceMax );
+    return true;
+}
+
+//! Run one shot and write its gather.  Return true if successful.
+/** Set computed to the number of samples simulated, which excludes any restored from a checkpoint. */
+static bool RunShot( const SurveySettings& s, const Geology& g, int shotX, int& computed ) {
+    WavefieldEngine engine;
+    engine.airgun().initialize( s.airgun );
+    engine.setPumpFactor( s.stepsPerSample );
+    engine.setSpatialOrder( s.spatialOrder );
+    engine.setPartition( s.part, s.partCount, s.halo );
+
+    // Record time-major, because that is the order in which the simulation produces samples.
+    const int w = s.width;
+    const int n = s.sampleCount;
+    std::vector<float> samples( size_t(w)*n );
+    const Checkpoint checkpoint( s, shotX );
+    int deltaCount = 0;
+    int t0 = s.resume ? ResumeShot( engine, s, checkpoint, samples, deltaCount ) : 0;
+    if( t0==0 ) {
+        // Undo whatever a failed resume restored.
+        engine.setPumpFactor( s.stepsPerSample );
+        engine.setSpatialOrder( s.spatialOrder );
+        engine.initialize( g );
+        engine.fireAirgun( shotX, s.shotY );
+    }
+    // After any resume, because a snapshot carries the setting of the run that saved it.
+    engine.setTileSkipping( s.skipQuiescent );
+    engine.setConeTracking( s.trackCone );
+    FILE* partial = nullptr;
+    if( s.checkpointInterval>0 ) {
+        // Rewrite the samples, which drops any recorded after the snapshot that was resumed.
+        partial = std::fopen( checkpoint.samples.c_str(), "wb" );
+        if( !partial || std::fwrite( samples.data(), sizeof(float)*w, t0, partial )!=size_t(t0) ) {
+            std::fprintf( stderr, "cannot write %s\n", checkpoint.samples.c_str() );
+            return false;
+        }
+    }
+    NimblePixMap noMap;
+    for( int t=t0; t<n; ++t ) {
+        engine.updateDraw( noMap, NimbleUpdate, 0, 0, ColorFunc(0) );
+        if( s.part==0 )
+            engine.copySurface( &samples[size_t(t)*w], w );
+        if( partial && (t+1)%s.checkpointInterval==0 && t+1<n ) {
+            // Samples go first, so that the samples file always covers the latest snapshot.
+            const int t1 = (t+1)-s.checkpointInterval;
+            const int m = (t+1)-std::max(t0,t1);
+            bool ok = std::fwrite( &samples[size_t(t+1-m)*w], sizeof(float)*w, m, partial )==size_t(m) && std::fflush(partial)==0;
+            if( ok ) {
+                if( deltaCount==DeltasPerFull || !engine.saveSnapshot( checkpoint.delta(deltaCount+1).c_str(), /*delta=*/true ) ) {
+                    // The old deltas do not follow the new snapshot, so a crash before they are gone is harmless.
+                    ok = engine.saveSnapshot( checkpoint.snapshot.c_str(), /*delta=*/false );
+                    if( ok ) {
+                        checkpoint.removeDeltas(1);
+                        deltaCount = 0;
+                    }
+                } else {
+                    ++deltaCount;
+                }
+            }
+            if( !ok )
+                std::fprintf( stderr, "cannot write checkpoint for shot %d\n", shotX );
+        }
+    }
+    computed = n-t0;
+    if( partial )
+        std::fclose( partial );
+    // Only the first process has the surface.
+    if( s.part>0 )
+        return true;
+
+    char filename[1024];
+    std::snprintf( filename, sizeof(filename), "%s-%d.bin", s.outputPrefix.c_str(), shotX );
+    FILE* f = std::fopen( filename, "wb" );
+    if( !f ) {
+        std::fprintf( stderr, "cannot open %s\n", filename );
+        return false;
+    }
+    GatherHeader h;
+    std::memcpy( h.magic, "SDGATHR2", sizeof(h.magic) );
+    h.traceCount = w;
+    h.sampleCount = n;
+    h.stepsPerSample = s.stepsPerSample;
+    h.shotX = shotX;
+    h.shotY = s.shotY;
+    h.spatialOrder = s.spatialOrder;
+    h.timestep = engine.timestep();
+    h.reserved = 0;
+    bool ok = std::fwrite( &h, sizeof(h), 1, f )==1;
+    std::vector<float> trace( n );
+    for( int k=0; k<w && ok; ++k ) {
+        for( int t=0; t<n; ++t )
+            trace[t] = samples[size_t(t)*w+k];
+        ok = std::fwrite( trace.data(), sizeof(float), n, f )==size_t(n);
+    }
+    if( std::fclose(f)!=0 )
+        ok = false;
+    if( !ok )
+        std::fprintf( stderr, "cannot write %s\n", filename );
+    if( !s.referencePrefix.empty() && !CompareShot( s, shotX, engine.timestep(), samples ) )
+        ok = false;
+    // Keep the checkpoint until the gather is safely written, so that -R can recover the shot.
+    if( ok && (s.checkpointInterval>0 || s.resume) ) {
+        std::remove( checkpoint.samples.c_str() );
+        std::remove( checkpoint.snapshot.c_str() );
+        checkpoint.removeDeltas(1);
+    }
+    return ok;
+}
+
+//! Run all shots.  If concurrent is true, run independent shots in parallel.
+/** Each shot's own update is parallel across panels either way.
+    Set computed to the total number of samples simulated. */
+static bool RunSurvey( const SurveySettings& s, const Geology& g, const std::vector<int>& shots, bool concurrent, double& computed ) {
+    std::vector<char> ok( shots.size(), false );
+    std::vector<int> samples( shots.size(), 0 );
+    auto runAll = [&]{
+        if( concurrent ) {
+#if USE_TBB
+            tbb::task_group tg;
+#elif USE_THREAD_POOL
+            TaskGroup tg;
+#endif
+            for( size_t k=0; k<shots.size(); ++k ) {
+#if USE_TBB || USE_THREAD_POOL
+                tg.run( [&,k]{ok[k] = RunShot( s, g, shots[k], samples[k] );} );
+#else
+                ok[k] = RunShot( s, g, shots[k], samples[k] );
+#endif
+            }
+#if USE_TBB || USE_THREAD_POOL
+            tg.wait();
+#endif
+        } else {
+            for( size_t k=0; k<shots.size(); ++k )
+                ok[k] = RunShot( s, g, shots[k], samples[k] );
+        }
+    };
+#if USE_TBB
+    ThrottledArena().execute( runAll );
+#else
+    runAll();
+#endif
+    computed = 0;
+    for( int m: samples )
+        computed += m;
+    for( char x: ok )
+        if( !x )
+            return false;
+    return true;
+}
+
+static void Usage( const char* program ) {
+    std::fprintf( stderr,
+        "Usage: %s [options]\n"
+        "  -w width          width of wavefield in pixels, a multiple of 8 (default 832)\n"
+        "  -h height         depth of wavefield in pixels (default 384)\n"
+        "  -n samples        number of samples per trace (default 1000)\n"
+        "  -d steps          simulation time steps per sample, 1..%d (default 1); above %d uses split tiling\n"
+        "  -x x1,x2,...      x coordinates of shots\n"
+        "  -x first:last:step\n"
+        "                    x coordinates of shots as a range (default is one shot in the middle)\n"
+        "  -y depth          depth of airgun (default 8)\n"
+        "  -g ocean:sand:dip:curvature:bumps\n"
+        "                    geology parameters (default 0:0.5:0:0.25:1)\n"
+        "  -s seed           seed for random part of geology (default 1)\n"
+        "  -a kind:frequency:amplitude\n"
+        "                    airgun pulse, where kind is square, gaussian, slope, or ricker (default gaussian:1:1)\n"
+        "  -o prefix         write gathers to prefix-x.bin (default \"gather\")\n"
+        "  -c prefix         compare each gather with reference prefix-x.bin and report the error\n"
+        "  -S order          order of accuracy in space, 2 or 4 (default 2); 4 requires -d %d or less\n"
+        "  -P processes      split each shot by depth across 1..%d processes (default 1); requires -d %d or less\n"
+        "  -C samples        checkpoint each shot every so many samples to prefix-x.part and prefix-x.snap*\n"
+        "  -R                resume shots from their checkpoints\n"
+        "  -Q                skip tiles where the wavefield is quiescent, which is faster but freezes values below 1e-3;\n"
+        "                    cannot be combined with -P\n"
+        "  -K                update only the causal cone of each shot, which freezes the initial noise of 1e-6 outside it;\n"
+        "                    cannot be combined with -P\n"
+#if USE_TBB || USE_THREAD_POOL
+        "  -t threads        number of threads per process (default is all hardware threads, divided among processes)\n"
+        "  -j                throughput mode: run independent shots in parallel\n"
+#endif
+#if USE_THREAD_POOL
+        "  -N                pin threads to NUMA nodes and place each panel's rows on the node that updates it;\n"
+        "                    with -P, bind each process to a node\n"
+#endif
+        ,
+        program, PUMP_FACTOR_SPLIT_MAX, PUMP_FACTOR_MAX, PUMP_FACTOR_MAX, PartCountMax, PUMP_FACTOR_MAX );
+    std::exit(1);
+}
+
+//! Parse list of shot coordinates.  Return false if malformed.
+static bool ParseShots( const char* s, std::vector<int>& shots ) {
+    int first, last, step;
+    if( std::strchr(s,':') ) {
+        if( std::sscanf( s, "%d:%d:%d", &first, &last, &step )!=3 || step<=0 )
+            return false;
+        for( int x=first; x<=last; x+=step )
+            shots.push_back(x);
+        return true;
+    }
+    for( const char* p=s; *p; ) {
+        char* end;
+        shots.push_back( int(std::strtol( p, &end, 10 )) );
+        if( end==p || (*end && *end!=',') )
+            return false;
+        p = *end ? end+1 : end;
+    }
+    return true;
+}
+
+static bool ParsePulseKind( const char* s, AirgunPulseKind& kind ) {
+    static const char* const name[APK_N_SIGNATURE] = {"square","gaussian","slope","ricker"};
+    for( int k=0; k<APK_N_SIGNATURE; ++k )
+        if( std::strcmp( s, name[k] )==0 ) {
+            kind = AirgunPulseKind(k);
+            return true;
+        }
+    return false;
+}
+
+int main( int argc, char* argv[] ) {
+    SurveySettings s;
+    GeologyParameters gp;
+    unsigned seed = 1;
+    std::vector<int> shots;
+    bool concurrent = false;
+#if USE_THREAD_POOL
+    bool numa = false;
+#endif
+#if HAVE_WORKER_THROTTLE
+    int threads = 0;
+#endif
+    for( int i=1; i<argc; ++i ) {
+        const char* arg = argv[i];
+        if( std::strcmp(arg,"-j")==0 ) {
+            concurrent = true;
+            continue;
+        }
+        if( std::strcmp(arg,"-R")==0 ) {
+            s.resume = true;
+            continue;
+        }
+        if( std::strcmp(arg,"-Q")==0 ) {
+            s.skipQuiescent = true;
+            continue;
+        }
+        if( std::strcmp(arg,"-K")==0 ) {
+            s.trackCone = true;
+            continue;
+        }
+#if USE_THREAD_POOL
+        if( std::strcmp(arg,"-N")==0 ) {
+            numa = true;
+            continue;
+        }
+#endif
+        if( i+1>=argc || arg[0]!='-' || arg[1]==0 || arg[2]!=0 )
+            Usage(argv[0]);
+        const char* value = argv[++i];
+        switch( arg[1] ) {
+            case 'w': s.width = std::atoi(value); break;
+            case 'h': s.height = std::atoi(value); break;
+            case 'n': s.sampleCount = std::atoi(value); break;
+            case 'd': s.stepsPerSample = std::atoi(value); break;
+            case 'y': s.shotY = std::atoi(value); break;
+            case 's': seed = unsigned(std::strtoul(value,nullptr,10)); break;
+            case 'o': s.outputPrefix = value; break;
+            case 'c': s.referencePrefix = value; break;
+#if HAVE_WORKER_THROTTLE
+            case 't': threads = std::atoi(value); break;
+#endif
+            case 'P': s.partCount = std::atoi(value); break;
+            case 'C': s.checkpointInterval = std::atoi(value); break;
+            case 'S': s.spatialOrder = std::atoi(value); break;
+            case 'x':
+                if( !ParseShots( value, shots ) )
+                    Usage(argv[0]);
+                break;
+            case 'g':
+                if( std::sscanf( value, "%f:%f:%f:%f:%d", &gp.oceanDepth, &gp.sandstoneDepth, &gp.dip, &gp.curvature, &gp.nBump )!=5
+                    || !(0<=gp.oceanDepth && gp.oceanDepth+gp.curvature<=0.9f) || !(0<=gp.sandstoneDepth && gp.sandstoneDepth<=1)
+                    || !(0<=gp.dip && gp.dip<=1) || !(0<=gp.curvature && gp.curvature<=1)
+                    || gp.nBump<0 || gp.nBump>GEOLOGY_NBUMP_MAX )
+                    Usage(argv[0]);
+                break;
+            case 'a': {
+                char kind[16];
+                if( std::sscanf( value, "%15[a-z]:%f:%f", kind, &s.airgun.frequency, &s.airgun.amplitude )!=3
+                    || !ParsePulseKind( kind, s.airgun.pulseKind ) || !(s.airgun.frequency>0) )
+                    Usage(argv[0]);
+                break;
+            }
+            default:
+                Usage(argv[0]);
+        }
+    }
+    if( s.width<=0 || s.width>GRID_WIDTH_MAX || s.width%8!=0 ) {
+        std::fprintf( stderr, "Width must be a multiple of 8 no greater than %d\n", GRID_WIDTH_MAX );
+        return 1;
+    }
+    if( s.height<HeightMin || s.height>GRID_HEIGHT_MAX ) {
+        std::fprintf( stderr, "Height must be between %d and %d\n", HeightMin, GRID_HEIGHT_MAX );
+        return 1;
+    }
+    if( s.sampleCount<=0 || s.stepsPerSample<1 || s.stepsPerSample>PUMP_FACTOR_SPLIT_MAX || s.shotY<1 || s.shotY>=s.height )
+        Usage(argv[0]);
+    if( s.partCount<1 || s.partCount>PartCountMax
+        || (s.partCount>1 && (concurrent || s.stepsPerSample>PUMP_FACTOR_MAX)) )
+        Usage(argv[0]);
+    // A split shot cannot skip tiles, so -Q or -K would make the gathers depend on the number of processes.
+    if( (s.skipQuiescent || s.trackCone) && s.partCount>1 )
+        Usage(argv[0]);
+    // Only trapezoid tiling has overlap zones deep enough for the fourth-order stencil.
+    if( (s.spatialOrder!=2 && s.spatialOrder!=4)
+        || (s.spatialOrder==4 && s.stepsPerSample>PUMP_FACTOR_MAX) )
+        Usage(argv[0]);
+    // The processes of a split shot would have to agree on which checkpoint to resume from.
+    if( s.checkpointInterval<0 || (s.partCount>1 && (s.checkpointInterval>0 || s.resume)) )
+        Usage(argv[0]);
+    if( shots.empty() )
+        shots.push_back( s.width/2 );
+    for( int x: shots )
+        if( x<0 || x>=s.width ) {
+            std::fprintf( stderr, "Shot x coordinate %d is outside wavefield of width %d\n", x, s.width );
+            return 1;
+        }
+
+    // Fork the other processes before anything starts the thread pool, whose threads a child would not have.
+    SharedHalo halo;
+    std::vector<pid_t> children;
+    if( s.partCount>1 ) {
+        if( !halo.create( s.partCount, WavefieldEngine::haloBytesMax( s.width+2*HIDDEN_BORDER_SIZE ) ) )
+            return 1;
+        std::fflush(stdout);
+        for( int k=1; k<s.partCount && s.part==0; ++k ) {
+            pid_t pid = fork();
+            if( pid<0 ) {
+                std::perror( "fork" );
+                for( pid_t c: children )
+                    kill( c, SIGKILL );
+                return 1;
+            }
+            if( pid==0 ) {
+                s.part = k;
+                // Die with the parent, and if it is already gone, do not start.
+                prctl( PR_SET_PDEATHSIG, SIGKILL );
+                if( getppid()!=halo.parent() )
+                    _exit(1);
+            } else {
+                children.push_back(pid);
+                halo.addChild(pid);
+            }
+        }
+        halo.setPart( s.part );
+        s.halo = &halo;
+    }
+#if USE_THREAD_POOL
+    if( numa && !(s.partCount>1 ? BindToNumaNode( NumaNodeOfChunk( s.part, s.partCount ) ) : SetNumaPlacement(true)) && s.part==0 )
+        std::fprintf( stderr, "NUMA placement is unavailable on this host\n" );
+#endif
+
+#if HAVE_WORKER_THROTTLE
+    ThrottleSettings ts = GetThrottleSettings();
+    ts.log = false;
+    SetThrottleSettings(ts);
+    if( threads<=0 || threads>MaxWorkerCount() )
+        threads = std::max( 1, MaxWorkerCount()/s.partCount );
+    SetWorkerCount( threads );
+#endif
+
+    // All shots share one geology, which the engines only read.
+    std::srand( seed );
+    Geology g;
+    g.generate( gp, s.width+2*HIDDEN_BORDER_SIZE, s.height+HIDDEN_BORDER_SIZE );
+
+    using namespace std::chrono;
+    auto start = steady_clock::now();
+    double computed;
+    bool ok = RunSurvey( s, g, shots, concurrent, computed );
+    double elapsed = duration<double>(steady_clock::now()-start).count();
+    if( s.part>0 )
+        return ok ? 0 : 1;
+    // A part that failed may leave the others waiting for it forever, so kill them.
+    while( !children.empty() ) {
+        int status;
+        pid_t c = wait( &status );
+        if( c<0 )
+            break;
+        children.erase( std::remove( children.begin(), children.end(), c ), children.end() );
+        if( !WIFEXITED(status) || WEXITSTATUS(status)!=0 ) {
+            ok = false;
+            for( pid_t d: children )
+                kill( d, SIGKILL );
+        }
+    }
+    // Samples restored from checkpoints took no time to compute.
+    double cells = computed*s.stepsPerSample*(s.width+2*HIDDEN_BORDER_SIZE)*(s.height+HIDDEN_BORDER_SIZE);
+    std::printf( "%d shots in %.3f sec = %.1f Mcell/s\n", int(shots.size()), elapsed, elapsed>0 ? cells/elapsed*1E-6 : 0 );
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,234 @@
+/* Copyright 2014-2017 Arch D. Robison
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/******************************************************************************
+ Microbenchmarks for the wavefield kernels.
+
+ For each wavefield size and pump factor, times each kind of tile by itself on
+ one thread, and then the full update for each thread count.  Pump factors above
+ PUMP_FACTOR_MAX, which use split tiling, are sampled at 16, 32, and 64.  Reports cell
+ updates per second and the memory bandwidth that those updates would need
+ if no field data were reused from cache.  Output is CSV or JSON, one record
+ per measurement.
+*******************************************************************************/
+
+#include "../../Source/AssertLib.h"
+#include "../../Source/Config.h"
+#include "../../Source/NimbleDraw.h"
+#include "../../Source/Geology.h"
+#include "../../Source/Wavefield.h"
+#include "../../Source/Parallel.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+//! One measurement.
+struct BenchRecord {
+    int width;
+    int height;
+    int pumpFactor;
+    const char* kind;       // kind of tile, or "all" for the full update
+    int threads;
+    int tiles;
+    double cellUpdates;     // includes redundant updates in overlap zones
+    double bytes;           // estimated as if no field data were reused from cache
+    double seconds;
+};
+
+static double Now() {
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+//! Time f() run frames times, after one untimed run to warm the caches.
+template<typename F>
+static double TimeFrames( int frames, const F& f ) {
+    f();
+    double t0 = Now();
+    for( int k=0; k<frames; ++k )
+        f();
+    return Now()-t0;
+}
+
+static void Measure( int width, int height, int framesPerMeasurement, const std::vector<int>& threadCounts, std::vector<BenchRecord>& records ) {
+    // Fixed seed, so that every run benchmarks the same geology.
+    std::srand(1);
+    GeologyParameters gp;
+    Geology g;
+    g.generate( gp, width+2*HIDDEN_BORDER_SIZE, height+HIDDEN_BORDER_SIZE );
+    WavefieldEngine engine;
+    // The wavefield stays quiescent without an airgun, so skipping would leave little to measure.
+    engine.setTileSkipping(false);
+    NimblePixMap noMap;
+    std::vector<WavefieldTileKind> kinds;
+    std::vector<int> pumpFactors;
+    for( int d=1; d<=PUMP_FACTOR_MAX; ++d )
+        pumpFactors.push_back(d);
+    for( int d=16; d<=PUMP_FACTOR_SPLIT_MAX; d*=2 )
+        pumpFactors.push_back(d);
+    for( int d: pumpFactors ) {
+        // Run split tiling for fewer frames, so that each measurement runs about as many timesteps.
+        int frames = d<=PUMP_FACTOR_MAX ? framesPerMeasurement : std::max( 1, framesPerMeasurement*PUMP_FACTOR_MAX/d );
+        engine.setPumpFactor(d);
+        engine.initialize(g);
+        engine.getTileKinds(kinds);
+        int totalTiles = 0;
+        double totalCells = 0, totalBytes = 0;
+        for( size_t k=0; k<kinds.size(); ++k ) {
+            const WavefieldTileKind& tk = kinds[k];
+            totalTiles += tk.tileCount;
+            totalCells += tk.cellsPerFrame;
+            totalBytes += tk.cellsPerFrame*tk.bytesPerCell;
+            if( tk.tileCount==0 )
+                continue;
+            double t = TimeFrames( frames, [&]{engine.updateTileKind(int(k));} );
+            records.push_back( {width, height, d, tk.name, 1, tk.tileCount, tk.cellsPerFrame*frames, tk.cellsPerFrame*tk.bytesPerCell*frames, t} );
+        }
+        // Reset the wavefield, which the tile-kind runs left in a meaningless state.
+        engine.initialize(g);
+        for( int n: threadCounts ) {
+#if HAVE_WORKER_THROTTLE
+            SetWorkerCount(n);
+#endif
+            double t;
+#if USE_TBB
+            ThrottledArena().execute( [&]{t = TimeFrames( frames, [&]{engine.updateDraw( noMap, NimbleUpdate, 0, 0, ColorFunc(0) );} );} );
+#else
+            t = TimeFrames( frames, [&]{engine.updateDraw( noMap, NimbleUpdate, 0, 0, ColorFunc(0) );} );
+#endif
+            records.push_back( {width, height, d, "all", n, totalTiles, totalCells*frames, totalBytes*frames, t} );
+        }
+    }
+}
+
+static void WriteCSV( FILE* f, const std::vector<BenchRecord>& records ) {
+    std::fprintf( f, "width,height,pump_factor,kind,threads,tiles,cell_updates,seconds,mcells_per_sec,est_gbytes_per_sec\n" );
+    for( const BenchRecord& r: records )
+        std::fprintf( f, "%d,%d,%d,%s,%d,%d,%.0f,%.6f,%.2f,%.3f\n",
+                      r.width, r.height, r.pumpFactor, r.kind, r.threads, r.tiles, r.cellUpdates, r.seconds,
+                      r.cellUpdates/r.seconds*1E-6, r.bytes/r.seconds*1E-9 );
+}
+
+static void WriteJSON( FILE* f, const std::vector<BenchRecord>& records ) {
+    std::fprintf( f, "[\n" );
+    for( size_t k=0; k<records.size(); ++k ) {
+        const BenchRecord& r = records[k];
+        std::fprintf( f, "  {\"width\":%d, \"height\":%d, \"pump_factor\":%d, \"kind\":\"%s\", \"threads\":%d, \"tiles\":%d, "
+                         "\"cell_updates\":%.0f, \"seconds\":%.6f, \"mcells_per_sec\":%.2f, \"est_gbytes_per_sec\":%.3f}%s\n",
+                      r.width, r.height, r.pumpFactor, r.kind, r.threads, r.tiles, r.cellUpdates, r.seconds,
+                      r.cellUpdates/r.seconds*1E-6, r.bytes/r.seconds*1E-9, k+1<records.size() ? "," : "" );
+    }
+    std::fprintf( f, "]\n" );
+}
+
+static void Usage( const char* program ) {
+    std::fprintf( stderr,
+        "Usage: %s [options]\n"
+        "  -s WxH        wavefield size; may be repeated (default 832x384, 1728x540, and 2368x720)\n"
+        "  -n frames     frames per measurement, scaled down for pump factors above %d (default 50)\n"
+#if HAVE_WORKER_THROTTLE
+        "  -t n1,n2,...  thread counts for the full update (default 1, 2, 4, ... up to all hardware threads)\n"
+#endif
+        "  -f format     csv or json (default csv)\n"
+        "  -o file       write results to file instead of stdout\n",
+        program, PUMP_FACTOR_MAX );
+    std::exit(1);
+}
+
+int main( int argc, char* argv[] ) {
+    struct Size {int width, height;};
+    std::vector<Size> sizes;
+    std::vector<int> threadCounts;
+    int frames = 50;
+    bool json = false;
+    const char* outputFile = nullptr;
+    for( int i=1; i<argc; ++i ) {
+        const char* arg = argv[i];
+        if( i+1>=argc || arg[0]!='-' || arg[1]==0 || arg[2]!=0 )
+            Usage(argv[0]);
+        const char* value = argv[++i];
+        switch( arg[1] ) {
+            case 's': {
+                Size s;
+                if( std::sscanf( value, "%dx%d", &s.width, &s.height )!=2
+                    || s.width<=0 || s.width>GRID_WIDTH_MAX || s.width%8!=0
+                    || s.height<64 || s.height>GRID_HEIGHT_MAX ) {
+                    std::fprintf( stderr, "Width must be a multiple of 8 no greater than %d, and height must be between 64 and %d\n",
+                                  GRID_WIDTH_MAX, GRID_HEIGHT_MAX );
+                    return 1;
+                }
+                sizes.push_back(s);
+                break;
+            }
+            case 'n': frames = std::atoi(value); break;
+            case 't':
+                for( const char* p=value; *p; ) {
+                    char* end;
+                    int n = int(std::strtol( p, &end, 10 ));
+                    if( end==p || (*end && *end!=',') || n<=0 )
+                        Usage(argv[0]);
+                    threadCounts.push_back(n);
+                    p = *end ? end+1 : end;
+                }
+                break;
+            case 'f':
+                if( std::strcmp(value,"json")==0 ) json = true;
+                else if( std::strcmp(value,"csv")==0 ) json = false;
+                else Usage(argv[0]);
+                break;
+            case 'o': outputFile = value; break;
+            default:
+                Usage(argv[0]);
+        }
+    }
+    if( frames<=0 )
+        Usage(argv[0]);
+    if( sizes.empty() )
+        sizes = {{832,384}, {1728,540}, {2368,720}};
+#if HAVE_WORKER_THROTTLE
+    ThrottleSettings ts = GetThrottleSettings();
+    ts.log = false;
+    SetThrottleSettings(ts);
+    int maxThreads = MaxWorkerCount();
+    if( threadCounts.empty() ) {
+        for( int n=1; n<maxThreads; n*=2 )
+            threadCounts.push_back(n);
+        threadCounts.push_back(maxThreads);
+    }
+    for( int& n: threadCounts )
+        if( n>maxThreads )
+            n = maxThreads;
+#else
+    threadCounts.assign(1,1);
+#endif
+
+    std::vector<BenchRecord> records;
+    for( const Size& s: sizes )
+        Measure( s.width, s.height, frames, threadCounts, records );
+
+    FILE* f = outputFile ? std::fopen( outputFile, "w" ) : stdout;
+    if( !f ) {
+        std::fprintf( stderr, "cannot open %s\n", outputFile );
+        return 1;
+    }
+    if( json )
+        WriteJSON( f, records );
+    else
+        WriteCSV( f, records );
+    return f==stdout || std::fclose(f)==0 ? 0 : 1;
+}
@@ -22,22 +22,14 @@
 #include "Wavefield.h"
 #include "Widget.h"
 #include <cmath>
+#include <cstring>
 
 using namespace std;
 
-const int AirgunPulseSizeMax = 256;
-static int AirgunPulseSize = 0;
-static float AirgunPulse[AirgunPulseSizeMax];
-static int AirgunCounter = AirgunPulseSizeMax;
-static int AirgunX;
-static int AirgunY;
-GraphMeter AirgunMeter(PANEL_MIN_WIDTH-36,100);
-
-void AirgunInitialize( const AirgunParameters& parameters) {
-    AirgunMeter.setLimits(-80000,80000);
+void Airgun::initialize( const AirgunParameters& parameters ) {
     int j=-1;
-    for( int i=0; i<AirgunPulseSizeMax; ++i ) {
-        double t = (i-AirgunPulseSizeMax/2)*0.075*parameters.frequency;
+    for( int i=0; i<pulseSizeMax; ++i ) {
+        double t = (i-pulseSizeMax/2)*0.075*parameters.frequency;
         double value = 0;
         switch( parameters.pulseKind ) {
             case APK_square: value = -1<=t && t<=1; break;
@@ -50,27 +42,48 @@ void AirgunInitialize( const AirgunParameters& parameters) {
         if( j>=0 )
             // The 100 was found by trial and error.  The intent is to have a big enough
             // amplitude that reflections show nicely.
-            AirgunPulse[j++] = float(25*SAMPLE_CLUT_SIZE*parameters.amplitude*value);
+            myPulse[j++] = float(25*SAMPLE_CLUT_SIZE*parameters.amplitude*value);
     }
-    AirgunPulseSize=j;
+    myPulseSize=j;
 }
 
-void AirgunFire( int x, int y ) {
-    if( AirgunCounter<AirgunPulseSize ) 
+bool Airgun::fire() {
+    if( myCounter<myPulseSize ) 
         // Ignore attempt to prematurely fire airgun
-        return;
-    AirgunCounter = 0;
-    AirgunY = y;
-    AirgunX = x;
-    WavefieldSetImpulseLocation(x,y);
+        return false;
+    myCounter = 0;
+    return true;
 }
 
-float AirgunGetImpulse( float rockFactor ) {
+float Airgun::getImpulse( float rockFactor ) {
     float a = 0;
-    if( AirgunCounter<AirgunPulseSize )  {
-        Assert( size_t(AirgunCounter)<=sizeof(AirgunPulse)/sizeof(AirgunPulse[0]));
-        a = AirgunPulse[AirgunCounter++]*powf(rockFactor,-1.5f)*0.1f;
+    if( myCounter<myPulseSize )  {
+        Assert( size_t(myCounter)<=sizeof(myPulse)/sizeof(myPulse[0]));
+        a = myPulse[myCounter++]*powf(rockFactor,-1.5f)*0.1f;
     }
-    AirgunMeter.update(a);
+    if( myMeter )
+        myMeter->update(a);
     return a;
 }
+
+void Airgun::saveState( AirgunState& s ) const {
+    static_assert( sizeof(s.pulse)==sizeof(myPulse), "AirgunState::pulse must match myPulse" );
+    s.pulseSize = myPulseSize;
+    s.counter = myCounter;
+    std::memcpy( s.pulse, myPulse, sizeof(myPulse) );
+}
+
+void Airgun::restoreState( const AirgunState& s ) {
+    Assert( 0<=s.pulseSize && s.pulseSize<=pulseSizeMax && 0<=s.counter && s.counter<=pulseSizeMax );
+    myPulseSize = s.pulseSize;
+    myCounter = s.counter;
+    std::memcpy( myPulse, s.pulse, sizeof(myPulse) );
+}
+
+void AirgunInitialize( const AirgunParameters& parameters ) {
+    TheWavefieldEngine.airgun().initialize( parameters );
+}
+
+void AirgunFire( int x, int y ) {
+    TheWavefieldEngine.fireAirgun( x, y );
+}
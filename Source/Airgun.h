@@ -17,6 +17,8 @@
  Airgun physics for Seismic Duck
 *******************************************************************************/
 
+#include <cstdint>
+
 //! Airgun signatures
 enum AirgunPulseKind {
     APK_square,
@@ -39,9 +41,49 @@ public:
     {}
 };
 
+class GraphMeter;
+
+//! State of an Airgun, as saved in snapshots of a WavefieldEngine.
+struct AirgunState {
+    std::int32_t pulseSize;
+    //! Index into pulse of next impulse.
+    std::int32_t counter;
+    float pulse[256];
+};
+
+//! Pulse generator for one airgun.
+/** Each WavefieldEngine has its own Airgun, so that independent simulations can fire independently. */
+class Airgun {
+public:
+    Airgun() : myPulseSize(0), myCounter(pulseSizeMax), myMeter(nullptr) {}
+
+    //! Compute pulse signature from parameters.
+    void initialize( const AirgunParameters& parameters );
+
+    //! Start a new pulse.  Return false if the previous pulse is still in progress.
+    bool fire();
+
+    //! Return next impulse of the current pulse, or 0 if there is no current pulse.
+    /** rockFactor is the A coefficient of the wavefield at the airgun. */
+    float getImpulse( float rockFactor );
+
+    //! Set meter that shows each impulse, or nullptr for none.
+    void setMeter( GraphMeter* meter ) {myMeter=meter;}
+    //! Copy the pulse and the position in it to s.
+    void saveState( AirgunState& s ) const;
+    //! Resume the pulse saved in s.  s must have come from saveState.
+    void restoreState( const AirgunState& s );
+private:
+    static const int pulseSizeMax = 256;
+    int myPulseSize;
+    float myPulse[pulseSizeMax];
+    //! Index into myPulse of next impulse.
+    int myCounter;
+    GraphMeter* myMeter;
+};
+
+//! Initialize the airgun of TheWavefieldEngine
 void AirgunInitialize( const AirgunParameters& parameters );
-void AirgunFire( int x, int y );
-float AirgunGetImpulse( float rockFactor );
 
-class GraphMeter;
-extern GraphMeter AirgunMeter;
+//! Fire the airgun of TheWavefieldEngine at (x,y)
+void AirgunFire( int x, int y );
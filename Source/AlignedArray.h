@@ -0,0 +1,123 @@
+/* Copyright 2017 Arch D. Robison
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+/******************************************************************************
+ Dynamically sized two-dimensional arrays with cache-aligned rows
+*******************************************************************************/
+
+#pragma once
+#ifndef AlignedArray_H
+#define AlignedArray_H
+
+#include "AssertLib.h"
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#if _MSC_VER
+#include <malloc.h>
+#endif
+
+//! Alignment of rows in bytes.  One cache line.
+const size_t ALIGNED_ARRAY_ALIGNMENT = 64;
+
+//! Return pointer to n bytes of memory aligned on an ALIGNED_ARRAY_ALIGNMENT boundary.
+/** The memory is zeroed if zero is true.  Otherwise it is left untouched, so that the first
+    thread to write a page chooses its NUMA node.  Throws std::bad_alloc if out of memory. */
+inline void* AlignedArrayAllocate( size_t n, bool zero=true ) {
+#if _MSC_VER
+    void* p = _aligned_malloc( n, ALIGNED_ARRAY_ALIGNMENT );
+#else
+    void* p;
+    if( posix_memalign( &p, ALIGNED_ARRAY_ALIGNMENT, n ) )
+        p = nullptr;
+#endif
+    if( !p )
+        throw std::bad_alloc();
+    if( zero )
+        std::memset( p, 0, n );
+    return p;
+}
+
+inline void AlignedArrayFree( void* p ) {
+#if _MSC_VER
+    _aligned_free(p);
+#else
+    std::free(p);
+#endif
+}
+
+//! Two-dimensional array indexed as a[i][j], with each row starting on a cache line boundary.
+/** Rows are padded to a multiple of the cache line size.  A row size that is a multiple of 4 KB
+    gets an extra cache line, so that a column does not map to a handful of cache sets.
+    T must be a type for which all zero bits is a valid value. */
+template<typename T>
+class AlignedArray2D {
+    T* myBase;
+    size_t myStride;
+    int myHeight;
+    int myWidth;
+public:
+    AlignedArray2D() : myBase(nullptr), myStride(0), myHeight(0), myWidth(0) {}
+    ~AlignedArray2D() {AlignedArrayFree(myBase);}
+    AlignedArray2D( const AlignedArray2D& ) = delete;
+    void operator=( const AlignedArray2D& ) = delete;
+
+    //! Resize to given number of rows and columns.
+    /** If the size changes, the old contents are discarded and the array is filled with zeros,
+        or left uninitialized if zero is false.  Otherwise the contents are left as they were. */
+    void resize( int height, int width, bool zero=true ) {
+        Assert( height>=0 && width>=0 );
+        if( height==myHeight && width==myWidth )
+            return;
+        AlignedArrayFree(myBase);
+        myBase = nullptr;
+        size_t rowBytes = (width*sizeof(T)+ALIGNED_ARRAY_ALIGNMENT-1) & ~(ALIGNED_ARRAY_ALIGNMENT-1);
+        if( rowBytes%4096==0 )
+            rowBytes += ALIGNED_ARRAY_ALIGNMENT;
+        Assert( rowBytes%sizeof(T)==0 );
+        myStride = rowBytes/sizeof(T);
+        myHeight = height;
+        myWidth = width;
+        if( height>0 )
+            myBase = static_cast<T*>(AlignedArrayAllocate( height*rowBytes, zero ));
+    }
+
+    //! Pointer to row i.
+    T* operator[]( int i ) const {
+        Assert( unsigned(i)<unsigned(myHeight) );
+        return myBase+i*myStride;
+    }
+
+    int height() const {return myHeight;}
+    int width() const {return myWidth;}
+
+    //! Distance between consecutive rows, in units of T.
+    size_t stride() const {return myStride;}
+
+    //! Copy of the base and stride of an AlignedArray2D, for use as a local variable.
+    /** A local View lets the compiler keep the base and stride in registers.
+        Otherwise it must reload them after every store through a type that may alias
+        anything, such as char or the SIMD intrinsic vector types. */
+    class View {
+        T* myBase;
+        size_t myStride;
+    public:
+        View( const AlignedArray2D& a ) : myBase(a.myBase), myStride(a.myStride) {}
+        T* operator[]( int i ) const {return myBase+i*myStride;}
+    };
+};
+
+#endif /* AlignedArray_H */
@@ -44,15 +44,32 @@ const int WAVEFIELD_VISIBLE_WIDTH_MAX = DISPLAY_WIDTH_MAX-PANEL_MIN_WIDTH;
 //! Maximum height of visible wavefield
 const int WAVEFIELD_VISIBLE_HEIGHT_MAX = DISPLAY_HEIGHT_MAX/2;
 
+//! Set to 1 to permit simulation grids much larger than the display, such as off-screen survey models.
+/** Widens the tile descriptors from 4 to 8 bytes.  The reservoir, which only the game has, stays bounded by the display. */
+#ifndef LARGE_GRID
+#define LARGE_GRID 0
+#endif
+
+//! Maximum width of simulated grid, not counting the hidden border.
+/** The display limits apply only to what is drawn. */
+const int GRID_WIDTH_MAX = LARGE_GRID ? 16384 : WAVEFIELD_VISIBLE_WIDTH_MAX;
+
+//! Maximum height of simulated grid, not counting the hidden border.
+const int GRID_HEIGHT_MAX = LARGE_GRID ? 8192 : WAVEFIELD_VISIBLE_HEIGHT_MAX;
+
 //! Maximum width of seismogram
 const int SEISMOGRAM_WIDTH_MAX = WAVEFIELD_VISIBLE_WIDTH_MAX;
 
 //! Maximum height of seismogram
 const int SEISMOGRAM_HEIGHT_MAX = WAVEFIELD_VISIBLE_HEIGHT_MAX;
 
-//! Maximum number of timesteps per frame
+//! Maximum number of timesteps per frame with trapezoid tiling, which sizes the overlap zones between panels.
 static const int PUMP_FACTOR_MAX = 6;
 
+//! Maximum number of timesteps per frame.  Pump factors above PUMP_FACTOR_MAX use split tiling,
+//! which has no overlap zones, for fast-forward and batch runs.
+static const int PUMP_FACTOR_SPLIT_MAX = 64;
+
 //! Log2 of size of a color lookup array for converting samples to colors.
 const int SAMPLE_CLUT_LG_SIZE = 10;
 
@@ -31,6 +31,7 @@
 #include "Sprite.h"
 #include "Wavefield.h"
 #include "Seismogram.h"
+#include "TraceLib.h"
 #include "Utility.h"
 #include <cstdlib>
 #include <cmath>
@@ -490,10 +491,11 @@ static void SetWidgetSizes() {
 
 static RubberImage PanelBackground("Panel");
 static DigitalMeter FrameRateMeter(6,1);
-#if USE_TBB
+#if HAVE_WORKER_THROTTLE
 static DigitalMeter ThreadMeter(2,0);
 static GraphMeter BusyMeter(90,25,NimbleColor(255,255,0));
 #endif
+static GraphMeter AirgunMeter(PANEL_MIN_WIDTH-36,100);
 
 static MessageDialog TheLevelContinueDialog("LevelContinueDialog");
 static MessageDialog WarnBreakDrillDialog("WarnBreakDrillDialog");
@@ -626,6 +628,7 @@ class ReservoirFunctor {
 public:
     ReservoirFunctor( NimbleRequest request_ ) : request(request_) {}
     void operator()() const {
+        TraceEvent("Reservoir");
         if( request & NimbleUpdate ) {
             float amount[N_Phase];
             ReservoirUpdate( amount );
@@ -645,6 +648,7 @@ public:
 
 void GameUpdateDraw( NimblePixMap& map, NimbleRequest request ) {
     CheckGameInterface(GIC_GameUpdateDraw); 
+    TraceEvent("GameUpdateDraw");
 
 #if WRITING_DOCUMENTATION
     new(&TheMap) NimblePixMap( map );
@@ -660,15 +664,26 @@ void GameUpdateDraw( NimblePixMap& map, NimbleRequest request ) {
     }
     const NimbleRequest pausedRequest = IsPaused ? request-NimbleUpdate : request;
     // Update the seismogram but do not draw it, using the current wavefield state.  
-    SeismogramUpdateDraw( seismogramClip, pausedRequest&NimbleUpdate, TheColorFunc, IsAutoGainOn );
+    {
+        TraceEvent("SeismogramUpdate");
+        SeismogramUpdateDraw( seismogramClip, pausedRequest&NimbleUpdate, TheColorFunc, IsAutoGainOn );
+    }
 
     // Do the computationally intense tasks in parallel
-    auto wf = [=]{WavefieldUpdateDraw(subsurface, pausedRequest, ShowGeology, ShowSeismic, TheColorFunc);  };
+    auto wf = [=]{
+        TraceEvent("Wavefield");
+        WavefieldUpdateDraw(subsurface, pausedRequest, ShowGeology, ShowSeismic, TheColorFunc);
+    };
     // Functor for drawing the seismogram.
-    auto sf = [=]{SeismogramUpdateDraw(seismogramClip, pausedRequest&NimbleDraw, TheColorFunc, IsAutoGainOn); };
+    auto sf = [=]{
+        TraceEvent("SeismogramDraw");
+        SeismogramUpdateDraw(seismogramClip, pausedRequest&NimbleDraw, TheColorFunc, IsAutoGainOn);
+    };
     ReservoirFunctor rf( pausedRequest );
 #if USE_TBB
-    tbb::parallel_invoke( wf, sf, rf );
+    ThrottledArena().execute( [&]{tbb::parallel_invoke( wf, sf, rf );} );
+#elif USE_THREAD_POOL
+    ParallelInvoke( wf, sf, rf );
 #elif USE_CILK
     cilk_spawn wf();
     cilk_spawn sf();
@@ -679,6 +694,8 @@ void GameUpdateDraw( NimblePixMap& map, NimbleRequest request ) {
     sf();
     rf();
 #endif
+    // The rest is serial
+    TraceEvent("SerialTail");
     if( pausedRequest & NimbleUpdate ) {
         DrillBit.update();
         UpdateDuckAndRig();
@@ -745,14 +762,14 @@ void GameUpdateDraw( NimblePixMap& map, NimbleRequest request ) {
         int tabLeft2 = PanelWidth*5/8;
         int airGunTop = tabTop2+2*TheFont.height();;
         AirgunMeter.drawOn( map, PanelWidth/2-AirgunMeter.width()/2, airGunTop );
-#if USE_TBB
+#if HAVE_WORKER_THROTTLE
         BusyMeter.update(BusyFrac());
 #endif
         if(ShowFrameRate) {
             int frameMeterY = fluidMeterY-FrameRateMeter.height()-15;
             FrameRateMeter.setValue( EstimateFrameRate() );
             FrameRateMeter.drawOn( map, PanelWidth/2-FrameRateMeter.width()/2, frameMeterY ); 
-#if USE_TBB
+#if HAVE_WORKER_THROTTLE
             int threadMeterY = frameMeterY -ThreadMeter.height() - 10;
             int pairWidth = ThreadMeter.width() + 10 + BusyMeter.width();
             ThreadMeter.setValue( WorkerCount() );
@@ -777,6 +794,11 @@ bool GameInitialize(int width, int height) {
     WindowHeight = height;
     SetWidgetSizes();
     BuiltFromResourcePixMap::loadAll();
+    AirgunMeter.setLimits(-80000,80000);
+    TheWavefieldEngine.airgun().setMeter( &AirgunMeter );
+    // The game can afford to freeze values too small to see.
+    TheWavefieldEngine.setTileSkipping(true);
+    TheWavefieldEngine.setConeTracking(true);
     AirgunInitialize( TheAirgunParameters );
     CashMeter.setValue(100);
     TheSpeedDialog.setValues();
@@ -119,7 +119,7 @@ public:
 
     void drawHole( NimblePixMap& map, int x, int y ) const;
 
-    static const int maxWidth = WAVEFIELD_VISIBLE_WIDTH_MAX+2*HIDDEN_BORDER_SIZE;
+    static const int maxWidth = GRID_WIDTH_MAX+2*HIDDEN_BORDER_SIZE;
 private:
     int myWidth;
     int myHeight;
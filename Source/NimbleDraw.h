@@ -28,6 +28,7 @@
 #pragma warning(disable: 4244 4800) 
 #endif
 #elif __APPLE__
+#elif __linux__
 #else
 #error unsupported target
 #endif /* defined(WIN32)||defined(WIN64) */
@@ -1,6 +1,424 @@
 #include "Parallel.h"
 #include "AssertLib.h"
+#include "Utility.h"
+#include <cstdio>
+#include <cstdlib>
+
+#if USE_TBB
+
+// TBB prior to oneTBB defines TBB_INTERFACE_VERSION in every header.  oneTBB defines it only in tbb/version.h.
+#if !defined(TBB_INTERFACE_VERSION) || TBB_INTERFACE_VERSION>=12000
+#define USE_ONETBB 1
+#include "tbb/info.h"
+#else
 #include "tbb/task_scheduler_init.h"
+#endif
+#include <memory>
+
+//! Maximum number of threads that the hardware can usefully run.
+static int MaxThreadCount() {
+#if USE_ONETBB
+    return tbb::info::default_concurrency();
+#else
+    return tbb::task_scheduler_init::default_num_threads();
+#endif
+}
+
+//! [n-1] is an arena with concurrency n.
+/** The arenas are created once and never destroyed.  Changing the thread count switches
+    which arena runs the work, which moves workers between arenas instead of destroying
+    and recreating them. */
+static std::unique_ptr<tbb::task_arena[]> ArenaOfCount;
+
+static tbb::task_arena* CurrentArena;
+
+static void ActivateThreads( int n ) {
+    if( !ArenaOfCount ) {
+        int m = MaxThreadCount();
+        ArenaOfCount.reset( new tbb::task_arena[m] );
+        for( int k=0; k<m; ++k )
+            ArenaOfCount[k].initialize(k+1);
+    }
+    CurrentArena = &ArenaOfCount[n-1];
+}
+
+tbb::task_arena& ThrottledArena() {
+    if( !CurrentArena )
+        ActivateThreads(1);
+    return *CurrentArena;
+}
+
+#elif USE_THREAD_POOL
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#if __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+//! Add the CPUs in a Linux CPU list such as "0-3,8-11" to cpus.
+static void ParseCpuList( const char* s, std::vector<int>& cpus ) {
+    while( *s>='0' && *s<='9' ) {
+        char* end;
+        int first = int(std::strtol( s, &end, 10 ));
+        int last = first;
+        if( *end=='-' )
+            last = int(std::strtol( end+1, &end, 10 ));
+        for( int c=first; c<=last; ++c )
+            cpus.push_back(c);
+        s = *end==',' ? end+1 : end;
+    }
+}
+
+//! CPUs of each NUMA node that has CPUs, as read once from sysfs.  Empty if the topology is unknown.
+static const std::vector<std::vector<int>>& NumaTopology() {
+    static const std::vector<std::vector<int>> nodes = []{
+        std::vector<std::vector<int>> result;
+#if __linux__
+        char line[4096];
+        std::vector<int> online;
+        if( FILE* f = std::fopen( "/sys/devices/system/node/online", "r" ) ) {
+            if( std::fgets( line, sizeof(line), f ) )
+                ParseCpuList( line, online );
+            std::fclose(f);
+        }
+        for( int n: online ) {
+            char path[64];
+            std::snprintf( path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n );
+            std::vector<int> cpus;
+            if( FILE* f = std::fopen( path, "r" ) ) {
+                if( std::fgets( line, sizeof(line), f ) )
+                    ParseCpuList( line, cpus );
+                std::fclose(f);
+            }
+            // Nodes with memory but no CPUs cannot run workers.
+            if( !cpus.empty() )
+                result.push_back(cpus);
+        }
+#endif /* __linux__ */
+        return result;
+    }();
+    return nodes;
+}
+
+int NumaNodeCount() {
+    return Max( 1, int(NumaTopology().size()) );
+}
+
+#if __linux__
+//! Set the affinity of thread t to the CPUs in cpus.
+static void PinThread( pthread_t t, const std::vector<int>& cpus ) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for( int c: cpus )
+        CPU_SET( c, &set );
+    pthread_setaffinity_np( t, sizeof(set), &set );
+}
+#endif /* __linux__ */
+
+//! A task in the thread pool.
+struct PoolTask {
+    std::function<void()> body;
+    TaskGroup* group;
+    //! NUMA node whose workers may run the task, or -1 for any thread.
+    int node;
+};
+
+//! Deque of tasks.  The owner pushes and pops at the back, and thieves steal from the front.
+class TaskQueue {
+    std::mutex myMutex;
+    std::deque<PoolTask> myTasks;
+public:
+    void push( PoolTask&& t ) {
+        std::lock_guard<std::mutex> lock(myMutex);
+        myTasks.push_back(std::move(t));
+    }
+    bool pop( PoolTask& t ) {
+        std::lock_guard<std::mutex> lock(myMutex);
+        if( myTasks.empty() ) return false;
+        t = std::move(myTasks.back());
+        myTasks.pop_back();
+        return true;
+    }
+    //! Steal the oldest task, unless it must run on a NUMA node other than node.
+    bool steal( PoolTask& t, int node ) {
+        std::lock_guard<std::mutex> lock(myMutex);
+        if( myTasks.empty() ) return false;
+        if( myTasks.front().node>=0 && myTasks.front().node!=node ) return false;
+        t = std::move(myTasks.front());
+        myTasks.pop_front();
+        return true;
+    }
+};
+
+//! Index of the calling thread's queue.  Zero for threads that are not in the pool.
+static thread_local int MyQueueIndex = 0;
+
+//! Work-stealing thread pool.
+/** Queue 0 is shared by all threads outside the pool.  Queue k>0 belongs to worker k.
+    Worker k runs tasks only if k<activeCount().  The other workers are parked.
+    With NUMA placement, a task tagged with a node runs only on workers pinned to that node,
+    and only active workers are given tagged tasks, so that every tagged task eventually runs. */
+class TaskPool {
+public:
+    TaskPool() :
+        mySize(Max(1,int(std::thread::hardware_concurrency()))),
+        myQueues(new TaskQueue[mySize]),
+        myNodeOfWorker(new std::atomic<int>[mySize]),
+        myQueuedCount(0),
+        mySleepCount(0),
+        myActiveCount(mySize),
+        myNextWorker(0),
+        myPlaced(false),
+        myStop(false)
+    {
+        for( int k=0; k<mySize; ++k )
+            myNodeOfWorker[k].store(-1);
+#if __linux__
+        sched_getaffinity( 0, sizeof(myProcessCpus), &myProcessCpus );
+#endif /* __linux__ */
+        for( int k=1; k<mySize; ++k )
+            myThreads.emplace_back( [this,k]{workerLoop(k);} );
+    }
+
+    ~TaskPool() {
+        {
+            std::lock_guard<std::mutex> lock(mySleepMutex);
+            myStop = true;
+        }
+        myWakeup.notify_all();
+        myUnpark.notify_all();
+        for( auto& t: myThreads )
+            t.join();
+    }
+
+    //! Number of threads, including one thread outside the pool.
+    int size() const {return mySize;}
+
+    //! Number of threads allowed to run tasks, including one thread outside the pool.
+    int activeCount() const {return myActiveCount.load();}
+
+    //! Allow only threads 0..n-1 to run tasks.
+    /** Parking or unparking a worker costs a condition variable notification, not a thread creation. */
+    void setActiveCount( int n ) {
+        Assert( 1<=n && n<=mySize );
+        {
+            std::lock_guard<std::mutex> lock(mySleepMutex);
+            myActiveCount.store(n);
+        }
+        myWakeup.notify_all();
+        myUnpark.notify_all();
+    }
+
+    void spawn( PoolTask&& t ) {
+        myQueues[MyQueueIndex].push(std::move(t));
+        myQueuedCount.fetch_add(1);
+        if( mySleepCount.load()>0 ) {
+            std::lock_guard<std::mutex> lock(mySleepMutex);
+            myWakeup.notify_one();
+        }
+    }
+
+    //! Spawn t on an active worker of the given node, or like spawn if there is none.
+    void spawnOnNode( int node, PoolTask&& t ) {
+        int k = 0;
+        if( myPlaced.load() ) {
+            // Choose among the active workers of the node in turn.
+            const int n = myActiveCount.load();
+            const int start = int(myNextWorker.fetch_add(1)%unsigned(n));
+            for( int i=0; i<n && k==0; ++i ) {
+                int j = (start+i)%n;
+                if( myNodeOfWorker[j].load()==node )
+                    k = j;
+            }
+        }
+        if( k==0 ) {
+            spawn(std::move(t));
+            return;
+        }
+        t.node = node;
+        myQueues[k].push(std::move(t));
+        myQueuedCount.fetch_add(1);
+        if( mySleepCount.load()>0 ) {
+            // Wake every sleeper, because only workers of the node can run the task.
+            std::lock_guard<std::mutex> lock(mySleepMutex);
+            myWakeup.notify_all();
+        }
+    }
+
+    //! Pin the workers to NUMA nodes, or unpin them.  Return true if they are pinned afterwards.
+    /** Must not be called while tasks are running. */
+    bool setPlacement( bool enable ) {
+#if __linux__
+        const std::vector<std::vector<int>>& nodes = NumaTopology();
+        const int n = int(nodes.size());
+        if( n<2 )
+            enable = false;
+        for( int k=1; k<mySize; ++k ) {
+            int node = -1;
+            if( enable ) {
+                // Alternate between nodes, so that a few active workers still cover every node.
+                node = k%n;
+                const std::vector<int>& cpus = nodes[node];
+                PinThread( myThreads[k-1].native_handle(), {cpus[k/n%cpus.size()]} );
+            } else {
+                pthread_setaffinity_np( myThreads[k-1].native_handle(), sizeof(myProcessCpus), &myProcessCpus );
+            }
+            myNodeOfWorker[k].store(node);
+        }
+        myPlaced.store(enable);
+#endif /* __linux__ */
+        return myPlaced.load();
+    }
+
+    bool placed() const {return myPlaced.load();}
+
+    //! Run one task if one can be found.  Return true if a task was run.
+    bool runOne() {
+        PoolTask t;
+        int k = MyQueueIndex;
+        const int node = myNodeOfWorker[k].load();
+        bool found = myQueues[k].pop(t);
+        for( int i=1; !found && i<mySize; ++i )
+            found = myQueues[(k+i)%mySize].steal(t,node);
+        if( !found )
+            return false;
+        myQueuedCount.fetch_sub(1);
+        t.body();
+        t.group->myPending.fetch_sub(1,std::memory_order_release);
+        return true;
+    }
+
+private:
+    void workerLoop( int k ) {
+        MyQueueIndex = k;
+        for(;;) {
+            if( k<myActiveCount.load() && runOne() )
+                continue;
+            if( k<myActiveCount.load() && myQueuedCount.load()>0 ) {
+                // The queued tasks are for another NUMA node, or are being pushed.
+                std::this_thread::yield();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(mySleepMutex);
+            if( k<myActiveCount.load() ) {
+                // Sleep until there is work
+                mySleepCount.fetch_add(1);
+                myWakeup.wait( lock, [this,k]{return myStop || myQueuedCount.load()>0 || k>=myActiveCount.load();} );
+                mySleepCount.fetch_sub(1);
+            } else {
+                // Park until reactivated
+                myUnpark.wait( lock, [this,k]{return myStop || k<myActiveCount.load();} );
+            }
+            if( myStop )
+                return;
+        }
+    }
+
+    const int mySize;
+    std::unique_ptr<TaskQueue[]> myQueues;
+    //! NUMA node to which each worker is pinned, or -1.  Entry 0 is for threads outside the pool, which are never pinned.
+    std::unique_ptr<std::atomic<int>[]> myNodeOfWorker;
+    std::vector<std::thread> myThreads;
+    //! Number of tasks sitting in queues.
+    std::atomic<int> myQueuedCount;
+    //! Number of active workers waiting on myWakeup.
+    std::atomic<int> mySleepCount;
+    std::atomic<int> myActiveCount;
+    //! Rotates the choice of worker in spawnOnNode.
+    std::atomic<unsigned> myNextWorker;
+    std::atomic<bool> myPlaced;
+#if __linux__
+    //! Affinity of the process when the pool started, which unpinned workers get back.
+    cpu_set_t myProcessCpus;
+#endif /* __linux__ */
+    std::mutex mySleepMutex;
+    //! Signaled when there is new work for active workers.
+    std::condition_variable myWakeup;
+    //! Signaled when parked workers might be reactivated.
+    std::condition_variable myUnpark;
+    bool myStop;
+};
+
+static TaskPool& ThePool() {
+    static TaskPool pool;
+    return pool;
+}
+
+void TaskGroup::run( std::function<void()> f ) {
+    myPending.fetch_add(1);
+    ThePool().spawn( PoolTask{std::move(f), this, -1} );
+}
+
+void TaskGroup::runOnNode( int node, std::function<void()> f ) {
+    myPending.fetch_add(1);
+    ThePool().spawnOnNode( node, PoolTask{std::move(f), this, -1} );
+}
+
+bool SetNumaPlacement( bool enable ) {
+    return ThePool().setPlacement(enable);
+}
+
+bool NumaPlacement() {
+    return ThePool().placed();
+}
+
+bool BindToNumaNode( int node ) {
+#if __linux__
+    const std::vector<std::vector<int>>& nodes = NumaTopology();
+    if( nodes.size()<2 )
+        return false;
+    Assert( 0<=node && node<int(nodes.size()) );
+    PinThread( pthread_self(), nodes[node] );
+    return true;
+#else
+    return false;
+#endif /* __linux__ */
+}
+
+void RunChunksOnNodes( int n, const std::function<void(int)>& f ) {
+    if( !NumaPlacement() ) {
+        for( int i=0; i<n; ++i )
+            f(i);
+        return;
+    }
+#if __linux__
+    std::vector<std::thread> threads;
+    const std::vector<std::vector<int>>& nodes = NumaTopology();
+    for( int node=0; node<int(nodes.size()); ++node )
+        threads.emplace_back( [&f,&nodes,n,node]{
+            PinThread( pthread_self(), nodes[node] );
+            for( int i=0; i<n; ++i )
+                if( NumaNodeOfChunk(i,n)==node )
+                    f(i);
+        } );
+    for( auto& t: threads )
+        t.join();
+#endif /* __linux__ */
+}
+
+void TaskGroup::wait() {
+    while( myPending.load(std::memory_order_acquire)>0 )
+        if( !ThePool().runOne() )
+            std::this_thread::yield();
+}
+
+static int MaxThreadCount() {
+    return ThePool().size();
+}
+
+static void ActivateThreads( int n ) {
+    ThePool().setActiveCount(n);
+}
+
+#endif /* USE_THREAD_POOL */
+
+#if HAVE_WORKER_THROTTLE
 
 // There is a wide variance in the total time to compute and present a frame with DirectX.
 // Hence to get a more reliable estimate of BusyFrac, the code estimates
@@ -12,19 +430,14 @@ static double TimeQueue[TimeQueueSize];
 static unsigned TimeQueueIndex;             // Index into TimeQueueIndex
 static float LastBusyFrac;
 
-static const float BusyFracSlow = 0.80f;    // The acceptable BusyFrac 
-static const float BusyFracFast = 0.50f;    // The acceptable BusyFrac 
-static const int LookBack = 15;             // How many frames to look back
-static const int MissTolerance = 3;         // How many misses to tolerate in a LookBack period
-static const int Settle = 15;               // Number of frames to ignore after changing thread count
+static ThrottleSettings TheThrottleSettings;
 
 static unsigned WasSlow;
 static unsigned WasFast;
 
-static int SettleCount = Settle;
+static int SettleCount = TheThrottleSettings.settle;
 
-static int ThreadCount = 1;
-static tbb::task_scheduler_init TheTaskSchedulerInit(ThreadCount);
+static int ThreadCount = 0;
 
 static int BitCount(unsigned n) {
     int k = 0;
@@ -32,15 +445,34 @@ static int BitCount(unsigned n) {
     return k;
 }
 
+static void SetThreadCount( int n ) {
+    Assert(1<=n && n<=MaxThreadCount());
+    if( TheThrottleSettings.log && ThreadCount>0 )
+        std::fprintf( stderr, "Seismic Duck: changing thread count from %d to %d (busy fraction %.2f)\n", ThreadCount, n, LastBusyFrac );
+    ThreadCount = n;
+    ActivateThreads(n);
+}
+
 static void BumpThreadCount(int delta) {
-    Assert(1<=ThreadCount+delta);
-    Assert(ThreadCount+delta <= TheTaskSchedulerInit.default_num_threads());
-    TheTaskSchedulerInit.terminate();
-    ThreadCount += delta;
-    TheTaskSchedulerInit.initialize(ThreadCount);
+    SetThreadCount(ThreadCount+delta);
     WasSlow = 0;
     WasFast = 0;
-    SettleCount = Settle;
+    SettleCount = TheThrottleSettings.settle;
+}
+
+//! Start with one thread, and let ThrottleWorkers add more as needed.
+static bool ThreadCountInitialized = (SetThreadCount(1), true);
+
+ThrottleSettings GetThrottleSettings() {
+    return TheThrottleSettings;
+}
+
+void SetThrottleSettings( const ThrottleSettings& settings ) {
+    Assert(0<=settings.busyFracFast && settings.busyFracFast<=settings.busyFracSlow);
+    Assert(0<settings.lookBack && settings.lookBack<32);
+    Assert(0<=settings.missTolerance && settings.missTolerance<settings.lookBack);
+    Assert(0<=settings.settle);
+    TheThrottleSettings = settings;
 }
 
 void ThrottleWorkers(double t0, double t1) {
@@ -52,15 +484,16 @@ void ThrottleWorkers(double t0, double t1) {
     LastBusyFrac = busyFrac;
 
     // Act on it
+    const ThrottleSettings& s = TheThrottleSettings;
     if(SettleCount==0) {
-        WasSlow = WasSlow<<1 | unsigned(busyFrac>BusyFracSlow);
-        WasFast = WasFast<<1 | unsigned(busyFrac<BusyFracFast);
-        int j = BitCount(WasFast & (1<<LookBack)-1);
-        int k = BitCount(WasSlow & (1<<LookBack)-1);
-        if(k>MissTolerance && ThreadCount<TheTaskSchedulerInit.default_num_threads()) {
+        WasSlow = WasSlow<<1 | unsigned(busyFrac>s.busyFracSlow);
+        WasFast = WasFast<<1 | unsigned(busyFrac<s.busyFracFast);
+        int j = BitCount(WasFast & (1u<<s.lookBack)-1);
+        int k = BitCount(WasSlow & (1u<<s.lookBack)-1);
+        if(k>s.missTolerance && ThreadCount<MaxThreadCount()) {
             // Running slower than threshold enough times that it's worth trying more threads.
             BumpThreadCount(1);
-        } else if(k==0 && j >= LookBack-MissTolerance && ThreadCount>1) {
+        } else if(k==0 && j >= s.lookBack-s.missTolerance && ThreadCount>1) {
             // Running faster than necessary most of the time, and never missing a deadline, so throttle back some.
             BumpThreadCount(-1);
         }
@@ -73,6 +506,16 @@ int WorkerCount() {
     return ThreadCount;
 }
 
+int MaxWorkerCount() {
+    return MaxThreadCount();
+}
+
+void SetWorkerCount( int n ) {
+    SetThreadCount(n);
+}
+
 float BusyFrac() {
     return LastBusyFrac;
 }
+
+#endif /* HAVE_WORKER_THROTTLE */
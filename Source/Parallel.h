@@ -17,18 +17,76 @@
  Parallel control structures for Seismic Duck.
 *******************************************************************************/
 
+#include <cstddef>
+#include <functional>
+
 #if __INTEL_COMPILER>=1200
 #define USE_CILK 1
 #define USE_ARRAY_NOTATION 1
 #define USE_TBB 0
+#elif defined(USE_TBB)
+// Use whatever value was supplied on command line.
 #else
 #define USE_TBB 1
 #endif
 
+// Builds without TBB or Cilk use a portable std::thread pool, unless USE_THREAD_POOL=0 is
+// supplied on the command line, in which case they are serial.
+#if !USE_CILK && !USE_TBB && !defined(USE_THREAD_POOL)
+#define USE_THREAD_POOL 1
+#endif
+
+#if USE_THREAD_POOL
+//! Number of NUMA nodes that placement can use.  1 if the host has one node or placement is unsupported.
+int NumaNodeCount();
+
+//! Enable or disable NUMA placement.  Return true if placement is on afterwards.
+/** Placement pins each worker of the thread pool to a CPU, alternating between nodes so that
+    a few active workers still cover every node, and makes parallel_ghost_cell run chunk i of n
+    only on workers of node NumaNodeOfChunk(i,n).  It is on only if NumaNodeCount()>1. */
+bool SetNumaPlacement( bool enable );
+
+//! True if NUMA placement is on.
+bool NumaPlacement();
+
+//! Call f(i) for i in [0,n), with each call on a thread pinned to node NumaNodeOfChunk(i,n).
+/** For first-touch placement of memory.  The threads are outside the pool, so that they run
+    regardless of how many workers are active.  Calls f serially if placement is off. */
+void RunChunksOnNodes( int n, const std::function<void(int)>& f );
+
+//! Restrict the calling thread, and threads that it starts later, to the CPUs of the given node.
+/** For a process that owns one node.  Call before anything starts the thread pool.  Return false
+    if NumaNodeCount()==1, in which case nothing is changed. */
+bool BindToNumaNode( int node );
+#else
+inline int NumaNodeCount() {return 1;}
+inline bool SetNumaPlacement( bool ) {return false;}
+inline bool NumaPlacement() {return false;}
+inline void RunChunksOnNodes( int n, const std::function<void(int)>& f ) {
+    for( int i=0; i<n; ++i )
+        f(i);
+}
+inline bool BindToNumaNode( int ) {return false;}
+#endif /* USE_THREAD_POOL */
+
+//! Node on which NUMA placement puts chunk i of n.
+/** Consecutive chunks share a node, so that panels of adjacent rows do too. */
+inline int NumaNodeOfChunk( int i, int n ) {
+    return i*NumaNodeCount()/n;
+}
+
 #if USE_CILK
 
 #include <cilk/cilk.h>
 
+//! Evaluate f() and g() in parallel.
+template<typename F, typename G>
+void ParallelInvoke( const F& f, const G& g ) {
+    cilk_spawn f();
+    g();
+    cilk_sync;
+}
+
 #if 1
 //! Cilk implementation of one-dimensional ghost cell pattern using cilk_for.
 template<typename Op>
@@ -66,58 +124,166 @@ void parallel_ghost_cell( size_t n, const Op& op ) {
 };
 #endif
 
-#elif USE_TBB
+#elif USE_TBB || USE_THREAD_POOL
+
+//! Divide and conquer evaluation of chunks [lower,upper) for parallel_ghost_cell.
+/** Each split exchanges borders along the split, spawns the upper subgroup into group g,
+    and continues with the lower subgroup. */
+template<typename TaskGroup, typename Op>
+void parallel_ghost_cell_task( TaskGroup& g, int lower, int upper, const Op& op ) {
+    while( lower+1!=upper ) {
+        // Find place to split group of chunks into two subgroups
+        int mid=lower+((upper-lower)>>1);
+        // Exchange border information along the split
+        op.exchangeBorders(mid);
+        // Evaluate the two subgroups in parallel.
+        g.run( [&g,mid,upper,&op]{parallel_ghost_cell_task( g, mid, upper, op );} );
+        upper=mid;
+    }
+    op.updateInterior(lower);
+}
+
+#if USE_TBB
 
 #include "tbb/parallel_invoke.h"
+#include "tbb/task_arena.h"
+#include "tbb/task_group.h"
 
 #define HAVE_WORKER_THROTTLE 1
 
-//! TBB task for parallel_ghost_cell
+//! TBB divide and conquer implementation of one-dimensional ghost cell pattern.
+/** n is the number of chunks, numbered 0..n-1.
+    Class op must have two methods:
+        op.exchangeBorders(i): exchange border information between chunks i-1 and i.
+        op.updateInterior(i): update chunk i
+*/
 template<typename Op>
-class ghost_cell_task: public tbb::task {
-    int lower, upper;
-    const Op op;
-    tbb::task* execute() override {
-        if( lower+1==upper ) {
-            op.updateInterior(lower);
-            return nullptr;
-        } else {
-            // Find place to split group of chunks into two subgroups
-            int mid=lower+((upper-lower)>>1);
-            // Exchange border information along the split
-            op.exchangeBorders(mid);
-            // Evaluate the two subgroups in parallel.
-            task& c = *new( allocate_continuation() ) tbb::empty_task();
-            // Continuation implicitly waits on 2 children.
-            c.set_ref_count(2);
-            // Left child
-            spawn(*new( c.allocate_child() ) ghost_cell_task(lower,mid,op));
-            // Recycle self as right child and use TBB idiom for "tail call" of a task.
-            recycle_as_child_of(c);
-            lower=mid;
-            return this;
-        }
+void parallel_ghost_cell( size_t n, const Op& op ) {
+    if( n>0 ) {
+        tbb::task_group g;
+        parallel_ghost_cell_task( g, 0, int(n), op );
+        g.wait();
     }
+};
+
+//! Evaluate f() and g() in parallel.
+template<typename F, typename G>
+void ParallelInvoke( const F& f, const G& g ) {
+    tbb::parallel_invoke( f, g );
+}
+
+//! Arena whose concurrency is the thread count chosen by ThrottleWorkers.
+/** Parallel work should be run via ThrottledArena().execute(...). */
+tbb::task_arena& ThrottledArena();
+
+#else /* USE_THREAD_POOL */
+
+#include <atomic>
+
+//! Group of tasks run by the work-stealing thread pool in Parallel.cpp.
+/** Substitute for tbb::task_group, for builds that have neither TBB nor Cilk. */
+class TaskGroup {
 public:
-    //! Construct task that evaluates group of chunks [l..u) using op_.
-    ghost_cell_task( int l, int u, const Op& op_ ) : lower(l), upper(u), op(op_) {}
+    TaskGroup() : myPending(0) {}
+    TaskGroup( const TaskGroup& ) = delete;
+    void operator=( const TaskGroup& ) = delete;
+
+    //! Spawn task that runs f.
+    void run( std::function<void()> f );
+
+    //! Spawn task that runs f on an active worker of the given NUMA node.
+    /** Runs f like run(f) if placement is off or no worker of the node is active. */
+    void runOnNode( int node, std::function<void()> f );
+
+    //! Wait for all tasks in the group to finish, running tasks from the pool while waiting.
+    void wait();
+private:
+    //! Number of tasks spawned but not yet finished.
+    std::atomic<int> myPending;
+    friend class TaskPool;
 };
 
-//! TBB divide and conquer implementation of one-dimensional ghost cell pattern.
+//! Evaluate f() and g() in parallel.
+template<typename F, typename G>
+void ParallelInvoke( const F& f, const G& g ) {
+    TaskGroup tg;
+    tg.run(f);
+    g();
+    tg.wait();
+}
+
+//! Evaluate f(), g(), and h() in parallel.
+template<typename F, typename G, typename H>
+void ParallelInvoke( const F& f, const G& g, const H& h ) {
+    TaskGroup tg;
+    tg.run(f);
+    tg.run(g);
+    h();
+    tg.wait();
+}
+
+//! Thread pool divide and conquer implementation of one-dimensional ghost cell pattern.
+/** Same contract as the TBB version.  With NUMA placement, exchanges all borders first,
+    and then runs chunk i on node NumaNodeOfChunk(i,n), so that it stays there from call to call. */
 template<typename Op>
 void parallel_ghost_cell( size_t n, const Op& op ) {
     if( n>0 ) {
-        tbb::task* t = new( tbb::task::allocate_root() ) ghost_cell_task<Op>(0,int(n),op);
-        tbb::task::spawn_root_and_wait(*t);
+        TaskGroup g;
+        if( NumaPlacement() ) {
+            for( int i=1; i<int(n); ++i )
+                op.exchangeBorders(i);
+            for( int i=0; i<int(n); ++i )
+                g.runOnNode( NumaNodeOfChunk(i,int(n)), [&op,i]{op.updateInterior(i);} );
+        } else {
+            parallel_ghost_cell_task( g, 0, int(n), op );
+        }
+        g.wait();
     }
 };
 
+#define HAVE_WORKER_THROTTLE 1
+
+#endif /* USE_THREAD_POOL */
+
+#if HAVE_WORKER_THROTTLE
+
+//! Parameters for the policy used by ThrottleWorkers.
+struct ThrottleSettings {
+    //! A frame is slow if its busy fraction exceeds this value.
+    float busyFracSlow = 0.80f;
+    //! A frame is fast if its busy fraction is below this value.
+    float busyFracFast = 0.50f;
+    //! How many frames to look back.  Must be less than 32.
+    int lookBack = 15;
+    //! How many slow frames to tolerate in a lookBack period.
+    int missTolerance = 3;
+    //! Number of frames to ignore after changing thread count.
+    int settle = 15;
+    //! If true, report changes in thread count on stderr.
+    bool log = true;
+};
+
+ThrottleSettings GetThrottleSettings();
+void SetThrottleSettings( const ThrottleSettings& settings );
+
+//! Adjust number of threads, given the start time t0 and finish time t1 of the most recent frame.
+void ThrottleWorkers(double t0, double t1);
+
 //! Return most recent estimate of what fraction of time was spend computing. 
 float BusyFrac();
 
-// Return number of worker threads
+// Return number of threads allowed to run parallel work, including the main thread.
 int WorkerCount();
 
+//! Return maximum number of threads that can run parallel work, including the main thread.
+int MaxWorkerCount();
+
+//! Set number of threads allowed to run parallel work, including the main thread.
+/** For programs that do not call ThrottleWorkers. */
+void SetWorkerCount( int n );
+
+#endif /* HAVE_WORKER_THROTTLE */
+
 #else
 
 //! Serial implementation of parallel_ghost_cell
@@ -135,4 +301,11 @@ void parallel_ghost_cell( size_t n, const Op& op ) {
     }
 }
 
+//! Serial implementation of ParallelInvoke.
+template<typename F, typename G>
+void ParallelInvoke( const F& f, const G& g ) {
+    f();
+    g();
+}
+
 #endif /* serial */
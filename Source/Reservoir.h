@@ -19,7 +19,8 @@
 
 //! Reservoir coordinate system uses u for horizonal and v for vertical.
 /** The grid is coarser than the pixel (x,y) coordinates by factor RESERVOIR_SCALE.
-    The origin is the upper left corner of the hidden border. */
+    The origin is the upper left corner of the hidden border.  Only the game has a reservoir, so its limits
+    follow the visible wavefield, not GRID_WIDTH_MAX and GRID_HEIGHT_MAX. */
 const int RESERVOIR_U_MAX = (WAVEFIELD_VISIBLE_WIDTH_MAX+2*HIDDEN_BORDER_SIZE) / RESERVOIR_SCALE;
 const int RESERVOIR_V_MAX = (WAVEFIELD_VISIBLE_HEIGHT_MAX+2*HIDDEN_BORDER_SIZE) / RESERVOIR_SCALE; 
 
@@ -14,7 +14,7 @@
  */
 
 /******************************************************************************
- Inclusion of SSE intrinsics.
+ Inclusion of SSE intrinsics, and run-time detection of wider instruction sets.
 *******************************************************************************/
 
 #if defined(_MSC_VER)
@@ -27,3 +27,63 @@
 #if USE_SSE
 #include <xmmintrin.h>
 #endif /* USE_SSE */
+
+// AVX2 and AVX-512 code is compiled into every build that uses SSE, but only executed
+// if SimdLevelOfHost() says that the processor and operating system support it.
+#if USE_SSE && (__clang_major__>=4 || !__clang__ && __GNUC__>=5 || _MSC_VER>=1912)
+#define USE_AVX 1
+#endif
+
+#if USE_AVX
+#include <immintrin.h>
+#if _MSC_VER
+#include <intrin.h>
+#define TARGET_AVX /* MSVC permits intrinsics for any instruction set */
+#define TARGET_AVX2
+#define TARGET_AVX512
+#else
+#include <cpuid.h>
+// TARGET_AVX omits FMA, for code that must round exactly like scalar code.
+#define TARGET_AVX __attribute__((target("avx")))
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx2,fma")))
+#endif
+
+//! Widest SIMD instruction set that may be used.
+enum SimdLevel {
+    SIMD_SSE,           // 4 floats
+    SIMD_AVX2,          // 8 floats, with FMA
+    SIMD_AVX512         // 16 floats, with FMA
+};
+
+//! Return widest SIMD level supported by both the processor and the operating system.
+inline SimdLevel SimdLevelOfHost() {
+    unsigned r[4];      // eax, ebx, ecx, edx
+    unsigned long long xcr0 = 0;
+#if _MSC_VER
+    __cpuidex( (int*)r, 1, 0 );
+#else
+    __cpuid_count( 1, 0, r[0], r[1], r[2], r[3] );
+#endif
+    const bool fma = r[2]>>12&1, osxsave = r[2]>>27&1, avx = r[2]>>28&1;
+    if( !(fma && osxsave && avx) )
+        return SIMD_SSE;
+#if _MSC_VER
+    xcr0 = _xgetbv(0);
+    __cpuidex( (int*)r, 7, 0 );
+#else
+    unsigned lo, hi;
+    __asm__( "xgetbv" : "=a"(lo), "=d"(hi) : "c"(0) );
+    xcr0 = (unsigned long long)hi<<32 | lo;
+    __cpuid_count( 7, 0, r[0], r[1], r[2], r[3] );
+#endif
+    // Operating system must save XMM and YMM state (bits 1 and 2) for AVX2,
+    // and additionally opmask and ZMM state (bits 5, 6, and 7) for AVX-512.
+    const bool avx2 = r[1]>>5&1, avx512f = r[1]>>16&1;
+    if( !avx2 || (xcr0&0x6)!=0x6 )
+        return SIMD_SSE;
+    if( avx512f && (xcr0&0xE6)==0xE6 )
+        return SIMD_AVX512;
+    return SIMD_AVX2;
+}
+#endif /* USE_AVX */
@@ -41,3 +41,96 @@ void WriteToTraceFile( const char * filename, int line, const char * format, ...
     }
 }
 #endif /* TRACING */
+
+#if TRACE_EVENTS
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+std::atomic<bool> TraceEventsAreEnabled;
+
+//! Events recorded by one thread.
+class TraceBuffer {
+public:
+    struct Event {
+        const char* name;
+        int arg;
+        long long begin, end;
+    };
+    //! Number of events retained.  Must be power of two.
+    static const unsigned capacity = 1<<14;
+    //! Total number of events ever recorded.  Event k is in slot k%capacity.
+    unsigned long long count;
+    Event event[capacity];
+    TraceBuffer() : count(0) {}
+};
+
+//! Protects TraceBufferList.
+static std::mutex TraceBufferMutex;
+
+//! All buffers ever created, in order of creation.  The index is used as the thread id.
+static std::vector<TraceBuffer*> TraceBufferList;
+
+//! Buffer for the current thread, or nullptr if it has not yet recorded an event.
+static thread_local TraceBuffer* MyTraceBuffer;
+
+long long TraceEventScope::now() {
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+void TraceEventScope::record() const {
+    TraceBuffer* b = MyTraceBuffer;
+    if( !b ) {
+        // Buffers are never freed, because the threads in the pool live as long as the program.
+        b = MyTraceBuffer = new TraceBuffer;
+        std::lock_guard<std::mutex> lock(TraceBufferMutex);
+        TraceBufferList.push_back(b);
+    }
+    TraceBuffer::Event& e = b->event[b->count++ & (TraceBuffer::capacity-1)];
+    e.name = myName;
+    e.arg = myArg;
+    e.begin = myBegin;
+    e.end = now();
+}
+
+void TraceEventsEnable( bool enable ) {
+    TraceEventsAreEnabled.store(enable);
+}
+
+bool TraceEventsWrite( const char* filename ) {
+    FILE* f = fopen( filename, "w" );
+    if( !f )
+        return false;
+    std::lock_guard<std::mutex> lock(TraceBufferMutex);
+    // Make timestamps relative to the earliest retained event, so that they are readable.
+    long long origin = 0;
+    for( const TraceBuffer* b: TraceBufferList ) {
+        unsigned long long first = b->count>TraceBuffer::capacity ? b->count-TraceBuffer::capacity : 0;
+        if( first<b->count ) {
+            long long t = b->event[first & (TraceBuffer::capacity-1)].begin;
+            if( origin==0 || t<origin )
+                origin = t;
+        }
+    }
+    fprintf( f, "{\"traceEvents\":[\n" );
+    const char* separator = "";
+    for( size_t tid=0; tid<TraceBufferList.size(); ++tid ) {
+        const TraceBuffer* b = TraceBufferList[tid];
+        fprintf( f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+                 separator, int(tid), int(tid) );
+        separator = ",\n";
+        unsigned long long first = b->count>TraceBuffer::capacity ? b->count-TraceBuffer::capacity : 0;
+        for( unsigned long long k=first; k<b->count; ++k ) {
+            const TraceBuffer::Event& e = b->event[k & (TraceBuffer::capacity-1)];
+            fprintf( f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                     separator, e.name, int(tid), (e.begin-origin)*1E-3, (e.end-e.begin)*1E-3 );
+            if( e.arg>=0 )
+                fprintf( f, ",\"args\":{\"arg\":%d}", e.arg );
+            fprintf( f, "}" );
+        }
+    }
+    fprintf( f, "\n]}\n" );
+    return fclose(f)==0;
+}
+#endif /* TRACE_EVENTS */
@@ -46,4 +46,64 @@ extern void WriteToTraceFile( const char * filename, int line, const char * form
 #define Trace1(fmt,x) /**/
 #define Trace2(fmt,y) /**/
 #endif /*!TRACING*/
+
+// Timeline of events, written in Chrome trace format for viewing with about:tracing.
+// Each thread records events in its own ring buffer, so recording never takes a lock.
+// Recording is off until TraceEventsEnable(true) is called.
+// Examples:
+//     TraceEvent("Seismogram");              // Record interval from here to end of scope
+//     TraceEvent1("updateInterior",p);       // Ditto, with integer argument
+#ifdef TRACE_EVENTS
+// Use whatever value was supplied on command line.
+#else
+// Default value
+#define TRACE_EVENTS 1
+#endif /* TRACE_EVENTS */
+
+#if TRACE_EVENTS
+#include <atomic>
+
+extern std::atomic<bool> TraceEventsAreEnabled;
+
+//! Records the interval from its construction to its destruction.
+class TraceEventScope {
+    const char* myName;
+    int myArg;
+    long long myBegin;
+public:
+    //! name must point to a string with static lifetime.  arg<0 means "no argument".
+    TraceEventScope( const char* name, int arg=-1 ) : myName(nullptr) {
+        if( TraceEventsAreEnabled.load(std::memory_order_relaxed) ) {
+            myName = name;
+            myArg = arg;
+            myBegin = now();
+        }
+    }
+    ~TraceEventScope() {
+        if( myName )
+            record();
+    }
+    TraceEventScope( const TraceEventScope& ) = delete;
+    void operator=( const TraceEventScope& ) = delete;
+private:
+    static long long now();
+    void record() const;
+};
+
+//! Turn recording of events on or off.
+void TraceEventsEnable( bool enable );
+
+//! Write recorded events to file in Chrome trace format.  Return true if successful.
+/** Should be called only while no other thread is recording events, e.g. between frames. */
+bool TraceEventsWrite( const char* filename );
+
+#define TRACE_EVENT_CONCAT2(a,b) a##b
+#define TRACE_EVENT_CONCAT(a,b) TRACE_EVENT_CONCAT2(a,b)
+#define TraceEvent(name) TraceEventScope TRACE_EVENT_CONCAT(traceEventScope,__LINE__)(name)
+#define TraceEvent1(name,arg) TraceEventScope TRACE_EVENT_CONCAT(traceEventScope,__LINE__)(name,arg)
+#else
+#define TraceEvent(name) /**/
+#define TraceEvent1(name,arg) /**/
+#endif /* TRACE_EVENTS */
+
 #endif /*TraceLib_H*/
@@ -27,9 +27,26 @@
 #include "Utility.h"
 #include "SSE.h"
 #include "Parallel.h"
+#include "TraceLib.h"
+#include "AlignedArray.h"
+#include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <cfloat>
+#include <climits>
 #include <cstring>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+#if !_WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #if __GNUC__
 #define CACHE_ALIGN(x) x __attribute__ ((aligned (16)))
@@ -46,20 +63,57 @@
 //! If non-zero, enables optimization calculations for tiles with homogeneous rock properties.
 #define OPTIMIZE_HOMOGENEOUS_TILES 1
 
-static const int NUM_PANEL_MAX = 16;
+//! If non-zero, WavefieldInitialize times candidate tilings on the host and keeps the fastest.
+#define AUTOTUNE_TILING 1
+
+//! If non-zero, skip interior tiles in regions where the wavefield is quiescent.
+#define SKIP_QUIESCENT_TILES 1
+
+//! If non-zero, a shot into a quiescent wavefield updates only tiles that its wave could have reached.
+#define RESTRICT_TO_CAUSAL_CONE 1
+
+//! If non-zero, the AVX2 and AVX-512 kernels for heterogeneous tiles unpack A and B from RockMap instead of loading them.
+#define COMPACT_ROCK_COEFFICIENTS 1
 
-//! Number of panels
-static int NumPanel = 10;
+//! If non-zero, store Vx, Vy, and U as 16-bit IEEE floats, which halves their memory traffic.
+/** Arithmetic remains 32-bit, and A, B, and the PML "psi" fields remain 32-bit.
+    Requires a processor with F16C, so the build must enable it (e.g. -mf16c).
+    Costs accuracy; see the -c option of the gather tool for a way to measure how much. */
+#ifndef HALF_FIELDS
+#define HALF_FIELDS 0
+#endif
+
+#if HALF_FIELDS && !USE_AVX
+#error HALF_FIELDS requires the AVX kernels
+#endif
+#if HALF_FIELDS && defined(__GNUC__) && !defined(__F16C__)
+#error HALF_FIELDS requires compiling with F16C enabled
+#endif
 
-//! Number of timesteps per video frame.
-static int PumpFactor = 3;
+//! Maximum number of panels.  Large grids need more panels to keep many cores busy.
+static const int NUM_PANEL_MAX = LARGE_GRID ? 64 : 16;
 
-static int TileHeight = 7;    // Must be <= 15.
-static int TileWidth = 16*7;  // Must be multiple of 8 and <= 8*63
+//! Largest number of rows that a disturbance crosses per timestep, for any spatial order.  Sizes the overlap zones.
+static const int STENCIL_REACH_MAX = 3;
 
 //! Size of damping region, in pixels.
 const int DampSize = 16;
 
+#if SKIP_QUIESCENT_TILES
+//! Minimum height of a block in the activity map, in rows.
+/** A wave moves at most PumpFactor rows or columns per frame, so blocks at least that big
+    let a one-block halo wake every tile that the wave can reach in the next frame.  The fourth-order
+    stencil moves it up to three times as far, so InitializeActivityMap scales the height by StencilReach. */
+const int ActivityBlockHeight = 8;
+
+//! Width of a block in the activity map, in columns.
+const int ActivityBlockWidth = 64;
+
+//! Magnitude of U, Vx, or Vy above which a block is active.
+/** Far above the noise from InitializeFDTD, and far below one step of the color lookup in WavefieldDrawPanel. */
+const float ActivityThreshold = 1E-3f;
+#endif /* SKIP_QUIESCENT_TILES */
+
 //! Velocity of various materials.
 /** The product of LFunc[k]*MFunc[k] must not exceed 0.5, otherwise runaway positive feedback occurs.
     The values here are correctly proportioned for water and shale.
@@ -68,84 +122,477 @@ const int DampSize = 16;
 static const float MofRock[RockTypeMax+1] = {0.50f,  0.3536f, 0.25f};
 static const float LofRock[RockTypeMax+1] = {0.25f,  0.7071f, 2.00f};
 
-static int WavefieldWidth;
-
-//! Equal to viewable height plus 1 for free surface plus DampSize for bottom PML region
-/** Does not inlude overlap zones. */
-static int WavefieldHeight;
-
 //! Maximum allowed width of wavefield, including left and right PML regions.
-static const int WavefieldWidthMax = HIDDEN_BORDER_SIZE + WAVEFIELD_VISIBLE_WIDTH_MAX + HIDDEN_BORDER_SIZE;
+static const int WavefieldWidthMax = HIDDEN_BORDER_SIZE + GRID_WIDTH_MAX + HIDDEN_BORDER_SIZE;
 
 //! Maximum allowed hight of wavefield, including PML region on bottom.
 /** The 1 is for the top read-only row of grid points.
-    The (2*PUMP_FACTOR_MAX+1)*(NUM_PANEL_MAX-1) is for the overlap zones between adjacent regions. */
-static const int WavefieldHeightMax = 1 + WAVEFIELD_VISIBLE_HEIGHT_MAX + HIDDEN_BORDER_SIZE + (2*PUMP_FACTOR_MAX+1)*(NUM_PANEL_MAX-1);
+    The (2*STENCIL_REACH_MAX*PUMP_FACTOR_MAX+2)*(NUM_PANEL_MAX-1) is for the overlap zones between adjacent regions,
+    as laid out by WavefieldState::ZoneSeparation for the widest stencil. */
+static const int WavefieldHeightMax = 1 + GRID_HEIGHT_MAX + HIDDEN_BORDER_SIZE + (2*STENCIL_REACH_MAX*PUMP_FACTOR_MAX+2)*(NUM_PANEL_MAX-1);
 
-//! Array of rock types, with two bits per element.
-static CACHE_ALIGN( byte RockMap[WavefieldHeightMax][WavefieldWidthMax>>2] );
+typedef AlignedArray2D<float> FieldType;
 
-typedef CACHE_ALIGN( float FieldType[WavefieldHeightMax][WavefieldWidthMax] );
+#if HALF_FIELDS
+//! 16-bit IEEE float in memory, which converts to and from float.
+/** Lets scalar code written for float fields operate on half-precision fields. */
+class HalfFloat {
+    unsigned short bits;
+public:
+    HalfFloat() = default;
+    HalfFloat( float x ) : bits(_cvtss_sh(x,_MM_FROUND_TO_NEAREST_INT)) {}
+    operator float() const {return _cvtsh_ss(bits);}
+    HalfFloat& operator+=( float x ) {return *this = float(*this)+x;}
+};
 
-static FieldType Vx, Vy, U, A, B;
+//! Element type of Vx, Vy, and U.
+typedef HalfFloat WaveValue;
+#else
+typedef float WaveValue;
+#endif /* HALF_FIELDS */
 
-//! "Psi" fields for left and right PML regions.
-static CACHE_ALIGN( float Pl[WavefieldHeightMax][DampSize] );
-static CACHE_ALIGN( float Pr[WavefieldHeightMax][DampSize] );
+typedef AlignedArray2D<WaveValue> WaveFieldType;
 
-//! "Psi" field for bottom PML region.
-/** Overlaps left and right PML regions on corners. */
-static CACHE_ALIGN( float Pb[DampSize][WavefieldWidthMax] );
+//! Declare local views of the field arrays of WavefieldState s with the same names.
+/** Used by the kernels so that the compiler can keep the array bases in registers. */
+#define LOCAL_FIELDS(s) const WaveFieldType::View Vx((s).Vx), Vy((s).Vy), U((s).U); const FieldType::View A((s).A), B((s).B)
+#define LOCAL_PSI_FIELDS(s) const FieldType::View Pl((s).Pl), Pr((s).Pr), Pb((s).Pb)
 
 typedef CACHE_ALIGN( float SigmaType[DampSize] );
 
 //! Coefficients for Uniaxial Perfectly Matched Layer (UPML)
+/** Index is distance into the PML region, with 0 nearest the interior. */
 static SigmaType D0, D1, D2, D3, D4, D5;
 static const float D6=1.0f-FLT_EPSILON;
 
-static short PanelIOfYPlus1[WavefieldHeightMax];
-static int PanelFirstY[NUM_PANEL_MAX+1];
-static int PanelFirstI[NUM_PANEL_MAX];
-static int PanelLastI[NUM_PANEL_MAX];
+//! Coefficients D0..D5 in reverse order, for left PML region.
+/** DLk[j] == Dk[DampSize-1-j], so that left border can be indexed by j. */
+static SigmaType DL0, DL1, DL2, DL3, DL4, DL5;
 
 struct PanelTransferDesc {
     short srcI;
     short dstI;
 };
 
-static PanelTransferDesc PanelTransfer[NUM_PANEL_MAX][2*PUMP_FACTOR_MAX];
+enum TileTag {
+#if OPTIMIZE_HOMOGENEOUS_TILES
+    TT_HomogeneousInterior,
+#endif /* OPTIMIZE_HOMOGENEOUS_TILES */
+    TT_HeterogeneousInterior,
+    TT_Top,
+    TT_Left,
+    TT_Right,
+    TT_BottomLeft,
+    TT_Bottom,
+    TT_BottomRight,
+    TT_NumTileTag
+};
+
+// A Tile describes one tile in the tiling of the wavefield.
+#if LARGE_GRID
+// Wide form, for grids with more than 1024 rows or 4096 columns.
+struct Tile {
+    unsigned tag:3;             // a TileTag
+    unsigned iLen:4;            // height of tile
+    unsigned jLenOver8:6;       // width of tile divided by 8
+    unsigned iFirst:19;         // i=index of upper left corner of tile.
+    unsigned jFirstOver8;       // j-index divided by 8
+};
+#else
+struct Tile {
+    unsigned tag:3;             // a TileTag
+    unsigned iFirst:10;         // i=index of upper left corner of tile.
+    unsigned iLen:4;            // height of tile
+    unsigned jFirstOver8:9;     // j-index divided by 8
+    unsigned jLenOver8:6;       // width of tile divided by 8
+};
+#endif /* LARGE_GRID */
+
+//! Number of rows that Tile::iFirst can index.
+static const int TileRowLimit = LARGE_GRID ? 1<<19 : 1<<10;
+
+#if SKIP_QUIESCENT_TILES
+//! Blocks of the activity map that a tile overlaps, and how activity applies to the tile.
+struct TileActivity {
+    unsigned short rowFirst, rowLast;   // block rows [rowFirst,rowLast)
+    unsigned short colFirst, colLast;   // block columns [colFirst,colLast)
+    bool skippable;                     // true if tile is interior, and so can be skipped when quiescent
+    bool last;                          // true if tile computes the last timestep of the frame
+};
+#endif /* SKIP_QUIESCENT_TILES */
+
+//! Names of tile kinds, indexed by TileTag.
+static const char* const TileTagName[TT_NumTileTag] = {
+#if OPTIMIZE_HOMOGENEOUS_TILES
+    "homogeneous",
+#endif /* OPTIMIZE_HOMOGENEOUS_TILES */
+    "heterogeneous", "top", "left", "right", "bottom-left", "bottom", "bottom-right"
+};
+
+//! Bytes of fields read and written per cell update, indexed by TileTag.
+/** Counts the field arrays, but not the small PML coefficient arrays, which stay in cache.
+    WaveBytes is the size of an element of Vx, Vy, or U. */
+static const int WaveBytes = sizeof(WaveValue);
+static const int TileTagBytesPerCell[TT_NumTileTag] = {
+#if OPTIMIZE_HOMOGENEOUS_TILES
+    6*WaveBytes,    // U, Vx, Vy read and written
+#endif /* OPTIMIZE_HOMOGENEOUS_TILES */
+#if COMPACT_ROCK_COEFFICIENTS
+    6*WaveBytes,    // plus RockMap read, which is 1/4 byte per cell (AVX2 and AVX-512 kernels only)
+#else
+    6*WaveBytes+8,  // plus A and B read
+#endif /* COMPACT_ROCK_COEFFICIENTS */
+    3*WaveBytes+4,  // Vy read and written, A and U read
+    6*WaveBytes+16, // U, Vx, Vy read and written, A and B read, Pl read and written
+    6*WaveBytes+16, // U, Vx, Vy read and written, A and B read, Pr read and written
+    6*WaveBytes+24, // U, Vx, Vy read and written, A and B read, Pl and Pb read and written
+    6*WaveBytes+16, // U, Vx, Vy read and written, A and B read, Pb read and written
+    6*WaveBytes+24  // U, Vx, Vy read and written, A and B read, Pr and Pb read and written
+};
+
+//! State of one wave simulation, and the operations on it.
+/** A WavefieldEngine owns one of these.  Nothing in it is shared with other engines,
+    so engines can run concurrently. */
+class WavefieldState {
+public:
+    //! Number of panels for trapezoid tiling.  Autotune picks a value for the host.
+    int TrapezoidNumPanel = 10;
+
+    //! Number of panels in the current layout.
+    /** Equal to TrapezoidNumPanel, except that split tiling may need fewer panels. */
+    int NumPanel = 10;
+
+    //! Number of timesteps per video frame.
+    int PumpFactor = 3;
+
+    //! Order of accuracy in space, 2 or 4.  Set by WavefieldEngine::setSpatialOrder.
+    int SpatialOrder = 2;
+
+    //! True if the panels are laid out for split tiling, which pump factors above PUMP_FACTOR_MAX use.
+    /** Split tiling packs the panels together without overlap zones.  It updates each panel as a trapezoid,
+        and then the diamonds between the trapezoids, as two parallel phases. */
+    bool SplitTiling = false;
+
+    //! Tile dimensions.  The defaults suit a Core 2.  Autotune picks values for the host.
+    int TileHeight = 7;    // Must be <= 15.
+    int TileWidth = 16*7;  // Must be multiple of 8 and <= 8*63
+
+    int WavefieldWidth = 0;
+
+    //! Equal to viewable height plus 1 for free surface plus DampSize for bottom PML region
+    /** Does not inlude overlap zones. */
+    int WavefieldHeight = 0;
+
+    //! Array of rock types, with two bits per element.
+    /** Rows in overlap zones are replicated like A and B. */
+    AlignedArray2D<byte> RockMap;
+
+    //! Fields of the wave simulation.
+    /** Sized by AllocateFields to the current wavefield, including overlap zones.
+        Rows have two columns of padding on the right, because the kernels read A[i][j+1] and U[i][j+1],
+        and the fourth-order kernels read U[i][j+2]. */
+    WaveFieldType Vx, Vy, U;
+    FieldType A, B;
+
+    //! Values of A and B for each rock type, for the current spatial order.  Set by InitializeRockCoefficients.
+    float AofRock[RockTypeMax+1], BofRock[RockTypeMax+1];
+
+    //! "Psi" fields for left and right PML regions.
+    /** Pl is indexed by j, and Pr by j-LeftJofRightRegion. */
+    AlignedArray2D<float> Pl;
+    AlignedArray2D<float> Pr;
+
+    //! "Psi" field for bottom PML region.
+    /** Overlaps left and right PML regions on corners. */
+    AlignedArray2D<float> Pb;
+
+    //! PanelIOfYPlus1[y+1] is the index i of the row with coordinate y.  Sized by InitializePanelMap.
+    std::vector<int> PanelIOfYPlus1;
+    int PanelFirstY[NUM_PANEL_MAX+1];
+    int PanelFirstI[NUM_PANEL_MAX];
+    int PanelLastI[NUM_PANEL_MAX];
+
+    PanelTransferDesc PanelTransfer[NUM_PANEL_MAX][2*STENCIL_REACH_MAX*PUMP_FACTOR_MAX];
+
+    //! Effective length of each row of PanelTransfer
+    int PanelTransferCount = 0;
+
+    //! State of the exchange across the boundary between panels p-1 and p in the current frame.
+    /** One of ZoneNotCopied, ZoneCopying, or ZoneCopied.  Reset by ResetZones. */
+    std::atomic<int> ZoneState[NUM_PANEL_MAX];
+
+    //! Part of the panels that this engine updates, and number of parts.  Set by WavefieldEngine::setPartition.
+    int PartIndex = 0;
+    int PartCount = 1;
+    WavefieldHaloLink* HaloLink = nullptr;
+
+    //! Rows of an overlap zone, packed for HaloLink.
+    std::vector<char> HaloBuffer;
+
+    //! Frames updated since Initialize.  Saved in snapshots.
+    long long FrameCount = 0;
+
+    //! Identifies the snapshot saved or restored last, for checking that a delta follows it.  Zero chain if none.
+    std::uint64_t SnapshotChain = 0;
+    int SnapshotSequence = 0;
+
+    //! U, Vx, and Vy as of the snapshot saved or restored last, for finding the chunks that a delta must hold.
+    /** Rows y=-1 through WavefieldHeight-2, at SnapshotBaseRow.  Empty until the first snapshot, because it is as big
+        as the three fields. */
+    std::vector<WaveValue> SnapshotBase;
+
+    int TopIofBottomRegion = 0;
+    int LeftJofRightRegion = 0;
+
+    //! True if the fields were allocated with NUMA placement.
+    bool FieldsPlaced = false;
+
+    const Tile* PanelFirstTile[NUM_PANEL_MAX];
+    const Tile* PanelLastTile[NUM_PANEL_MAX];
+
+    //! First tile of panel p that touches rows copied by the exchange with panel p+1.
+    /** Equal to PanelLastTile[p] for the last panel, and for split tiling. */
+    const Tile* PanelHaloTile[NUM_PANEL_MAX];
+
+    //! Tiles for the diamond between panels p-1 and p, for the second phase of split tiling.
+    const Tile* BoundaryFirstTile[NUM_PANEL_MAX];
+    const Tile* BoundaryLastTile[NUM_PANEL_MAX];
+
+    //! Tiles for all panels, grouped by panel.
+    std::vector<Tile> TileArray;
+
+    //! "pump factor" for which current tiling is set up, or zero if tiling needs to be recomputed.
+    int currentPumpFactor = 0;
+
+    int AirgunY = 0, AirgunX = 0;
+    float AirgunImpulseValue[PUMP_FACTOR_SPLIT_MAX];
+    //! Number of impulses injected so far in the current frame by each panel.
+    /** Split tiling uses only AirgunImpulseCounter[0], because its phases run one after the other
+        and only one region of a phase updates the airgun's cell. */
+    int AirgunImpulseCounter[NUM_PANEL_MAX];
+    Airgun TheAirgun;
+
+    float WaveClutShowsGeology = 0;
+    float WaveClutShowsSeismic = 0;
+    ColorFunc WaveClutColorFunc = ColorFunc(0);
+    NimblePixel WaveClut[RockTypeMax+2][SAMPLE_CLUT_SIZE];
+
+    //! Set by WavefieldEngine::setPipelinedDraw.
+    bool PipelinedDraw = false;
+
+    //! Copies of the visible part of U for pipelined drawing.  Row y of a copy is row IofY(y) of U without the hidden border.
+    /** While an update writes DrawCopy[DrawCopyBack], the previous frame is drawn from the other buffer. */
+    WaveFieldType DrawCopy[2];
+    int DrawCopyBack = 0;
+
+    //! True if DrawCopy[1-DrawCopyBack] holds the current wavefield.
+    bool DrawCopyValid = false;
+
+    //! Size of geology for which Autotune last chose the tiling, or zero if it has not run.
+    int TunedWidth = 0, TunedHeight = 0;
+
+#if SKIP_QUIESCENT_TILES
+    //! Activity for each tile in TileArray.
+    std::vector<TileActivity> TileActivityArray;
+
+    //! BlockRowFirstY[r] is the first y coordinate in row r of the activity map.
+    /** Block rows do not cross panel boundaries, so each panel writes only its own rows of BlockActive. */
+    std::vector<int> BlockRowFirstY;
+
+    //! BlockRowOfYPlus1[y+1] is the row of the activity map for y coordinate y.
+    std::vector<int> BlockRowOfYPlus1;
+
+    int BlockRowCount = 0;
+    int BlockColCount = 0;
+
+    //! Height of the shortest block row.
+    int MinBlockHeight = 0;
+
+    //! Nonzero for blocks with a cell above ActivityThreshold at the end of the frame.
+    std::vector<char> BlockActive;
+
+    //! Nonzero for blocks whose tiles must be updated in the current frame.
+    std::vector<char> BlockAwake;
+
+    //! True if quiescent tiles may be skipped during the current frame.
+    bool SkipThisFrame = false;
+#endif /* SKIP_QUIESCENT_TILES */
+
+#if RESTRICT_TO_CAUSAL_CONE
+    //! True if the wavefield holds only noise, so that the causal cone of a new shot bounds all activity.
+    bool Quiescent = true;
+
+    //! Radius of causal cone at end of current frame, or -1 if the whole grid must be updated.
+    /** The cone is a diamond, because each timestep carries a disturbance one cell along i or j. */
+    int ConeRadius = -1;
+
+    //! Center of causal cone, as a y coordinate and j index.
+    int ConeY = 0, ConeJ = 0;
+#endif /* RESTRICT_TO_CAUSAL_CONE */
+
+    //! Set by WavefieldEngine::setTileSkipping.
+    bool SkipQuiescent = false;
+
+    //! Set by WavefieldEngine::setConeTracking.
+    bool TrackCone = false;
+
+    inline int StencilReach() const;
+    inline int TileLag() const;
+    inline int ZoneSeparation() const;
+    inline int TrapezoidFirstI( int p, int k ) const;
+    inline int TrapezoidLastI( int p, int k ) const;
+    inline int IofY( int y ) const;
+    inline bool IsInteriorTile( Tile t ) const;
+    int TrapezoidPanelCount() const;
+    int SplitNumPanel() const;
+    void InitializePanelMap();
+    void AllocateFields();
+    void ClearRow( int i );
+    void ChangeLayout();
+    void InitializeZoneTranfers();
+    void InitializeRockMap( const Geology& g );
+    void InitializeRockCoefficients();
+    void InitializeFDTD();
+    void InitializePML();
+    void ReplicateZone( int p, bool all );
+    void ResetZones();
+    void ExchangeZone( int p );
+    void SendHalo( int p, bool up );
+    void ReceiveHalo( int p, bool up );
+    void ExchangeHalos( int pFirst, int pLast );
+    char* SnapshotRow( int k, int i ) const;
+    size_t SnapshotBaseRow( int k, int y ) const;
+    bool ChunkChanged( int y, int c ) const;
+    void RecordChunk( int y, int c );
+    bool SaveSnapshot( const char* path, bool delta );
+    bool RestoreSnapshot( const char* path );
+    inline TileTag Classify( int i, int j ) const;
+    void CheckTiles( int p ) const;
+    bool IsHomogeneous( int iFirst, int iLast, int jFirst, int jLast ) const;
+    void AddTile( int iFirst, int iLast, int jFirst, int jLast );
+    void SplitHorizontal( int iFirst, int iLast, int jFirst, int jLast );
+    void SplitVertical( int iFirst, int iLast, int jFirst, int jLast );
+    void MakeTilesForPanel( int p );
+    void AddHalfRow( int i, int jFirst, int jLast );
+    void MakeSplitTiles( int p, int phase );
+    void CheckSplitTiles() const;
+#if SKIP_QUIESCENT_TILES
+    void InitializeActivityMap();
+    TileActivity MakeTileActivity( int p, Tile t, bool last ) const;
+    bool IsAwake( const TileActivity& a ) const;
+    bool IsActive( int iFirst, int iLast, int jFirst, int jLast ) const;
+    void MarkActivity( int p, int iFirst, int iLast, int jFirst, int jLast );
+    void WakeBlocks();
+#endif /* SKIP_QUIESCENT_TILES */
+#if RESTRICT_TO_CAUSAL_CONE
+    void UpdateCone();
+    bool IsInCone( int p, int iFirst, int iLast, int jFirst, int jLast ) const;
+#endif /* RESTRICT_TO_CAUSAL_CONE */
+    void InitializeTiles();
+    void ComputeTiling();
+    void Initialize( const Geology& g );
+    inline void UpdateTile( Tile t );
+    void UpdateVelocityRow4( int i, int jFirst, int jLast );
+    void UpdatePressureRow4( int i, int jFirst, int jLast );
+    inline void LagToU( int& iFirst, int& iLast, int& jFirst, int& jLast ) const;
+    inline void UpdateSpan4( int i, int jFirst, int jLast, bool velocity );
+    inline void UpdateRow4( int p, int i, int jFirst, int jLast, bool velocity );
+    void UpdateTile4( Tile t, int p );
+    void WavefieldUpdatePanel( int p );
+    void UpdateHalfRow( Tile t, bool velocity );
+    void WavefieldUpdateSplit( int p, int phase );
+    void ComputeWaveClut( const NimblePixMap& map, float showGeology, float showSeismic, ColorFunc colorFunc );
+    void WavefieldDrawPanel( int p, const NimblePixMap& map, const WaveFieldType& source, bool copied ) const;
+    void CopyPanelForDraw( int p, const NimblePixMap& map );
+    void WavefieldDrawTiles( int p, const NimblePixMap& map ) const;
+    void DrawColorScale( const NimblePixMap& map ) const;
+    void UpdatePanels( const NimblePixMap& map, NimbleRequest request, bool copy, int pFirst, int pLast );
+    void UpdateDraw( const NimblePixMap& map, NimbleRequest request, float showGeology, float showSeismic, ColorFunc colorFunc );
+    double TimeUpdates( int frames );
+    void Autotune( const Geology& g, int threads );
+};
+
+//! Rows or columns that a disturbance crosses per timestep: 1 for the second-order stencil and 3 for the fourth-order one.
+inline int WavefieldState::StencilReach() const {
+    return SpatialOrder==4 ? 3 : 1;
+}
+
+//! Rows and columns by which UpdateTile4 lags U behind the velocities: 0 for the second-order stencil and 1 for the fourth-order one.
+inline int WavefieldState::TileLag() const {
+    return SpatialOrder==4 ? 1 : 0;
+}
 
-//! Effective length of each row of PanelTransfer
-static int PanelTransferCount;
+//! Rows from the last row of a panel to the first row of the next panel in the layout for trapezoid tiling.
+/** Holds the overlap zones for PUMP_FACTOR_MAX, plus a row that neither panel writes, plus the lag of U. */
+inline int WavefieldState::ZoneSeparation() const {
+    return 2*StencilReach()*PUMP_FACTOR_MAX+1+TileLag();
+}
 
-static inline int TrapezoidFirstI( int p, int k ) {
+//! First row of the velocities that panel p updates in timestep k of a frame.
+/** With the fourth-order stencil, U lags a row behind, so each bound moves down by TileLag. */
+inline int WavefieldState::TrapezoidFirstI( int p, int k ) const {
     Assert( 0<=p && p<NumPanel );
     Assert( 0<=k && k<PumpFactor );
-    return p==0 ? PanelFirstI[p] : PanelFirstI[p]-(PumpFactor-k);
+    return p==0 ? PanelFirstI[p] : PanelFirstI[p]-StencilReach()*(PumpFactor-k)+TileLag();
 }
 
-static inline int TrapezoidLastI( int p, int k ) {
+inline int WavefieldState::TrapezoidLastI( int p, int k ) const {
     Assert( 0<=p && p<NumPanel );
     Assert( 0<=k && k<PumpFactor );
-    return p==NumPanel-1 ? PanelLastI[p] : PanelLastI[p]+(PumpFactor-1-k);
+    return p==NumPanel-1 ? PanelLastI[p] : PanelLastI[p]+StencilReach()*(PumpFactor-1-k)+TileLag();
 }
 
 // Return index corresponding to given y coordinate.
 // THe y coordinate must be in the closed interval [-1,WavefieldHeight]
-inline int IofY( int y ) {
+inline int WavefieldState::IofY( int y ) const {
     Assert( -1<=y && y<=WavefieldHeight );
     return PanelIOfYPlus1[y+1];
 }
 
-static int TopIofBottomRegion;
-static int LeftJofRightRegion;
+//! Number of panels for trapezoid tiling.
+/** Returns the largest count, up to TrapezoidNumPanel, for which the rows of the layout fit in a Tile, and
+    the last panel has room for the bottom PML region below the rows that it shares with the panel above.
+    Only the wide overlap zones of the fourth-order stencil make either limit matter in practice.
+    Never goes below PartCount, because every part needs a panel. */
+int WavefieldState::TrapezoidPanelCount() const {
+    const int h = WavefieldHeight;
+    int n = TrapezoidNumPanel;
+    for( ; n>PartCount; --n )
+        if( h-1+(n-1)*ZoneSeparation()<=TileRowLimit && h-1-h*(n-1)/n>=DampSize+StencilReach()*PUMP_FACTOR_MAX )
+            break;
+    return n;
+}
+
+//! Number of panels for split tiling with the current PumpFactor.
+/** Returns the largest count, up to TrapezoidNumPanel, for which each panel has at least 2*PumpFactor rows,
+    so that the diamonds between panels do not overlap, and the half rows of the last diamond are above
+    the bottom PML region. */
+int WavefieldState::SplitNumPanel() const {
+    const int h = WavefieldHeight;
+    int n = TrapezoidNumPanel;
+    for( ; n>1; --n ) {
+        bool fits = h*(n-1)/n+1+PumpFactor<=h-DampSize;
+        for( int p=0; p<n; ++p ) {
+            int y0 = p==0 ? -1 : h*p/n;
+            int y1 = p==n-1 ? h-1 : h*(p+1)/n;
+            fits &= y1-y0>=2*PumpFactor;
+        }
+        if( fits )
+            break;
+    }
+    return n;
+}
 
-static void InitializePanelMap() {
-    Assert(1<=PumpFactor && PumpFactor<=PUMP_FACTOR_MAX);
+void WavefieldState::InitializePanelMap() {
+    Assert(1<=PumpFactor && PumpFactor<=PUMP_FACTOR_SPLIT_MAX);
+    // Only trapezoid tiling has the overlap zones that the wider stencil needs.
+    Assert( SpatialOrder==2 || PumpFactor<=PUMP_FACTOR_MAX );
 #if ASSERTIONS
     int h = WavefieldHeight;
 #endif /*ASSERTIONS*/
     int w = WavefieldWidth;
+    SplitTiling = PumpFactor>PUMP_FACTOR_MAX;
+    NumPanel = SplitTiling ? SplitNumPanel() : TrapezoidPanelCount();
     PanelFirstY[0] = -1;
     for( int p=1; p<NumPanel; ++p )
         PanelFirstY[p] = WavefieldHeight*p/NumPanel;
@@ -153,6 +600,7 @@ static void InitializePanelMap() {
     Assert( 0<h && h<=WavefieldHeightMax ); // FIXME - account for panel boundaries
     Assert( 0<w && w<=WavefieldWidthMax );
     Assert( NumPanel<=NUM_PANEL_MAX );
+    PanelIOfYPlus1.assign( WavefieldHeight+2, 0 );
     int i=0;
     for( int p=0; p<NumPanel; ++p ) {
         PanelFirstI[p] = i;
@@ -160,25 +608,131 @@ static void InitializePanelMap() {
             PanelIOfYPlus1[y+1] = i++;
         PanelLastI[p] = i;
         // Allocate separation zone
-        i += 2*PUMP_FACTOR_MAX+1;
+        if( !SplitTiling )
+            i += ZoneSeparation();
     }
     TopIofBottomRegion = PanelLastI[NumPanel-1]-DampSize;
     LeftJofRightRegion = w-DampSize;
 }
 
-static void InitializeZoneTranfers() {
-    Assert(0<PumpFactor && PumpFactor<=PUMP_FACTOR_MAX);
-    // Compute panel boundary transfers
-    PanelTransferCount = 2*PumpFactor;
+//! Zero rows [iFirst,iLast) of f, including their padding.
+template<typename T>
+static void ClearRows( AlignedArray2D<T>& f, int iFirst, int iLast ) {
+    for( int i=iFirst; i<iLast; ++i )
+        std::memset( f[i], 0, f.stride()*sizeof(T) );
+}
+
+//! Size the field arrays to match WavefieldWidth and the layout for trapezoid tiling.
+/** The layout for split tiling needs fewer rows, so ChangeLayout can switch layouts in place.
+    With NUMA placement, the rows of each panel, including its half of the overlap zones,
+    are first touched on the node that parallel_ghost_cell runs the panel on. */
+void WavefieldState::AllocateFields() {
+    const bool placed = NumaPlacement();
+    if( placed!=FieldsPlaced ) {
+        // Free the arrays, so that resizing them places their pages anew.
+        RockMap.resize( 0, 0 );
+        for( WaveFieldType* f: {&Vx, &Vy, &U} )
+            f->resize( 0, 0 );
+        for( FieldType* f: {&A, &B} )
+            f->resize( 0, 0 );
+        Pl.resize( 0, 0 );
+        Pr.resize( 0, 0 );
+        Pb.resize( 0, 0 );
+        FieldsPlaced = placed;
+    }
+    // The extra rows are for the kernels that read A[i+1][j] and U[i+1][j] on the last row,
+    // and the fourth-order kernels that read U[i+2][j].
+    int h = WavefieldHeight+(TrapezoidNumPanel-1)*ZoneSeparation()+2;
+    int w = WavefieldWidth;
+    if( RockMap.height()==h && RockMap.width()==w>>2 )
+        return;
+    RockMap.resize( h, w>>2, !placed );
+    for( WaveFieldType* f: {&Vx, &Vy, &U} )
+        f->resize( h, w+2, !placed );
+    for( FieldType* f: {&A, &B} )
+        f->resize( h, w+2, !placed );
+    Pl.resize( h, DampSize, !placed );
+    Pr.resize( h, DampSize, !placed );
+    Pb.resize( DampSize, w, !placed );
+    if( placed )
+        RunChunksOnNodes( NumPanel, [this,h]( int p ) {
+            // Split each overlap zone down the middle.  The last panel also gets the spare rows and Pb.
+            int iFirst = p==0 ? 0 : (PanelLastI[p-1]+PanelFirstI[p])/2;
+            int iLast = p==NumPanel-1 ? h : (PanelLastI[p]+PanelFirstI[p+1])/2;
+            ClearRows( RockMap, iFirst, iLast );
+            for( WaveFieldType* f: {&Vx, &Vy, &U} )
+                ClearRows( *f, iFirst, iLast );
+            for( FieldType* f: {&A, &B, &Pl, &Pr} )
+                ClearRows( *f, iFirst, iLast );
+            if( p==NumPanel-1 )
+                ClearRows( Pb, 0, DampSize );
+        } );
+}
+
+//! Zero row i of every field.
+void WavefieldState::ClearRow( int i ) {
+    int w = WavefieldWidth;
+    std::memset( RockMap[i], 0, w>>2 );
+    for( WaveFieldType* f: {&Vx, &Vy, &U} )
+        std::memset( (*f)[i], 0, (w+2)*sizeof(WaveValue) );
+    for( FieldType* f: {&A, &B} )
+        std::memset( (*f)[i], 0, (w+2)*sizeof(float) );
+    std::memset( Pl[i], 0, DampSize*sizeof(float) );
+    std::memset( Pr[i], 0, DampSize*sizeof(float) );
+}
+
+//! Lay out the panels for the current PumpFactor, and move the rows of the fields to their new places.
+void WavefieldState::ChangeLayout() {
+    const std::vector<int> oldIOfYPlus1 = PanelIOfYPlus1;
+    InitializePanelMap();
+#if SKIP_QUIESCENT_TILES
+    InitializeActivityMap();
+#endif /* SKIP_QUIESCENT_TILES */
+    // Rows move up when the overlap zones are removed and down when they are restored,
+    // so copy in the order that reads each row before it is overwritten.
+    const int n = WavefieldHeight;
+    const bool down = PanelIOfYPlus1[n-1]>oldIOfYPlus1[n-1];
+    const int w = WavefieldWidth;
+    for( int k=0; k<n; ++k ) {
+        int y1 = down ? n-1-k : k;
+        int i0 = oldIOfYPlus1[y1];
+        int i1 = PanelIOfYPlus1[y1];
+        if( i0!=i1 ) {
+            memcpy( RockMap[i1], RockMap[i0], w>>2 );
+            memcpy( A[i1], A[i0], w*sizeof(float) );
+            memcpy( B[i1], B[i0], w*sizeof(float) );
+            memcpy( U[i1], U[i0], w*sizeof(WaveValue) );
+            memcpy( Vx[i1], Vx[i0], w*sizeof(WaveValue) );
+            memcpy( Vy[i1], Vy[i0], w*sizeof(WaveValue) );
+            memcpy( Pl[i1], Pl[i0], DampSize*sizeof(float) );
+            memcpy( Pr[i1], Pr[i0], DampSize*sizeof(float) );
+        }
+    }
+    // The kernels read the row after the last row, which must be zero.  With overlap zones,
+    // it is the last row of the arrays, which is never written.
+    if( SplitTiling )
+        ClearRow( PanelLastI[NumPanel-1] );
+}
+
+void WavefieldState::InitializeZoneTranfers() {
+    Assert(0<PumpFactor && PumpFactor<=PUMP_FACTOR_SPLIT_MAX);
+    if( SplitTiling ) {
+        // No overlap zones
+        PanelTransferCount = 0;
+        return;
+    }
+    // Compute panel boundary transfers.  Each zone is as deep as a disturbance travels in a frame.
+    const int depth = StencilReach()*PumpFactor;
+    PanelTransferCount = 2*depth;
     for( int p=1; p<NumPanel; ++p ) {
         int k = 0;
-        for( int d=0; d<PumpFactor; ++d ) {
+        for( int d=0; d<depth; ++d ) {
             // Copy from start of panel p+1 to end of panel p
             PanelTransfer[p][k].srcI = PanelFirstI[p]+d;
             PanelTransfer[p][k].dstI = PanelLastI[p-1]+d;
             ++k;
         }
-        for( int d=0; d<PumpFactor; ++d ) {
+        for( int d=0; d<depth; ++d ) {
             // Copy from end of panel p to start of panel p+1
             PanelTransfer[p][k].srcI = PanelLastI[p-1]-d-1;
             PanelTransfer[p][k].dstI = PanelFirstI[p]-d-1;
@@ -189,7 +743,7 @@ static void InitializeZoneTranfers() {
 }
 
 //! Initialize RockMap and related wavefield propagation coefficients.
-static void InitializeRockMap( const Geology& g ) {
+void WavefieldState::InitializeRockMap( const Geology& g ) {
     int h = WavefieldHeight;
     int w = WavefieldWidth;
     Assert( 4<=WavefieldHeight && WavefieldHeight<=WavefieldHeightMax );
@@ -198,7 +752,7 @@ static void InitializeRockMap( const Geology& g ) {
     static const RockType typeOfLayer[GEOLOGY_N_LAYER] = {Water,Shale,Sandstone,Shale};
     for( int y=1; y<h; ++y ) {
         int i = IofY(y);
-        Assert(0<=i && i<sizeof(RockMap)/sizeof(RockMap[0]));
+        Assert(0<=i && i<RockMap.height());
         for( int j=0; j<w>>2; ++j ) {
             unsigned packed = 0;
             for( int k=0; k<4; ++k ) {
@@ -212,8 +766,29 @@ static void InitializeRockMap( const Geology& g ) {
     }
 }
 
+//! Factor by which the fourth-order stencil shortens the timestep.
+/** Its differences can be 9/8+1/24 = 7/6 times those of the second-order stencil, so the limit on
+    MofRock*LofRock needs a factor of at most 6/7, which this undercuts a bit for margin. */
+static const float FourthOrderTimestep = 0.85f;
+
+//! Timestep for the given spatial order, relative to that of the second-order stencil.
+static float TimestepOfOrder( int order ) {
+    // The fourth-order differences can be larger, so they need a shorter timestep.
+    return order==4 ? FourthOrderTimestep : 1;
+}
+
+//! Set AofRock and BofRock for the current spatial order.
+void WavefieldState::InitializeRockCoefficients() {
+    const float dt = TimestepOfOrder( SpatialOrder );
+    for( int r=0; r<=RockTypeMax; ++r ) {
+        // Store M/2 in A, because we sum two A values to compute an average M.
+        AofRock[r] = MofRock[r]*0.5f*dt;
+        BofRock[r] = LofRock[r]*dt;
+    }
+}
+
 //! Initialize wave field arrays.
-static void InitializeFDTD() {
+void WavefieldState::InitializeFDTD() {
     int h = WavefieldHeight;
     int w = WavefieldWidth;
 
@@ -224,16 +799,18 @@ static void InitializeFDTD() {
         Assert(U[0][j]==0);
     }
 
+    InitializeRockCoefficients();
+
     // Clear the FTDT fields.  The initial value for U is a bit of noise that
-    // prevents performance losses from denormal floating-point values.
+    // prevents performance losses from denormal floating-point values.  It depends
+    // on y, not i, so that every layout of the rows starts with the same noise.
     for( int y=0; y<h-1; ++y ) {
         int i = IofY(y);
         for( int j=0; j<w; ++j ) {
             int r = RockMap[i][j>>2]>>(2*(j&3))&3;
-            // Store M/2 in A, because we sum two A values to compute an average M.
-            A[i][j] = MofRock[r]*0.5f;
-            B[i][j] = LofRock[r];
-            U[i][j] = sinf(i*.1f)*cosf(j*.1f)*1.E-6;
+            A[i][j] = AofRock[r];
+            B[i][j] = BofRock[r];
+            U[i][j] = sinf(y*.1f)*cosf(j*.1f)*1.E-6;
             Vx[i][j] = 0;
             Vy[i][j] = 0;
         }
@@ -250,8 +827,34 @@ static inline float SigmaRamp( float k ) {
     return s;
 }
 
-//! Initialize PML-related fields and coefficients.
-static void InitializePML() {
+//! Initialize UPML coefficients, which are the same for all wavefields.
+static bool InitializePMLCoefficients() {
+    for( int k=0; k<DampSize; ++k ) {
+        float s0 = SigmaRamp(k);
+        float s1 = SigmaRamp(k+0.5f);
+        D0[k] = (2-s0)/(2+s0);
+        D1[k] = (2-s1)/(2+s1);
+        D2[k] = 2/(2+s0);
+        D3[k] = 2/(2+s1);
+        D4[k] = s0;
+        D5[k] = s1;
+    }
+    for( int k=0; k<DampSize; ++k ) {
+        int j = DampSize-1-k;
+        DL0[j] = D0[k];
+        DL1[j] = D1[k];
+        DL2[j] = D2[k];
+        DL3[j] = D3[k];
+        DL4[j] = D4[k];
+        DL5[j] = D5[k];
+    }
+    return true;
+}
+
+static bool PMLCoefficientsInitialized = InitializePMLCoefficients();
+
+//! Initialize PML-related fields.
+void WavefieldState::InitializePML() {
     int h = WavefieldHeight;
     int w = WavefieldWidth;
 
@@ -266,21 +869,9 @@ static void InitializePML() {
     for( int k=0; k<DampSize; ++k )
         for( int j=0; j<w; ++j )
             Pb[k][j] = 0;
-
-    // Initialize UPML coefficients
-    for( int k=0; k<DampSize; ++k ) {
-        float s0 = SigmaRamp(k);
-        float s1 = SigmaRamp(k+0.5f);
-        D0[k] = (2-s0)/(2+s0);
-        D1[k] = (2-s1)/(2+s1);
-        D2[k] = 2/(2+s0);
-        D3[k] = 2/(2+s1);
-        D4[k] = s0;
-        D5[k] = s1;
-    }
 }
 
-static void ReplicateZone( int p, bool all ) {
+void WavefieldState::ReplicateZone( int p, bool all ) {
     int w = WavefieldWidth;
     Assert(w>0);
     Assert(NumPanel>0);
@@ -290,47 +881,119 @@ static void ReplicateZone( int p, bool all ) {
         if( all ) {
             memcpy( A[i1], A[i0], w*sizeof(float) );
             memcpy( B[i1], B[i0], w*sizeof(float) );
+            memcpy( RockMap[i1], RockMap[i0], w>>2 );
         }
-        memcpy( U[i1], U[i0], w*sizeof(float) );
-        memcpy( Vx[i1], Vx[i0], w*sizeof(float) );
-        memcpy( Vy[i1], Vy[i0], w*sizeof(float) );
+        memcpy( U[i1], U[i0], w*sizeof(WaveValue) );
+        memcpy( Vx[i1], Vx[i0], w*sizeof(WaveValue) );
+        memcpy( Vy[i1], Vy[i0], w*sizeof(WaveValue) );
         memcpy( Pl[i1], Pl[i0], DampSize*sizeof(float) );
         memcpy( Pr[i1], Pr[i0], DampSize*sizeof(float) );
     }
 }
 
-enum TileTag {
-#if OPTIMIZE_HOMOGENEOUS_TILES
-    TT_HomogeneousInterior,
-#endif /* OPTIMIZE_HOMOGENEOUS_TILES */
-    TT_HeterogeneousInterior,
-    TT_Top,
-    TT_Left,
-    TT_Right,
-    TT_BottomLeft,
-    TT_Bottom,
-    TT_BottomRight,
-    TT_NumTileTag
+//! Values of ZoneState.
+enum {
+    ZoneNotCopied,
+    ZoneCopying,
+    ZoneCopied
 };
 
-// A Tile describes one tile in the tiling of the wavefield.
-struct Tile {
-    unsigned tag:3;             // a TileTag
-    unsigned iFirst:10;         // i=index of upper left corner of tile.
-    unsigned iLen:4;            // height of tile
-    unsigned jFirstOver8:9;     // j-index divided by 8
-    unsigned jLenOver8:6;       // width of tile divided by 8
-};
+//! Mark every zone as not yet exchanged in the current frame.
+void WavefieldState::ResetZones() {
+    for( int p=0; p<NumPanel; ++p )
+        ZoneState[p].store( ZoneNotCopied, std::memory_order_relaxed );
+}
+
+//! Exchange the zone between panels p-1 and p, unless it has been exchanged in the current frame.
+/** Panel p calls this before its first tile, and panel p-1 before its first tile in PanelHaloTile,
+    so the copy overlaps with the interiors of other panels instead of delaying the fork of panels.
+    Whichever of the two comes first does the copy, and the other waits for it to finish.  The wait
+    is never for a panel that has not started, because starting is what claims the copy. */
+void WavefieldState::ExchangeZone( int p ) {
+    Assert( 0<p && p<NumPanel );
+    int state = ZoneNotCopied;
+    if( ZoneState[p].compare_exchange_strong( state, ZoneCopying, std::memory_order_acquire ) ) {
+        TraceEvent1("exchangeBorders",p);
+        ReplicateZone(p,/*all=*/false);
+        ZoneState[p].store( ZoneCopied, std::memory_order_release );
+    } else {
+        while( ZoneState[p].load( std::memory_order_acquire )!=ZoneCopied )
+            std::this_thread::yield();
+    }
+}
+
+//! Bytes of one row of an overlap zone in a message through HaloLink.
+static size_t HaloRowBytes( int w ) {
+    return 3*w*sizeof(WaveValue)+2*DampSize*sizeof(float);
+}
+
+//! Send the rows of the zone between panels p-1 and p that the other part needs and this part computes.
+/** If up is true, this part owns panel p, and otherwise it owns panel p-1.  Only the fields that
+    evolve are sent, because every part initializes A, B, and RockMap from the whole geology. */
+void WavefieldState::SendHalo( int p, bool up ) {
+    const int w = WavefieldWidth;
+    HaloBuffer.resize( PanelTransferCount/2*HaloRowBytes(w) );
+    char* out = HaloBuffer.data();
+    for( int k=0; k<PanelTransferCount; ++k ) {
+        int i = PanelTransfer[p][k].srcI;
+        if( (i>=PanelFirstI[p])!=up )
+            continue;
+        for( const WaveFieldType* f: {&U, &Vx, &Vy} ) {
+            std::memcpy( out, (*f)[i], w*sizeof(WaveValue) );
+            out += w*sizeof(WaveValue);
+        }
+        for( const FieldType* f: {&Pl, &Pr} ) {
+            std::memcpy( out, (*f)[i], DampSize*sizeof(float) );
+            out += DampSize*sizeof(float);
+        }
+    }
+    Assert( out==HaloBuffer.data()+HaloBuffer.size() );
+    HaloLink->send( up, HaloBuffer.data(), HaloBuffer.size() );
+}
 
-// Fixme - estimate is way too high in practice, and theoretically too low
-static const int NUM_TILE_MAX = WavefieldWidthMax*WavefieldHeightMax*PUMP_FACTOR_MAX;
+//! Receive the rows of the zone between panels p-1 and p that the other part computes, and store them.
+/** The transfers are visited in the same order as by SendHalo in the other part. */
+void WavefieldState::ReceiveHalo( int p, bool up ) {
+    const int w = WavefieldWidth;
+    HaloBuffer.resize( PanelTransferCount/2*HaloRowBytes(w) );
+    HaloLink->receive( up, HaloBuffer.data(), HaloBuffer.size() );
+    const char* in = HaloBuffer.data();
+    for( int k=0; k<PanelTransferCount; ++k ) {
+        if( (PanelTransfer[p][k].srcI>=PanelFirstI[p])==up )
+            continue;
+        int i = PanelTransfer[p][k].dstI;
+        for( WaveFieldType* f: {&U, &Vx, &Vy} ) {
+            std::memcpy( (*f)[i], in, w*sizeof(WaveValue) );
+            in += w*sizeof(WaveValue);
+        }
+        for( FieldType* f: {&Pl, &Pr} ) {
+            std::memcpy( (*f)[i], in, DampSize*sizeof(float) );
+            in += DampSize*sizeof(float);
+        }
+    }
+    Assert( in==HaloBuffer.data()+HaloBuffer.size() );
+}
 
-static const Tile* PanelFirstTile[NUM_PANEL_MAX];
-static const Tile* PanelLastTile[NUM_PANEL_MAX];
-static Tile TileArray[NUM_TILE_MAX];
-static Tile* TileEnd;
+//! Exchange the zones on the boundaries of panels [pFirst,pLast) with the parts that own the panels beyond them.
+/** Sends both messages before receiving either, so that no part waits for another in a cycle.  Marks the
+    zones as copied, so that ExchangeZone does not overwrite them from rows that this part does not update. */
+void WavefieldState::ExchangeHalos( int pFirst, int pLast ) {
+    Assert( PanelTransferCount==2*StencilReach()*PumpFactor );
+    if( pFirst>0 )
+        SendHalo( pFirst, /*up=*/true );
+    if( pLast<NumPanel )
+        SendHalo( pLast, /*up=*/false );
+    if( pFirst>0 ) {
+        ReceiveHalo( pFirst, /*up=*/true );
+        ZoneState[pFirst].store( ZoneCopied, std::memory_order_relaxed );
+    }
+    if( pLast<NumPanel ) {
+        ReceiveHalo( pLast, /*up=*/false );
+        ZoneState[pLast].store( ZoneCopied, std::memory_order_relaxed );
+    }
+}
 
-static inline TileTag Classify( int i, int j ) {
+inline TileTag WavefieldState::Classify( int i, int j ) const {
     Assert(1<=TopIofBottomRegion);
     Assert(DampSize<=LeftJofRightRegion);
     static const TileTag matrix[3][3] = {
@@ -342,9 +1005,10 @@ static inline TileTag Classify( int i, int j ) {
 }
 
 #if ASSERTIONS
-static void CheckTiles( int p ) {
-    Assert(sizeof(Tile)==4);
-    static unsigned char TileDepth[WavefieldHeightMax][WavefieldWidthMax];
+void WavefieldState::CheckTiles( int p ) const {
+    Assert(sizeof(Tile)==(LARGE_GRID ? 8 : 4));
+    static AlignedArray2D<unsigned char> TileDepth;
+    TileDepth.resize( A.height(), WavefieldWidth );
     int i0 = TrapezoidFirstI(p,0);
     int i1 = TrapezoidLastI(p,0);
     for( int i=i0; i<i1; ++i )
@@ -398,7 +1062,7 @@ static void CheckTiles( int p ) {
 #endif /* ASSERTIONS */
 
 //! Return true if tile for [iFirst,iLast) x [jFirst,jLast) is homogeneous
-static bool IsHomogeneous( int iFirst, int iLast, int jFirst, int jLast ) {
+bool WavefieldState::IsHomogeneous( int iFirst, int iLast, int jFirst, int jLast ) const {
     // Load values that are used for a homogenous tile.
     float a = A[iFirst][jFirst];
     float b = B[iFirst][jFirst];
@@ -410,7 +1074,7 @@ static bool IsHomogeneous( int iFirst, int iLast, int jFirst, int jLast ) {
     return true;
 }
 
-static void AddTile( int iFirst, int iLast, int jFirst, int jLast ) {
+void WavefieldState::AddTile( int iFirst, int iLast, int jFirst, int jLast ) {
     // Caller is responsible for ensuring that tile is non-empty.
     Assert( iFirst<iLast );
     Assert( jFirst<jLast );
@@ -441,11 +1105,10 @@ static void AddTile( int iFirst, int iLast, int jFirst, int jLast ) {
     Assert(t.jFirstOver8*8 == jFirst);
     t.jLenOver8 = (jLast-jFirst)/8;
     Assert(8*t.jFirstOver8 + 8*t.jLenOver8 == jLast);
-    Assert( TileEnd<TileArray+NUM_TILE_MAX );
-    *TileEnd++ = t;
+    TileArray.push_back(t);
 }
 
-static void SplitHorizontal( int iFirst, int iLast, int jFirst, int jLast ) {
+void WavefieldState::SplitHorizontal( int iFirst, int iLast, int jFirst, int jLast ) {
     Assert( iFirst<iLast );
     Assert( jFirst<jLast );
     if( jFirst<DampSize && DampSize<jLast ) {
@@ -459,7 +1122,7 @@ static void SplitHorizontal( int iFirst, int iLast, int jFirst, int jLast ) {
     }
 }
 
-static void SplitVertical( int iFirst, int iLast, int jFirst, int jLast ) {
+void WavefieldState::SplitVertical( int iFirst, int iLast, int jFirst, int jLast ) {
     Assert( DampSize<=TopIofBottomRegion );
     if( iFirst<iLast && jFirst<jLast ) {
         if( iFirst<1 && 1<iLast ) {
@@ -474,281 +1137,1439 @@ static void SplitVertical( int iFirst, int iLast, int jFirst, int jLast ) {
     }
 }
 
-static void MakeTilesForPanel( int p ) {
+//! Append tiles for panel p to TileArray.
+void WavefieldState::MakeTilesForPanel( int p ) {
     Assert(TileWidth%4==0);
-    PanelFirstTile[p] = TileEnd;
     int w = WavefieldWidth;
     int d = PumpFactor-1;
+    // Each timestep shifts the tile up by as many rows as a disturbance crosses per timestep.
+    int r = StencilReach();
     int i0=TrapezoidFirstI(p,0);
     int i1=TrapezoidLastI(p,0);
-    for( int i=i0; i-d < i1; i+=TileHeight )
+    for( int i=i0; i-r*d < i1; i+=TileHeight )
         for( int j=0; j-8*d < w; j+=TileWidth )
-            for( int k=0; k<=d; ++k )
-                SplitVertical( Max(i-k,TrapezoidFirstI(p,k)), Min(i-k+TileHeight,TrapezoidLastI(p,k)),
+            for( int k=0; k<=d; ++k ) {
+#if SKIP_QUIESCENT_TILES
+                size_t n = TileArray.size();
+#endif /* SKIP_QUIESCENT_TILES */
+                SplitVertical( Max(i-r*k,TrapezoidFirstI(p,k)), Min(i-r*k+TileHeight,TrapezoidLastI(p,k)),
                                Max(j-8*k,0), Min(j-8*k+TileWidth,w) );
-    PanelLastTile[p] = TileEnd;
-#if ASSERTIONS
-    CheckTiles(p);
-#endif /* ASSERTIONS */
+#if SKIP_QUIESCENT_TILES
+                for( ; n<TileArray.size(); ++n )
+                    TileActivityArray.push_back( MakeTileActivity( p, TileArray[n], k==d ) );
+#endif /* SKIP_QUIESCENT_TILES */
+            }
 }
 
-static void InitializeTiles() {
-    TileEnd=TileArray;
-    for( int p=0; p<NumPanel; ++p ) {
-        int yFirst=PanelFirstY[p];
-        int yLast=PanelFirstY[p+1];
-        if( p>0 ) yFirst-=PumpFactor;
-        if( p+1<NumPanel ) yLast+=PumpFactor-1;
-        MakeTilesForPanel(p);
+//! Append tiles of zero height for a half-row update of row i in columns [jFirst,jLast).
+/** The tiles are split at the left and right PML regions, like those of SplitHorizontal. */
+void WavefieldState::AddHalfRow( int i, int jFirst, int jLast ) {
+    Assert( 1<=i && i<TopIofBottomRegion );
+    const int bounds[4] = {0, DampSize, LeftJofRightRegion, WavefieldWidth};
+    for( int r=0; r<3; ++r ) {
+        int j0 = Max(jFirst,bounds[r]);
+        int j1 = Min(jLast,bounds[r+1]);
+        if( j0<j1 ) {
+            Tile t;
+            t.tag = Classify(i,j0);
+            t.iFirst = i;
+            Assert(t.iFirst==i);
+            t.iLen = 0;
+            t.jFirstOver8 = j0/8;
+            t.jLenOver8 = (j1-j0)/8;
+            Assert(8*t.jFirstOver8 + 8*t.jLenOver8 == j1);
+            TileArray.push_back(t);
+        }
     }
 }
 
-//! "pump factor" for which current tiling is set up, or zero if tiling needs to be recomputed.
-static int currentPumpFactor = 0;
-
-static void ComputeTiling() {
-    if( PumpFactor != currentPumpFactor ) {
-        currentPumpFactor = PumpFactor;
-        InitializeZoneTranfers();
-        for(int p=1; p<NumPanel; ++p)
-            ReplicateZone(p,/*all=*/true);
-        InitializeTiles();
+//! Append split tiles for panel p (phase 0) or for the diamond between panels p-1 and p (phase 1) to TileArray.
+/** At timestep k of the frame, phase 0 updates rows [f+k+1,l-k) of a panel with rows [f,l), and only the
+    velocities of row f+k.  Phase 1 then updates rows [f-k,f+k), and only U of row f+k.  The half rows let
+    panels update in parallel, because a panel's velocities at f+k need its own U from the previous timestep,
+    but U at f+k needs velocities of row f+k-1 in the diamond from the same timestep.  The top of the first panel
+    and the bottom of the last panel do not shrink.  The tiles are in the same skewed order as for MakeTilesForPanel. */
+void WavefieldState::MakeSplitTiles( int p, int phase ) {
+    Assert( SplitTiling );
+    Assert( phase==0 || 0<p );
+    const int w = WavefieldWidth;
+    const int d = PumpFactor-1;
+    const int f = PanelFirstI[p];
+    const int l = PanelLastI[p];
+    // Rows [first[k],last[k]) are fully updated at timestep k, and row half[k] is half updated, unless it is negative.
+    int first[PUMP_FACTOR_SPLIT_MAX], last[PUMP_FACTOR_SPLIT_MAX], half[PUMP_FACTOR_SPLIT_MAX];
+    int i0 = INT_MAX, i1 = INT_MIN;
+    for( int k=0; k<=d; ++k ) {
+        if( phase==0 ) {
+            first[k] = p==0 ? f : f+k+1;
+            last[k] = p==NumPanel-1 ? l : l-k;
+            half[k] = p==0 ? -1 : f+k;
+        } else {
+            first[k] = f-k;
+            last[k] = f+k;
+            half[k] = f+k;
+        }
+        Assert( first[k]<=last[k] );
+        i0 = Min( i0, (half[k]<0 ? first[k] : Min(first[k],half[k]))+k );
+        i1 = Max( i1, Max(last[k],half[k]+1)+k );
     }
+    for( int i=i0; i<i1; i+=TileHeight )
+        for( int j=0; j-8*d < w; j+=TileWidth )
+            for( int k=0; k<=d; ++k ) {
+                int jFirst = Max(j-8*k,0);
+                int jLast = Min(j-8*k+TileWidth,w);
+                bool hasHalf = 0<=half[k] && i-k<=half[k] && half[k]<i-k+TileHeight && jFirst<jLast;
+                // A velocity-only half row is above the rows that phase 0 updates, and a U-only half row is below those of phase 1.
+                if( hasHalf && phase==0 )
+                    AddHalfRow( half[k], jFirst, jLast );
+                SplitVertical( Max(i-k,first[k]), Min(i-k+TileHeight,last[k]), jFirst, jLast );
+                if( hasHalf && phase==1 )
+                    AddHalfRow( half[k], jFirst, jLast );
+            }
 }
 
-void WavefieldInitialize( const Geology& g ) {
-    WavefieldHeight = g.height()+1;
-    WavefieldWidth = g.width();
-    InitializePanelMap();
-    InitializeRockMap(g);
-    InitializeFDTD();
-    InitializePML();
-    //! Force tiling to be recomputed.
-    currentPumpFactor = 0;
+#if ASSERTIONS
+//! Check that the split tiles update every cell PumpFactor times, in an order that respects the dependences between cells,
+//! and that no region of a phase touches a cell that another region of the same phase writes.
+void WavefieldState::CheckSplitTiles() const {
+    const int h = PanelLastI[NumPanel-1];
+    const int w = WavefieldWidth;
+    // Timesteps applied so far to the velocities and U of each cell.
+    std::vector<int> stepV(h*w,0), stepU(h*w,0);
+    // Region of the current phase that wrote or read the velocities (v==1) or U (v==0) of each cell,
+    // or -1 for none, or NumPanel for more than one reader.
+    std::vector<int> writer, reader;
+    int r = 0;
+    auto touch = [&]( bool v, int i, int j, bool write ) {
+        int& wr = writer[(v*h+i)*w+j];
+        int& rd = reader[(v*h+i)*w+j];
+        Assert( wr<0 || wr==r );
+        if( write ) {
+            Assert( rd<0 || rd==r );
+            wr = r;
+        } else {
+            rd = rd<0 || rd==r ? r : NumPanel;
+        }
+    };
+    auto updateV = [&]( int i, int j ) {
+        int s = ++stepV[i*w+j];
+        touch( true, i, j, true );
+        if( i>0 ) {
+            Assert( stepU[i*w+j]==s-1 );
+            touch( false, i, j, false );
+        }
+        if( i>0 && j+1<w ) {
+            Assert( stepU[i*w+j+1]==s-1 );
+            touch( false, i, j+1, false );
+        }
+        if( i+1<h ) {
+            Assert( stepU[(i+1)*w+j]==s-1 );
+            touch( false, i+1, j, false );
+        }
+    };
+    auto updateU = [&]( int i, int j ) {
+        int s = ++stepU[i*w+j];
+        touch( false, i, j, true );
+        Assert( stepV[i*w+j]==s );
+        touch( true, i, j, false );
+        if( j>0 ) {
+            Assert( stepV[i*w+j-1]==s );
+            touch( true, i, j-1, false );
+        }
+        // Velocities of the top row are updated only between the left and right PML regions.
+        if( i>1 || (DampSize<=j && j<w-DampSize) ) {
+            Assert( stepV[(i-1)*w+j]==s );
+            touch( true, i-1, j, false );
+        }
+    };
+    for( int phase=0; phase<2; ++phase ) {
+        writer.assign( 2*h*w, -1 );
+        reader.assign( 2*h*w, -1 );
+        for( r=phase; r<NumPanel; ++r )
+            for( const Tile* t=phase==0 ? PanelFirstTile[r] : BoundaryFirstTile[r]; t<(phase==0 ? PanelLastTile[r] : BoundaryLastTile[r]); ++t ) {
+                int jFirst = t->jFirstOver8*8;
+                int jLast = jFirst+t->jLenOver8*8;
+                if( t->iLen==0 ) {
+                    for( int j=jFirst; j<jLast; ++j )
+                        if( phase==0 )
+                            updateV( t->iFirst, j );
+                        else
+                            updateU( t->iFirst, j );
+                } else {
+                    for( int i=t->iFirst; i<t->iFirst+t->iLen; ++i )
+                        for( int j=jFirst; j<jLast; ++j ) {
+                            updateV( i, j );
+                            if( i>0 )
+                                updateU( i, j );
+                        }
+                }
+            }
+    }
+    for( int i=0; i<h; ++i )
+        for( int j=0; j<w; ++j ) {
+            Assert( stepV[i*w+j]==(i>0 || (DampSize<=j && j<w-DampSize) ? PumpFactor : 0) );
+            Assert( stepU[i*w+j]==(i>0 ? PumpFactor : 0) );
+        }
 }
+#endif /* ASSERTIONS */
 
-int WavefieldGetPumpFactor() {
-    return PumpFactor;
+//! True if tile t is outside the PML regions, including the cells of U that UpdateTile4 updates for it.
+/** Only such tiles may be skipped, because the PML regions must keep absorbing even the initial noise. */
+inline bool WavefieldState::IsInteriorTile( Tile t ) const {
+    bool interior = t.tag==TT_HeterogeneousInterior;
+#if OPTIMIZE_HOMOGENEOUS_TILES
+    interior |= t.tag==TT_HomogeneousInterior;
+#endif /* OPTIMIZE_HOMOGENEOUS_TILES */
+    // UpdateTile4 updates U one column left of the tile.
+    return interior && t.jFirstOver8*8-TileLag()>=DampSize;
 }
 
-void WavefieldSetPumpFactor( int d ) {
-    Assert(1<=d && d<=PUMP_FACTOR_MAX);
-    PumpFactor = d;
+#if SKIP_QUIESCENT_TILES
+//! Divide the rows of each panel into blocks, and mark all blocks as active.
+/** Must be called after InitializePanelMap. */
+void WavefieldState::InitializeActivityMap() {
+    BlockRowFirstY.clear();
+    MinBlockHeight = WavefieldHeight;
+    for( int p=0; p<NumPanel; ++p ) {
+        int y0 = PanelFirstY[p];
+        int n = PanelFirstY[p+1]-y0;
+        int m = Max(1,n/(ActivityBlockHeight*StencilReach()));
+        for( int b=0; b<m; ++b )
+            BlockRowFirstY.push_back( y0+n*b/m );
+        MinBlockHeight = Min(MinBlockHeight,n/m);
+    }
+    BlockRowFirstY.push_back( PanelFirstY[NumPanel] );
+    BlockRowCount = int(BlockRowFirstY.size())-1;
+    BlockRowOfYPlus1.resize( PanelFirstY[NumPanel]+1 );
+    for( int r=0; r<BlockRowCount; ++r )
+        for( int y=BlockRowFirstY[r]; y<BlockRowFirstY[r+1]; ++y )
+            BlockRowOfYPlus1[y+1] = r;
+    BlockColCount = (WavefieldWidth+ActivityBlockWidth-1)/ActivityBlockWidth;
+    // Start with everything active, because the first frame has no history.
+    BlockActive.assign( BlockRowCount*BlockColCount, 1 );
+    BlockAwake.assign( BlockRowCount*BlockColCount, 1 );
 }
 
-static int AirgunY, AirgunX;
-static float AirgunImpulseValue[PUMP_FACTOR_MAX];
-static int AirgunImpulseCounter[NUM_PANEL_MAX];
+TileActivity WavefieldState::MakeTileActivity( int p, Tile t, bool last ) const {
+    int dy = PanelFirstY[p]-PanelFirstI[p];
+    int jFirst = t.jFirstOver8*8;
+    // Include the row above and the column to the left, where UpdateTile4 updates U.
+    int iFirst = Max( int(t.iFirst)-TileLag(), 0 );
+    int jFirstU = Max( jFirst-TileLag(), 0 );
+    TileActivity a;
+    a.rowFirst = BlockRowOfYPlus1[iFirst+dy+1];
+    a.rowLast = BlockRowOfYPlus1[t.iFirst+t.iLen-1+dy+1]+1;
+    a.colFirst = jFirstU/ActivityBlockWidth;
+    a.colLast = (jFirst+t.jLenOver8*8-1)/ActivityBlockWidth+1;
+    a.skippable = IsInteriorTile(t);
+    a.last = last;
+    return a;
+}
 
-void WavefieldSetImpulseLocation( int x, int y ) {
-    AirgunY = y;
-    AirgunX = x;
+inline bool WavefieldState::IsAwake( const TileActivity& a ) const {
+    for( int r=a.rowFirst; r<a.rowLast; ++r )
+        for( int c=a.colFirst; c<a.colLast; ++c )
+            if( BlockAwake[r*BlockColCount+c] )
+                return true;
+    return false;
 }
 
-#if USE_SSE
-#define CAST(x) (*(__m128*)&(x))        /* for aligned load or store */
-#define LOAD(x) _mm_loadu_ps(&(x))      /* for unaligned load */
-#define ADD _mm_add_ps
-#define MUL _mm_mul_ps
-#define SUB _mm_sub_ps
-#endif /* USE_SSE */
+//! True if U, Vx, or Vy exceeds ActivityThreshold in magnitude anywhere in [iFirst,iLast) x [jFirst,jLast).
+bool WavefieldState::IsActive( int iFirst, int iLast, int jFirst, int jLast ) const {
+    LOCAL_FIELDS(*this);
+    for( int i=iFirst; i<iLast; ++i ) {
+        float m = 0;
+        for( int j=jFirst; j<jLast; ++j )
+            m = Max( m, Max( std::fabs(U[i][j]), Max( std::fabs(Vx[i][j]), std::fabs(Vy[i][j]) ) ) );
+        if( m>ActivityThreshold )
+            return true;
+    }
+    return false;
+}
 
-static void WavefieldUpdatePanel( int p ) {
-    const int topIofBottomRegion = TopIofBottomRegion;
+//! Update BlockActive for the rows of panel p in [iFirst,iLast) x [jFirst,jLast).
+/** Rows outside the panel's own rows are left to the panel that owns them. */
+void WavefieldState::MarkActivity( int p, int iFirst, int iLast, int jFirst, int jLast ) {
+    const int dy = PanelFirstY[p]-PanelFirstI[p];
+    iLast = Min(iLast,PanelLastI[p]);
+    for( int i=Max(iFirst,PanelFirstI[p]); i<iLast; ) {
+        int r = BlockRowOfYPlus1[i+dy+1];
+        int iEnd = Min(iLast,BlockRowFirstY[r+1]-dy);
+        for( int c=jFirst/ActivityBlockWidth; c*ActivityBlockWidth<jLast; ++c ) {
+            char& active = BlockActive[r*BlockColCount+c];
+            if( !active )
+                active = IsActive( i, iEnd, Max(jFirst,c*ActivityBlockWidth), Min(jLast,(c+1)*ActivityBlockWidth) );
+        }
+        i = iEnd;
+    }
+}
+
+//! Set BlockAwake to the active blocks and their neighbors, and clear BlockActive for the next frame.
+/** The block with the airgun is active while the airgun is firing. */
+void WavefieldState::WakeBlocks() {
+    SkipThisFrame = SkipQuiescent && MinBlockHeight>=StencilReach()*PumpFactor+TileLag();
+    if( SplitTiling || !SkipQuiescent ) {
+        // Split tiling does not track activity, and nothing needs it without skipping, so keep
+        // every block active, which also keeps UpdateCone from deciding that the wavefield is quiescent.
+        std::fill( BlockActive.begin(), BlockActive.end(), 1 );
+        return;
+    }
+    for( int k=0; k<PumpFactor; ++k )
+        if( AirgunImpulseValue[k]!=0 ) {
+            int c = (AirgunX+HIDDEN_BORDER_SIZE)/ActivityBlockWidth;
+            BlockActive[BlockRowOfYPlus1[AirgunY+1]*BlockColCount+c] = 1;
+            break;
+        }
+    const int rows = BlockRowCount;
+    const int cols = BlockColCount;
+    for( int r=0; r<rows; ++r )
+        for( int c=0; c<cols; ++c ) {
+            char awake = 0;
+            for( int s=Max(r-1,0); s<=Min(r+1,rows-1); ++s )
+                for( int t=Max(c-1,0); t<=Min(c+1,cols-1); ++t )
+                    awake |= BlockActive[s*cols+t];
+            BlockAwake[r*cols+c] = awake;
+        }
+    std::fill( BlockActive.begin(), BlockActive.end(), 0 );
+}
+#endif /* SKIP_QUIESCENT_TILES */
+
+void WavefieldState::InitializeTiles() {
+    TileArray.clear();
+#if SKIP_QUIESCENT_TILES
+    TileActivityArray.clear();
+#endif /* SKIP_QUIESCENT_TILES */
+    size_t panelFirst[NUM_PANEL_MAX+1];
+    for( int p=0; p<NumPanel; ++p ) {
+        panelFirst[p] = TileArray.size();
+        if( SplitTiling )
+            MakeSplitTiles(p,0);
+        else
+            MakeTilesForPanel(p);
+    }
+    panelFirst[NumPanel] = TileArray.size();
+    // Split tiling appends the tiles for the diamonds between panels.
+    size_t boundaryFirst[NUM_PANEL_MAX+1];
+    boundaryFirst[0] = boundaryFirst[1] = TileArray.size();
+    for( int p=1; p<NumPanel; ++p ) {
+        if( SplitTiling )
+            MakeSplitTiles(p,1);
+        boundaryFirst[p+1] = TileArray.size();
+    }
+    // Release space left over from a tiling that needed more tiles.
+    TileArray.shrink_to_fit();
+#if SKIP_QUIESCENT_TILES
+    // Only trapezoid tiling skips tiles.
+    Assert( TileActivityArray.size()==(SplitTiling ? 0 : TileArray.size()) );
+    TileActivityArray.shrink_to_fit();
+#endif /* SKIP_QUIESCENT_TILES */
+    // Set the pointers only now, because appending tiles may have moved the array.
+    for( int p=0; p<NumPanel; ++p ) {
+        PanelFirstTile[p] = TileArray.data()+panelFirst[p];
+        PanelLastTile[p] = TileArray.data()+panelFirst[p+1];
+        BoundaryFirstTile[p] = TileArray.data()+boundaryFirst[p];
+        BoundaryLastTile[p] = TileArray.data()+boundaryFirst[p+1];
+        // A tile touches rows [iFirst-1,iLast], or [iFirst-3,iLast+1] for the fourth-order stencil, and the exchange
+        // with panel p+1 copies rows [PanelLastI[p]-StencilReach()*PumpFactor,PanelLastI[p]+StencilReach()*PumpFactor) of panel p.
+        PanelHaloTile[p] = PanelLastTile[p];
+        if( !SplitTiling && p+1<NumPanel )
+            for( const Tile* ptr=PanelFirstTile[p]; ptr<PanelLastTile[p]; ++ptr )
+                if( int(ptr->iFirst+ptr->iLen)+SpatialOrder/2-1>=PanelLastI[p]-StencilReach()*PumpFactor ) {
+                    PanelHaloTile[p] = ptr;
+                    break;
+                }
+#if ASSERTIONS
+        if( !SplitTiling )
+            CheckTiles(p);
+#endif /* ASSERTIONS */
+    }
+#if ASSERTIONS
+    if( SplitTiling )
+        CheckSplitTiles();
+#endif /* ASSERTIONS */
+}
+
+void WavefieldState::ComputeTiling() {
+    if( PumpFactor != currentPumpFactor ) {
+        // The layout for split tiling depends on PumpFactor.
+        if( SplitTiling || PumpFactor>PUMP_FACTOR_MAX )
+            ChangeLayout();
+        currentPumpFactor = PumpFactor;
+        InitializeZoneTranfers();
+        for(int p=1; p<NumPanel; ++p)
+            ReplicateZone(p,/*all=*/true);
+        InitializeTiles();
+    }
+}
+
+void WavefieldState::Initialize( const Geology& g ) {
+    WavefieldHeight = g.height()+1;
+    WavefieldWidth = g.width();
+    InitializePanelMap();
+#if SKIP_QUIESCENT_TILES
+    InitializeActivityMap();
+#endif /* SKIP_QUIESCENT_TILES */
+    AllocateFields();
+    if( SplitTiling )
+        ClearRow( PanelLastI[NumPanel-1] );
+    InitializeRockMap(g);
+    InitializeFDTD();
+    InitializePML();
+#if RESTRICT_TO_CAUSAL_CONE
+    Quiescent = true;
+    ConeRadius = -1;
+#endif /* RESTRICT_TO_CAUSAL_CONE */
+    FrameCount = 0;
+    SnapshotChain = 0;
+    std::vector<WaveValue>().swap( SnapshotBase );
+    DrawCopyValid = false;
+    //! Force tiling to be recomputed.
+    currentPumpFactor = 0;
+}
+
+#if RESTRICT_TO_CAUSAL_CONE
+//! Advance the causal cone by one frame, starting it when a shot enters a quiescent wavefield
+//! and ending it when it covers the grid.
+/** Must be called before WakeBlocks, which clears the activity it checks. */
+void WavefieldState::UpdateCone() {
+    bool firing = false;
+    for( int k=0; k<PumpFactor; ++k )
+        firing |= AirgunImpulseValue[k]!=0;
+#if SKIP_QUIESCENT_TILES
+    // Without tile skipping, values below ActivityThreshold must not be frozen, so only the first shot
+    // after initialize, when the wavefield holds only noise, gets a cone.
+    if( SkipQuiescent && !Quiescent && std::find( BlockActive.begin(), BlockActive.end(), 1 )==BlockActive.end() )
+        Quiescent = true;
+#endif /* SKIP_QUIESCENT_TILES */
+    const int j = AirgunX+HIDDEN_BORDER_SIZE;
+    if( !TrackCone || SplitTiling || (firing && ConeRadius>=0 && (AirgunY!=ConeY || j!=ConeJ)) )
+        // Tracking is off, or a second source has appeared.  Only trapezoid tiling tracks the cone.
+        ConeRadius = -1;
+    else if( firing && Quiescent && ConeRadius<0 ) {
+        ConeRadius = 0;
+        ConeY = AirgunY;
+        ConeJ = j;
+    }
+    if( firing )
+        Quiescent = false;
+    if( ConeRadius>=0 ) {
+        // Add one for the offset between U and V on the staggered grid, and two for the lag of U behind V in UpdateTile4.
+        ConeRadius += StencilReach()*PumpFactor+(ConeRadius==0 ? 1+2*TileLag() : 0);
+        // Stop when the cone contains every corner of the grid.
+        int dy = Max( ConeY-PanelFirstY[0], PanelFirstY[NumPanel]-1-ConeY );
+        int dj = Max( ConeJ, WavefieldWidth-1-ConeJ );
+        if( dy+dj<=ConeRadius )
+            ConeRadius = -1;
+    }
+}
+
+//! True if the rectangle [iFirst,iLast) x [jFirst,jLast) of panel p intersects the causal cone.
+inline bool WavefieldState::IsInCone( int p, int iFirst, int iLast, int jFirst, int jLast ) const {
+    const int y = ConeY+PanelFirstI[p]-PanelFirstY[p];
+    int di = y<iFirst ? iFirst-y : y>=iLast ? y-iLast+1 : 0;
+    int dj = ConeJ<jFirst ? jFirst-ConeJ : ConeJ>=jLast ? ConeJ-jLast+1 : 0;
+    return di+dj<=ConeRadius;
+}
+#endif /* RESTRICT_TO_CAUSAL_CONE */
+
+//! Coefficients of the fourth-order staggered difference f'(x) ~ C1*(f(x+1/2)-f(x-1/2)) + C2*(f(x+3/2)-f(x-3/2)).
+static const float C1 = 9.0f/8, C2 = -1.0f/24;
+
+#if USE_SSE
+#define CAST(x) (*(__m128*)&(x))        /* for aligned load or store */
+#define LOAD(x) _mm_loadu_ps(&(x))      /* for unaligned load */
+#define ADD _mm_add_ps
+#define MUL _mm_mul_ps
+#define SUB _mm_sub_ps
+#endif /* USE_SSE */
+
+#if USE_AVX
+//! Kernel for a rectangular tile [iFirst,iLast) x [jFirst,jLast).
+typedef void (*TileKernel)( const WavefieldState& s, int iFirst, int iLast, int jFirst, int jLast );
+
+// The AVX kernels use unaligned loads and stores, because the stencils read neighbors at j-1 and j+1.
+// Tile widths are multiples of 8, so the AVX-512 kernels use a half-width mask for the last 8 columns of a row.
+// Use of FMA means that results differ in the last bit from the SSE kernels.
+// Fields Vx, Vy, and U are accessed through LOADW8 and STOREW8, which convert when HALF_FIELDS is set.
+
+#if HALF_FIELDS
+#define LOADW8(x) _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)&(x)))
+#define STOREW8(x,v) _mm_storeu_si128((__m128i*)&(x),_mm256_cvtps_ph(v,_MM_FROUND_TO_NEAREST_INT))
+#else
+#define LOADW8(x) _mm256_loadu_ps(&(x))
+#define STOREW8(x,v) _mm256_storeu_ps(&(x),v)
+#endif /* HALF_FIELDS */
+
+TARGET_AVX2 static void HomogeneousInteriorAVX2( const WavefieldState& s, int iFirst, int iLast, int jFirst, int jLast ) {
+    LOCAL_FIELDS(s);
+    const __m256 a = _mm256_set1_ps(2*A[iFirst][jFirst]);
+    const __m256 b = _mm256_set1_ps(B[iFirst][jFirst]);
+    for( int i=iFirst; i<iLast; ++i ) {
+        for( int j=jFirst; j<jLast; j+=8 ) {
+            __m256 u = LOADW8(U[i][j]);
+            STOREW8(Vx[i][j],_mm256_fmadd_ps(a,_mm256_sub_ps(LOADW8(U[i][j+1]),u),LOADW8(Vx[i][j])));
+            STOREW8(Vy[i][j],_mm256_fmadd_ps(a,_mm256_sub_ps(LOADW8(U[i+1][j]),u),LOADW8(Vy[i][j])));
+        }
+        for( int j=jFirst; j<jLast; j+=8 ) {
+            __m256 dvx = _mm256_sub_ps(LOADW8(Vx[i][j]),LOADW8(Vx[i][j-1]));
+            __m256 dvy = _mm256_sub_ps(LOADW8(Vy[i][j]),LOADW8(Vy[i-1][j]));
+            STOREW8(U[i][j],_mm256_fmadd_ps(b,_mm256_add_ps(dvx,dvy),LOADW8(U[i][j])));
+        }
+    }
+}
+
+#if !COMPACT_ROCK_COEFFICIENTS
+TARGET_AVX2 static void HeterogeneousInteriorAVX2( const WavefieldState& s, int iFirst, int iLast, int jFirst, int jLast ) {
+    LOCAL_FIELDS(s);
+    for( int i=iFirst; i<iLast; ++i ) {
+        for( int j=jFirst; j<jLast; j+=8 ) {
+            __m256 u = LOADW8(U[i][j]);
+            __m256 a = _mm256_loadu_ps(&A[i][j]);
+            __m256 ax = _mm256_add_ps(_mm256_loadu_ps(&A[i][j+1]),a);
+            __m256 ay = _mm256_add_ps(_mm256_loadu_ps(&A[i+1][j]),a);
+            STOREW8(Vx[i][j],_mm256_fmadd_ps(ax,_mm256_sub_ps(LOADW8(U[i][j+1]),u),LOADW8(Vx[i][j])));
+            STOREW8(Vy[i][j],_mm256_fmadd_ps(ay,_mm256_sub_ps(LOADW8(U[i+1][j]),u),LOADW8(Vy[i][j])));
+            __m256 dvx = _mm256_sub_ps(LOADW8(Vx[i][j]),LOADW8(Vx[i][j-1]));
+            __m256 dvy = _mm256_sub_ps(LOADW8(Vy[i][j]),LOADW8(Vy[i-1][j]));
+            STOREW8(U[i][j],_mm256_fmadd_ps(_mm256_loadu_ps(&B[i][j]),_mm256_add_ps(dvx,dvy),u));
+        }
+    }
+}
+#endif /* COMPACT_ROCK_COEFFICIENTS */
+
+// Each row of RockMap packs 16 cells into 4 bytes, so starting at j, which is a multiple of 8,
+// one 4-byte load covers columns j..j+15.
+
+//! Return the rock types of columns j..j+15 of row, packed two bits per column.
+static inline unsigned RockBits( const byte* row, int j ) {
+    unsigned bits;
+    memcpy( &bits, row+(j>>2), sizeof(bits) );
+    return bits;
+}
+
+TARGET_AVX2 static inline __m256i UnpackRock8( unsigned bits ) {
+    const __m256i shift = _mm256_setr_epi32(0,2,4,6,8,10,12,14);
+    return _mm256_and_si256(_mm256_srlv_epi32(_mm256_set1_epi32(int(bits)),shift),_mm256_set1_epi32(3));
+}
+
+#if COMPACT_ROCK_COEFFICIENTS
+// The compact kernels compute exactly what kernels that stream A and B would, but instead they read the
+// rock types from RockMap and look up A and B with a permute on a register that holds AofRock or BofRock.
+
+//! Return the rock types of columns j+1..j+16 of row, packed two bits per column.
+/** The caller must ensure that column j+16 is inside the wavefield. */
+static inline unsigned RockBitsShifted( const byte* row, int j, unsigned bits ) {
+    return bits>>2 | unsigned(row[(j>>2)+4])<<30;
+}
+
+TARGET_AVX2 static void HeterogeneousInteriorRockAVX2( const WavefieldState& s, int iFirst, int iLast, int jFirst, int jLast ) {
+    LOCAL_FIELDS(s);
+    const __m256 aOfRock = _mm256_setr_ps(s.AofRock[0],s.AofRock[1],s.AofRock[2],0,0,0,0,0);
+    const __m256 bOfRock = _mm256_setr_ps(s.BofRock[0],s.BofRock[1],s.BofRock[2],0,0,0,0,0);
+    for( int i=iFirst; i<iLast; ++i ) {
+        const byte* rock = s.RockMap[i];
+        const byte* rockBelow = s.RockMap[i+1];
+        for( int j=jFirst; j<jLast; j+=8 ) {
+            unsigned bits = RockBits(rock,j);
+            __m256i r = UnpackRock8(bits);
+            __m256 u = LOADW8(U[i][j]);
+            __m256 a = _mm256_permutevar8x32_ps(aOfRock,r);
+            __m256 ax = _mm256_add_ps(_mm256_permutevar8x32_ps(aOfRock,UnpackRock8(bits>>2)),a);
+            __m256 ay = _mm256_add_ps(_mm256_permutevar8x32_ps(aOfRock,UnpackRock8(RockBits(rockBelow,j))),a);
+            STOREW8(Vx[i][j],_mm256_fmadd_ps(ax,_mm256_sub_ps(LOADW8(U[i][j+1]),u),LOADW8(Vx[i][j])));
+            STOREW8(Vy[i][j],_mm256_fmadd_ps(ay,_mm256_sub_ps(LOADW8(U[i+1][j]),u),LOADW8(Vy[i][j])));
+            __m256 dvx = _mm256_sub_ps(LOADW8(Vx[i][j]),LOADW8(Vx[i][j-1]));
+            __m256 dvy = _mm256_sub_ps(LOADW8(Vy[i][j]),LOADW8(Vy[i-1][j]));
+            STOREW8(U[i][j],_mm256_fmadd_ps(_mm256_permutevar8x32_ps(bOfRock,r),_mm256_add_ps(dvx,dvy),u));
+        }
+    }
+}
+#endif /* COMPACT_ROCK_COEFFICIENTS */
+
+//! Return mask for the next min(16,jLast-j) columns of a tile.
+static inline __mmask16 RowMask16( int j, int jLast ) {
+    return jLast-j>=16 ? 0xFFFF : 0x00FF;
+}
+
+#if HALF_FIELDS
+// Mask m is either all 16 columns or the first 8, so the half-precision loads and stores need only AVX-512F.
+TARGET_AVX512 static inline __m512 LoadWave16( __mmask16 m, const WaveValue* p ) {
+    __m256i h = m==0xFFFF ? _mm256_loadu_si256((const __m256i*)p) : _mm256_zextsi128_si256(_mm_loadu_si128((const __m128i*)p));
+    return _mm512_cvtph_ps(h);
+}
+
+TARGET_AVX512 static inline void StoreWave16( WaveValue* p, __mmask16 m, __m512 v ) {
+    __m256i h = _mm512_cvtps_ph(v,_MM_FROUND_TO_NEAREST_INT);
+    if( m==0xFFFF )
+        _mm256_storeu_si256((__m256i*)p,h);
+    else
+        _mm_storeu_si128((__m128i*)p,_mm256_castsi256_si128(h));
+}
+
+#define LOADW16(m,x) LoadWave16(m,&(x))
+#define STOREW16(x,m,v) StoreWave16(&(x),m,v)
+#else
+#define LOADW16(m,x) _mm512_maskz_loadu_ps(m,&(x))
+#define STOREW16(x,m,v) _mm512_mask_storeu_ps(&(x),m,v)
+#endif /* HALF_FIELDS */
+
+TARGET_AVX512 static void HomogeneousInteriorAVX512( const WavefieldState& s, int iFirst, int iLast, int jFirst, int jLast ) {
+    LOCAL_FIELDS(s);
+    const __m512 a = _mm512_set1_ps(2*A[iFirst][jFirst]);
+    const __m512 b = _mm512_set1_ps(B[iFirst][jFirst]);
+    for( int i=iFirst; i<iLast; ++i ) {
+        for( int j=jFirst; j<jLast; j+=16 ) {
+            __mmask16 m = RowMask16(j,jLast);
+            __m512 u = LOADW16(m,U[i][j]);
+            STOREW16(Vx[i][j],m,_mm512_fmadd_ps(a,_mm512_sub_ps(LOADW16(m,U[i][j+1]),u),LOADW16(m,Vx[i][j])));
+            STOREW16(Vy[i][j],m,_mm512_fmadd_ps(a,_mm512_sub_ps(LOADW16(m,U[i+1][j]),u),LOADW16(m,Vy[i][j])));
+        }
+        for( int j=jFirst; j<jLast; j+=16 ) {
+            __mmask16 m = RowMask16(j,jLast);
+            __m512 dvx = _mm512_sub_ps(LOADW16(m,Vx[i][j]),LOADW16(m,Vx[i][j-1]));
+            __m512 dvy = _mm512_sub_ps(LOADW16(m,Vy[i][j]),LOADW16(m,Vy[i-1][j]));
+            STOREW16(U[i][j],m,_mm512_fmadd_ps(b,_mm512_add_ps(dvx,dvy),LOADW16(m,U[i][j])));
+        }
+    }
+}
+
+#if !COMPACT_ROCK_COEFFICIENTS
+TARGET_AVX512 static void HeterogeneousInteriorAVX512( const WavefieldState& s, int iFirst, int iLast, int jFirst, int jLast ) {
+    LOCAL_FIELDS(s);
+    for( int i=iFirst; i<iLast; ++i ) {
+        for( int j=jFirst; j<jLast; j+=16 ) {
+            __mmask16 m = RowMask16(j,jLast);
+            __m512 u = LOADW16(m,U[i][j]);
+            __m512 a = _mm512_maskz_loadu_ps(m,&A[i][j]);
+            __m512 ax = _mm512_add_ps(_mm512_maskz_loadu_ps(m,&A[i][j+1]),a);
+            __m512 ay = _mm512_add_ps(_mm512_maskz_loadu_ps(m,&A[i+1][j]),a);
+            STOREW16(Vx[i][j],m,_mm512_fmadd_ps(ax,_mm512_sub_ps(LOADW16(m,U[i][j+1]),u),LOADW16(m,Vx[i][j])));
+            STOREW16(Vy[i][j],m,_mm512_fmadd_ps(ay,_mm512_sub_ps(LOADW16(m,U[i+1][j]),u),LOADW16(m,Vy[i][j])));
+            __m512 dvx = _mm512_sub_ps(LOADW16(m,Vx[i][j]),LOADW16(m,Vx[i][j-1]));
+            __m512 dvy = _mm512_sub_ps(LOADW16(m,Vy[i][j]),LOADW16(m,Vy[i-1][j]));
+            STOREW16(U[i][j],m,_mm512_fmadd_ps(_mm512_maskz_loadu_ps(m,&B[i][j]),_mm512_add_ps(dvx,dvy),u));
+        }
+    }
+}
+#endif /* COMPACT_ROCK_COEFFICIENTS */
+
+TARGET_AVX512 static inline __m512i UnpackRock16( unsigned bits ) {
+    const __m512i shift = _mm512_setr_epi32(0,2,4,6,8,10,12,14,16,18,20,22,24,26,28,30);
+    return _mm512_and_si512(_mm512_srlv_epi32(_mm512_set1_epi32(int(bits)),shift),_mm512_set1_epi32(3));
+}
+
+#if COMPACT_ROCK_COEFFICIENTS
+TARGET_AVX512 static void HeterogeneousInteriorRockAVX512( const WavefieldState& s, int iFirst, int iLast, int jFirst, int jLast ) {
+    LOCAL_FIELDS(s);
+    const __m512 aOfRock = _mm512_setr_ps(s.AofRock[0],s.AofRock[1],s.AofRock[2],0,0,0,0,0,0,0,0,0,0,0,0,0);
+    const __m512 bOfRock = _mm512_setr_ps(s.BofRock[0],s.BofRock[1],s.BofRock[2],0,0,0,0,0,0,0,0,0,0,0,0,0);
+    for( int i=iFirst; i<iLast; ++i ) {
+        const byte* rock = s.RockMap[i];
+        const byte* rockBelow = s.RockMap[i+1];
+        for( int j=jFirst; j<jLast; j+=16 ) {
+            __mmask16 m = RowMask16(j,jLast);
+            // Column j+16 is at most LeftJofRightRegion+8, so it is inside the wavefield.
+            unsigned bits = RockBits(rock,j);
+            __m512i r = UnpackRock16(bits);
+            __m512 u = LOADW16(m,U[i][j]);
+            __m512 a = _mm512_permutexvar_ps(r,aOfRock);
+            __m512 ax = _mm512_add_ps(_mm512_permutexvar_ps(UnpackRock16(RockBitsShifted(rock,j,bits)),aOfRock),a);
+            __m512 ay = _mm512_add_ps(_mm512_permutexvar_ps(UnpackRock16(RockBits(rockBelow,j)),aOfRock),a);
+            STOREW16(Vx[i][j],m,_mm512_fmadd_ps(ax,_mm512_sub_ps(LOADW16(m,U[i][j+1]),u),LOADW16(m,Vx[i][j])));
+            STOREW16(Vy[i][j],m,_mm512_fmadd_ps(ay,_mm512_sub_ps(LOADW16(m,U[i+1][j]),u),LOADW16(m,Vy[i][j])));
+            __m512 dvx = _mm512_sub_ps(LOADW16(m,Vx[i][j]),LOADW16(m,Vx[i][j-1]));
+            __m512 dvy = _mm512_sub_ps(LOADW16(m,Vy[i][j]),LOADW16(m,Vy[i-1][j]));
+            STOREW16(U[i][j],m,_mm512_fmadd_ps(_mm512_permutexvar_ps(r,bOfRock),_mm512_add_ps(dvx,dvy),u));
+        }
+    }
+}
+#endif /* COMPACT_ROCK_COEFFICIENTS */
+
+// The PML kernels are exact translations of the scalar code in WavefieldUpdatePanel.
+// They are compiled for AVX without FMA, so that the compiler cannot contract multiply-add pairs,
+// and thus the results match the scalar code bit for bit.  PML tiles are 8 or 16 columns wide on
+// the left and right, so 8 floats is the natural vector width.
+
+#define LOAD8(x) _mm256_loadu_ps(&(x))
+#define STORE8(x,v) _mm256_storeu_ps(&(x),v)
+#define ADD8 _mm256_add_ps
+#define MUL8 _mm256_mul_ps
+#define SUB8 _mm256_sub_ps
+
+TARGET_AVX static void LeftAVX( const WavefieldState& s, int iFirst, int iLast, int jFirst, int jLast ) {
+    LOCAL_FIELDS(s);
+    LOCAL_PSI_FIELDS(s);
+    const __m256 d6 = _mm256_set1_ps(D6);
+    for( int i=iFirst; i<iLast; ++i ) {
+        for( int j=jFirst; j<jLast; j+=8 ) {
+            __m256 u = LOADW8(U[i][j]);
+            __m256 a = LOAD8(A[i][j]);
+            __m256 vx = ADD8(MUL8(LOAD8(DL0[j]),LOADW8(Vx[i][j])),MUL8(MUL8(LOAD8(DL2[j]),ADD8(LOAD8(A[i][j+1]),a)),SUB8(LOADW8(U[i][j+1]),u)));
+            __m256 vy = ADD8(LOADW8(Vy[i][j]),MUL8(ADD8(LOAD8(A[i+1][j]),a),SUB8(LOADW8(U[i+1][j]),u)));
+            STOREW8(Vx[i][j],vx);
+            STOREW8(Vy[i][j],vy);
+            __m256 dvx = SUB8(vx,LOADW8(Vx[i][j-1]));
+            __m256 dvy = SUB8(vy,LOADW8(Vy[i-1][j]));
+            __m256 pl = LOAD8(Pl[i][j]);
+            STOREW8(U[i][j],ADD8(MUL8(LOAD8(DL1[j]),u),MUL8(LOAD8(B[i][j]),ADD8(MUL8(LOAD8(DL3[j]),ADD8(dvx,pl)),dvy))));
+            STORE8(Pl[i][j],ADD8(MUL8(d6,pl),MUL8(LOAD8(DL5[j]),dvy)));
+        }
+    }
+}
+
+TARGET_AVX static void RightAVX( const WavefieldState& s, int iFirst, int iLast, int jFirst, int jLast ) {
+    LOCAL_FIELDS(s);
+    LOCAL_PSI_FIELDS(s);
+    const __m256 d6 = _mm256_set1_ps(D6);
+    for( int i=iFirst; i<iLast; ++i ) {
+        for( int j=jFirst, l=j-s.LeftJofRightRegion; j<jLast; j+=8, l+=8 ) {
+            __m256 u = LOADW8(U[i][j]);
+            __m256 a = LOAD8(A[i][j]);
+            __m256 vx = ADD8(MUL8(LOAD8(D1[l]),LOADW8(Vx[i][j])),MUL8(MUL8(LOAD8(D3[l]),ADD8(LOAD8(A[i][j+1]),a)),SUB8(LOADW8(U[i][j+1]),u)));
+            __m256 vy = ADD8(LOADW8(Vy[i][j]),MUL8(ADD8(LOAD8(A[i+1][j]),a),SUB8(LOADW8(U[i+1][j]),u)));
+            STOREW8(Vx[i][j],vx);
+            STOREW8(Vy[i][j],vy);
+            __m256 dvx = SUB8(vx,LOADW8(Vx[i][j-1]));
+            __m256 dvy = SUB8(vy,LOADW8(Vy[i-1][j]));
+            __m256 pr = LOAD8(Pr[i][l]);
+            STOREW8(U[i][j],ADD8(MUL8(LOAD8(D0[l]),u),MUL8(LOAD8(B[i][j]),ADD8(MUL8(LOAD8(D2[l]),ADD8(dvx,pr)),dvy))));
+            STORE8(Pr[i][l],ADD8(MUL8(d6,pr),MUL8(LOAD8(D4[l]),dvy)));
+        }
+    }
+}
+
+TARGET_AVX static void BottomLeftAVX( const WavefieldState& s, int iFirst, int iLast, int jFirst, int jLast ) {
+    LOCAL_FIELDS(s);
+    LOCAL_PSI_FIELDS(s);
+    const __m256 d6 = _mm256_set1_ps(D6);
+    for( int i=iFirst, k=i-s.TopIofBottomRegion; i<iLast; ++i, ++k ) {
+        Assert(0<=k && k<DampSize);
+        const __m256 d0k = _mm256_set1_ps(D0[k]), d1k = _mm256_set1_ps(D1[k]), d2k = _mm256_set1_ps(D2[k]);
+        const __m256 d3k = _mm256_set1_ps(D3[k]), d4k = _mm256_set1_ps(D4[k]);
+        for( int j=jFirst; j<jLast; j+=8 ) {
+            __m256 u = LOADW8(U[i][j]);
+            __m256 a = LOAD8(A[i][j]);
+            __m256 vx = ADD8(MUL8(LOAD8(DL0[j]),LOADW8(Vx[i][j])),MUL8(MUL8(LOAD8(DL2[j]),ADD8(LOAD8(A[i][j+1]),a)),SUB8(LOADW8(U[i][j+1]),u)));
+            __m256 vy = ADD8(MUL8(d1k,LOADW8(Vy[i][j])),MUL8(MUL8(d3k,ADD8(LOAD8(A[i+1][j]),a)),SUB8(LOADW8(U[i+1][j]),u)));
+            STOREW8(Vx[i][j],vx);
+            STOREW8(Vy[i][j],vy);
+            __m256 dvx = SUB8(vx,LOADW8(Vx[i][j-1]));
+            __m256 dvy = SUB8(vy,LOADW8(Vy[i-1][j]));
+            __m256 pl = LOAD8(Pl[i][j]);
+            __m256 pb = LOAD8(Pb[k][j]);
+            STOREW8(U[i][j],ADD8(MUL8(MUL8(d0k,LOAD8(DL1[j])),u),MUL8(LOAD8(B[i][j]),ADD8(MUL8(LOAD8(DL3[j]),ADD8(dvx,pl)),MUL8(d2k,ADD8(dvy,pb))))));
+            STORE8(Pb[k][j],ADD8(MUL8(d6,pb),MUL8(d4k,dvx)));
+            STORE8(Pl[i][j],ADD8(MUL8(d6,pl),MUL8(LOAD8(DL5[j]),dvy)));
+        }
+    }
+}
+
+TARGET_AVX static void BottomAVX( const WavefieldState& s, int iFirst, int iLast, int jFirst, int jLast ) {
+    LOCAL_FIELDS(s);
+    LOCAL_PSI_FIELDS(s);
+    const __m256 d6 = _mm256_set1_ps(D6);
+    for( int i=iFirst, k=i-s.TopIofBottomRegion; i<iLast; ++i, ++k ) {
+        Assert(0<=k && k<DampSize);
+        const __m256 d0k = _mm256_set1_ps(D0[k]), d1k = _mm256_set1_ps(D1[k]), d2k = _mm256_set1_ps(D2[k]);
+        const __m256 d3k = _mm256_set1_ps(D3[k]), d4k = _mm256_set1_ps(D4[k]);
+        for( int j=jFirst; j<jLast; j+=8 ) {
+            __m256 u = LOADW8(U[i][j]);
+            __m256 a = LOAD8(A[i][j]);
+            __m256 vx = ADD8(LOADW8(Vx[i][j]),MUL8(ADD8(LOAD8(A[i][j+1]),a),SUB8(LOADW8(U[i][j+1]),u)));
+            __m256 vy = ADD8(MUL8(d1k,LOADW8(Vy[i][j])),MUL8(MUL8(d3k,ADD8(LOAD8(A[i+1][j]),a)),SUB8(LOADW8(U[i+1][j]),u)));
+            STOREW8(Vx[i][j],vx);
+            STOREW8(Vy[i][j],vy);
+            __m256 dvx = SUB8(vx,LOADW8(Vx[i][j-1]));
+            __m256 dvy = SUB8(vy,LOADW8(Vy[i-1][j]));
+            __m256 pb = LOAD8(Pb[k][j]);
+            STOREW8(U[i][j],ADD8(MUL8(d0k,u),MUL8(LOAD8(B[i][j]),ADD8(dvx,MUL8(d2k,ADD8(dvy,pb))))));
+            STORE8(Pb[k][j],ADD8(MUL8(d6,pb),MUL8(d4k,dvx)));
+        }
+    }
+}
+
+TARGET_AVX static void BottomRightAVX( const WavefieldState& s, int iFirst, int iLast, int jFirst, int jLast ) {
+    LOCAL_FIELDS(s);
+    LOCAL_PSI_FIELDS(s);
+    const __m256 d6 = _mm256_set1_ps(D6);
+    for( int i=iFirst, k=i-s.TopIofBottomRegion; i<iLast; ++i, ++k ) {
+        Assert(0<=k && k<DampSize);
+        const __m256 d0k = _mm256_set1_ps(D0[k]), d1k = _mm256_set1_ps(D1[k]), d2k = _mm256_set1_ps(D2[k]);
+        const __m256 d3k = _mm256_set1_ps(D3[k]), d4k = _mm256_set1_ps(D4[k]);
+        for( int j=jFirst, l=j-s.LeftJofRightRegion; j<jLast; j+=8, l+=8 ) {
+            __m256 u = LOADW8(U[i][j]);
+            __m256 a = LOAD8(A[i][j]);
+            __m256 vx = ADD8(MUL8(LOAD8(D1[l]),LOADW8(Vx[i][j])),MUL8(MUL8(LOAD8(D3[l]),ADD8(LOAD8(A[i][j+1]),a)),SUB8(LOADW8(U[i][j+1]),u)));
+            __m256 vy = ADD8(MUL8(d1k,LOADW8(Vy[i][j])),MUL8(MUL8(d3k,ADD8(LOAD8(A[i+1][j]),a)),SUB8(LOADW8(U[i+1][j]),u)));
+            STOREW8(Vx[i][j],vx);
+            STOREW8(Vy[i][j],vy);
+            __m256 dvx = SUB8(vx,LOADW8(Vx[i][j-1]));
+            __m256 dvy = SUB8(vy,LOADW8(Vy[i-1][j]));
+            __m256 pr = LOAD8(Pr[i][l]);
+            __m256 pb = LOAD8(Pb[k][j]);
+            STOREW8(U[i][j],ADD8(MUL8(MUL8(d0k,LOAD8(D0[l])),u),MUL8(LOAD8(B[i][j]),ADD8(MUL8(LOAD8(D2[l]),ADD8(dvx,pr)),MUL8(d2k,ADD8(dvy,pb))))));
+            STORE8(Pb[k][j],ADD8(MUL8(d6,pb),MUL8(d4k,dvx)));
+            STORE8(Pr[i][l],ADD8(MUL8(d6,pr),MUL8(LOAD8(D4[l]),dvy)));
+        }
+    }
+}
+
+//! Kernel for each kind of tile, or nullptr if the inline code in WavefieldUpdatePanel should be used.
+static TileKernel TileKernelOfTag[TT_NumTileTag];
+
+//! Kernel for interior columns [jFirst,jLast) of row i of the fourth-order stencil, above the bottom PML region.
+/** Returns the first column that it did not update, which leaves fewer than 8 columns for the caller. */
+typedef int (*RowKernel4)( const WavefieldState& s, int i, int jFirst, int jLast );
+
+//! Advance Vx and Vy of the interior columns of row i>0 as UpdateVelocityRow4 does, but with FMA.
+TARGET_AVX2 static int VelocityInterior4AVX2( const WavefieldState& s, int i, int jFirst, int jLast ) {
+    LOCAL_FIELDS(s);
+    const __m256 c1 = _mm256_set1_ps(C1), c2 = _mm256_set1_ps(C2);
+    int j = jFirst;
+    for( ; j+8<=jLast; j+=8 ) {
+        __m256 u1 = LOADW8(U[i][j]);
+        __m256 a1 = LOAD8(A[i][j]);
+        __m256 dx = _mm256_fmadd_ps(c1,SUB8(LOADW8(U[i][j+1]),u1),MUL8(c2,SUB8(LOADW8(U[i][j+2]),LOADW8(U[i][j-1]))));
+        __m256 dy = _mm256_fmadd_ps(c1,SUB8(LOADW8(U[i+1][j]),u1),MUL8(c2,SUB8(LOADW8(U[i+2][j]),LOADW8(U[i-1][j]))));
+        STOREW8(Vx[i][j],_mm256_fmadd_ps(ADD8(LOAD8(A[i][j+1]),a1),dx,LOADW8(Vx[i][j])));
+        STOREW8(Vy[i][j],_mm256_fmadd_ps(ADD8(LOAD8(A[i+1][j]),a1),dy,LOADW8(Vy[i][j])));
+    }
+    return j;
+}
+
+//! Advance U of the interior columns of row i>0 as UpdatePressureRow4 does, but with FMA.
+TARGET_AVX2 static int PressureInterior4AVX2( const WavefieldState& s, int i, int jFirst, int jLast ) {
+    LOCAL_FIELDS(s);
+    // Row 1 has only the surface row of Vy above it, so its difference along y is second order.
+    const __m256 c1 = _mm256_set1_ps(C1), c2 = _mm256_set1_ps(C2);
+    const __m256 c1y = _mm256_set1_ps(i>1 ? C1 : 1), c2y = _mm256_set1_ps(i>1 ? C2 : 0);
+    const int i0 = i>1 ? i-2 : i-1;
+    int j = jFirst;
+    for( ; j+8<=jLast; j+=8 ) {
+        __m256 dx = _mm256_fmadd_ps(c1,SUB8(LOADW8(Vx[i][j]),LOADW8(Vx[i][j-1])),MUL8(c2,SUB8(LOADW8(Vx[i][j+1]),LOADW8(Vx[i][j-2]))));
+        __m256 dy = _mm256_fmadd_ps(c1y,SUB8(LOADW8(Vy[i][j]),LOADW8(Vy[i-1][j])),MUL8(c2y,SUB8(LOADW8(Vy[i+1][j]),LOADW8(Vy[i0][j]))));
+        STOREW8(U[i][j],_mm256_fmadd_ps(LOAD8(B[i][j]),ADD8(dx,dy),LOADW8(U[i][j])));
+    }
+    return j;
+}
+
+//! Advance Vx and Vy of the heterogeneous half row [jFirst,jLast) of row i, rounding like the AVX interior kernels.
+TARGET_AVX2 static void HalfRowVelocityAVX2( const WavefieldState& s, int i, int jFirst, int jLast ) {
+    LOCAL_FIELDS(s);
+    for( int j=jFirst; j<jLast; j+=8 ) {
+        __m256 u = LOADW8(U[i][j]);
+        __m256 a = LOAD8(A[i][j]);
+        STOREW8(Vx[i][j],_mm256_fmadd_ps(ADD8(LOAD8(A[i][j+1]),a),SUB8(LOADW8(U[i][j+1]),u),LOADW8(Vx[i][j])));
+        STOREW8(Vy[i][j],_mm256_fmadd_ps(ADD8(LOAD8(A[i+1][j]),a),SUB8(LOADW8(U[i+1][j]),u),LOADW8(Vy[i][j])));
+    }
+}
+
+//! Advance U of the heterogeneous half row [jFirst,jLast) of row i, rounding like the AVX interior kernels.
+TARGET_AVX2 static void HalfRowPressureAVX2( const WavefieldState& s, int i, int jFirst, int jLast ) {
+    LOCAL_FIELDS(s);
+    for( int j=jFirst; j<jLast; j+=8 ) {
+        __m256 dvx = SUB8(LOADW8(Vx[i][j]),LOADW8(Vx[i][j-1]));
+        __m256 dvy = SUB8(LOADW8(Vy[i][j]),LOADW8(Vy[i-1][j]));
+        STOREW8(U[i][j],_mm256_fmadd_ps(LOAD8(B[i][j]),ADD8(dvx,dvy),LOADW8(U[i][j])));
+    }
+}
+
+//! Fourth-order interior kernels, or nullptr if UpdateVelocityRow4 and UpdatePressureRow4 should use their own code.
+static RowKernel4 VelocityKernel4, PressureKernel4;
+
+//! Choose kernels for the widest instruction set that the host supports.
+/** The interior kernels for AVX2 and AVX-512 use FMA, so they match the SSE code only to within FMA rounding.
+    The PML kernels match it bit for bit. */
+static bool ChooseTileKernels() {
+    SimdLevel level = SimdLevelOfHost();
+    if( level>=SIMD_AVX2 ) {
+        // The rows of the fourth-order stencil are not multiples of 16 wide, so AVX-512 hosts use these too.
+        VelocityKernel4 = VelocityInterior4AVX2;
+        PressureKernel4 = PressureInterior4AVX2;
+        TileKernelOfTag[TT_Left] = LeftAVX;
+        TileKernelOfTag[TT_Right] = RightAVX;
+        TileKernelOfTag[TT_BottomLeft] = BottomLeftAVX;
+        TileKernelOfTag[TT_Bottom] = BottomAVX;
+        TileKernelOfTag[TT_BottomRight] = BottomRightAVX;
+    }
+    switch( level ) {
+        case SIMD_AVX512:
+#if OPTIMIZE_HOMOGENEOUS_TILES
+            TileKernelOfTag[TT_HomogeneousInterior] = HomogeneousInteriorAVX512;
+#endif /* OPTIMIZE_HOMOGENEOUS_TILES */
+#if COMPACT_ROCK_COEFFICIENTS
+            TileKernelOfTag[TT_HeterogeneousInterior] = HeterogeneousInteriorRockAVX512;
+#else
+            TileKernelOfTag[TT_HeterogeneousInterior] = HeterogeneousInteriorAVX512;
+#endif /* COMPACT_ROCK_COEFFICIENTS */
+            break;
+        case SIMD_AVX2:
+#if OPTIMIZE_HOMOGENEOUS_TILES
+            TileKernelOfTag[TT_HomogeneousInterior] = HomogeneousInteriorAVX2;
+#endif /* OPTIMIZE_HOMOGENEOUS_TILES */
+#if COMPACT_ROCK_COEFFICIENTS
+            TileKernelOfTag[TT_HeterogeneousInterior] = HeterogeneousInteriorRockAVX2;
+#else
+            TileKernelOfTag[TT_HeterogeneousInterior] = HeterogeneousInteriorAVX2;
+#endif /* COMPACT_ROCK_COEFFICIENTS */
+            break;
+        case SIMD_SSE:
+            break;
+    }
+    return true;
+}
+
+static bool TileKernelsChosen = ChooseTileKernels();
+#endif /* USE_AVX */
+
+//! Advance the cells in tile t by one timestep.
+inline void WavefieldState::UpdateTile( Tile t ) {
+    LOCAL_FIELDS(*this);
+    LOCAL_PSI_FIELDS(*this);
+    const int topIofBottomRegion = TopIofBottomRegion;
     const int leftJofRightRegion = LeftJofRightRegion;
-    const int airgunJ = AirgunX+HIDDEN_BORDER_SIZE;
-    const int airgunI = (AirgunY-PanelFirstY[p])+PanelFirstI[p];
-    const Tile* tFirst = PanelFirstTile[p];
-    const Tile* tLast = PanelLastTile[p];
-    for( const Tile* ptr=tFirst; ptr<tLast; ++ptr ) {
-        Tile t = *ptr;
-        int iFirst = t.iFirst;
-        int iLast = iFirst+t.iLen;
-        int jFirst = t.jFirstOver8*8;
-        int jLast = jFirst+t.jLenOver8*8;
-        switch( t.tag ) {
-            case TT_Top:
-                // Reflection boundary condition at top.
-                Assert(iFirst==0);
-                Assert(iLast==1);
+    int iFirst = t.iFirst;
+    int iLast = iFirst+t.iLen;
+    int jFirst = t.jFirstOver8*8;
+    int jLast = jFirst+t.jLenOver8*8;
+    if( SpatialOrder==4 ) {
+        UpdateTile4( t, -1 );
+        return;
+    }
+#if USE_AVX
+    if( TileKernel kernel = TileKernelOfTag[t.tag] )
+        kernel( *this, iFirst, iLast, jFirst, jLast );
+    else
+#endif /* USE_AVX */
+    switch( t.tag ) {
+        case TT_Top:
+            // Reflection boundary condition at top.
+            Assert(iFirst==0);
+            Assert(iLast==1);
+            for( int j=jFirst; j<jLast; ++j ) {
+                Assert(Vx[0][j]==0);
+                Assert(U[0][j]==0);
+                Vy[0][j] += 4*A[1][j]*(U[1][j]/*-U[0][j]*/);
+            }
+            break;
+        case TT_Left:
+            // Left border
+            for( int i=iFirst; i<iLast; ++i ) {
                 for( int j=jFirst; j<jLast; ++j ) {
-                    Assert(Vx[0][j]==0);
-                    Assert(U[0][j]==0);
-                    Vy[0][j] += 4*A[1][j]*(U[1][j]/*-U[0][j]*/);
-                }
-                break;
-            case TT_Left:
-                // Left border
-                for( int i=iFirst; i<iLast; ++i ) {
-                    for( int j=jFirst, l=DampSize-1-jFirst; j<jLast; ++j, --l ) {
-                        // Uniaxial PML along X axis
-                        float u = U[i][j];
-                        Vx[i][j] = D0[l]*Vx[i][j]+D2[l]*(A[i][j+1]+A[i][j])*(U[i][j+1]-u);
-                        Vy[i][j] =       Vy[i][j]+      (A[i+1][j]+A[i][j])*(U[i+1][j]-u);
-                        U [i][j] = D1[l]*u       +B[i][j]*(D3[l]*((Vx[i][j]-Vx[i][j-1])+Pl[i][l]) + (Vy[i][j]-Vy[i-1][j]));
-                        Pl[i][l] = D6   *Pl[i][l]+         D5[l]*                                   (Vy[i][j]-Vy[i-1][j]);
-                    }
+                    // Uniaxial PML along X axis
+                    float u = U[i][j];
+                    Vx[i][j] = DL0[j]*Vx[i][j]+DL2[j]*(A[i][j+1]+A[i][j])*(U[i][j+1]-u);
+                    Vy[i][j] =        Vy[i][j]+       (A[i+1][j]+A[i][j])*(U[i+1][j]-u);
+                    U [i][j] = DL1[j]*u       +B[i][j]*(DL3[j]*((Vx[i][j]-Vx[i][j-1])+Pl[i][j]) + (Vy[i][j]-Vy[i-1][j]));
+                    Pl[i][j] = D6    *Pl[i][j]+         DL5[j]*                                   (Vy[i][j]-Vy[i-1][j]);
                 }
-                break;
+            }
+            break;
 #if OPTIMIZE_HOMOGENEOUS_TILES
-            case TT_HomogeneousInterior:  {
-                // Interior
+        case TT_HomogeneousInterior:  {
+            // Interior
 #if USE_ARRAY_NOTATION
-                // Array notation form - readable and fast
-                size_t m = iLast-iFirst;
-                size_t n = jLast-jFirst;
-                int i = iFirst;
-                int j = jFirst;
-                float a = 2*A[i][j];
-                float b = B[i][j];
-                Vx[i:m][j:n] += a*(U[i:m][j+1:n]-U[i:m][j:n]);
-                Vy[i:m][j:n] += a*(U[i+1:m][j:n]-U[i:m][j:n]);
-                U[i:m][j:n] += b*((Vx[i:m][j:n]-Vx[i:m][j-1:n])+(Vy[i:m][j:n]-Vy[i-1:m][j:n]));
-#elif USE_SSE
-                // SSE form - less readable but fast
-                __m128 a = CAST(A[iFirst][jFirst]);
-                a = ADD(a,a);
-                __m128 b = CAST(B[iFirst][jFirst]);
-                for( int i=iFirst; i<iLast; ++i ) {
-                    // Fissioning inner loop into two loops seems to get best performance from Core-2 processors.
-                    for( int j=jFirst; j<jLast; j+=4 ) {
-                        CAST(Vx[i][j]) = ADD(CAST(Vx[i][j]),MUL(a,SUB(LOAD(U[i][j+1]),CAST(U[i][j]))));
-                        CAST(Vy[i][j]) = ADD(CAST(Vy[i][j]),MUL(a,SUB(CAST(U[i+1][j]),CAST(U[i][j]))));
-                    }
-                    for( int j=jFirst; j<jLast; j+=4 )
-                        CAST(U[i][j]) = ADD(CAST(U[i][j]),MUL(b,ADD(SUB(CAST(Vx[i][j]),LOAD(Vx[i][j-1])),SUB(CAST(Vy[i][j]),CAST(Vy[i-1][j])))));
+            // Array notation form - readable and fast
+            size_t m = iLast-iFirst;
+            size_t n = jLast-jFirst;
+            int i = iFirst;
+            int j = jFirst;
+            float a = 2*A[i][j];
+            float b = B[i][j];
+            Vx[i:m][j:n] += a*(U[i:m][j+1:n]-U[i:m][j:n]);
+            Vy[i:m][j:n] += a*(U[i+1:m][j:n]-U[i:m][j:n]);
+            U[i:m][j:n] += b*((Vx[i:m][j:n]-Vx[i:m][j-1:n])+(Vy[i:m][j:n]-Vy[i-1:m][j:n]));
+#elif USE_SSE && !HALF_FIELDS
+            // SSE form - less readable but fast
+            __m128 a = CAST(A[iFirst][jFirst]);
+            a = ADD(a,a);
+            __m128 b = CAST(B[iFirst][jFirst]);
+            for( int i=iFirst; i<iLast; ++i ) {
+                // Fissioning inner loop into two loops seems to get best performance from Core-2 processors.
+                for( int j=jFirst; j<jLast; j+=4 ) {
+                    CAST(Vx[i][j]) = ADD(CAST(Vx[i][j]),MUL(a,SUB(LOAD(U[i][j+1]),CAST(U[i][j]))));
+                    CAST(Vy[i][j]) = ADD(CAST(Vy[i][j]),MUL(a,SUB(CAST(U[i+1][j]),CAST(U[i][j]))));
                 }
+                for( int j=jFirst; j<jLast; j+=4 )
+                    CAST(U[i][j]) = ADD(CAST(U[i][j]),MUL(b,ADD(SUB(CAST(Vx[i][j]),LOAD(Vx[i][j-1])),SUB(CAST(Vy[i][j]),CAST(Vy[i-1][j])))));
+            }
 #else
-                // Scalar form - more readable but slow
-                float a = 2*A[iFirst][jFirst];
-                float b = B[iFirst][jFirst];
-                for( int i=iFirst; i<iLast; ++i ) {
-                    for( int j=jFirst; j<jLast; ++j ) {
-                        Vx[i][j] += a*(U[i][j+1]-U[i][j]);
-                        Vy[i][j] += a*(U[i+1][j]-U[i][j]);
-                        U[i][j] += b*((Vx[i][j]-Vx[i][j-1])+(Vy[i][j]-Vy[i-1][j]));
-                    }
+            // Scalar form - more readable but slow
+            float a = 2*A[iFirst][jFirst];
+            float b = B[iFirst][jFirst];
+            for( int i=iFirst; i<iLast; ++i ) {
+                for( int j=jFirst; j<jLast; ++j ) {
+                    Vx[i][j] += a*(U[i][j+1]-U[i][j]);
+                    Vy[i][j] += a*(U[i+1][j]-U[i][j]);
+                    U[i][j] += b*((Vx[i][j]-Vx[i][j-1])+(Vy[i][j]-Vy[i-1][j]));
                 }
-#endif
-                break;
             }
+#endif
+            break;
+        }
 #endif /* OPTIMIZE_HOMOGENEOUS_TILES */
-            case TT_HeterogeneousInterior: {
-                // Interior
+        case TT_HeterogeneousInterior: {
+            // Interior
 #if USE_ARRAY_NOTATION
-                // Array notation form - readable and fast
-                size_t m = iLast-iFirst;
-                size_t n = jLast-jFirst;
-                int i = iFirst;
-                int j = jFirst;
-                Vx[i:m][j:n] += (A[i:m][j:n]+A[i:m][j+1:n])*(U[i:m][j+1:n]-U[i:m][j:n]);
-                Vy[i:m][j:n] += (A[i:m][j:n]+A[i+1:m][j:n])*(U[i+1:m][j:n]-U[i:m][j:n]);
-                U[i:m][j:n] += B[i:m][j:n]*((Vx[i:m][j:n]-Vx[i:m][j-1:n])+(Vy[i:m][j:n]-Vy[i-1:m][j:n]));
-#elif USE_SSE
-                // SSE form - less readable but fast
-                for( int i=iFirst; i<iLast; ++i ) {
-                    for( int j=jFirst; j<jLast; j+=4 ) {
-                        __m128 u = CAST(U[i][j]);
-                        __m128 a = CAST(A[i][j]);
-                        CAST(Vx[i][j]) = ADD(CAST(Vx[i][j]),MUL(ADD(LOAD(A[i][j+1]),a),SUB(LOAD(U[i][j+1]),u)));
-                        CAST(Vy[i][j]) = ADD(CAST(Vy[i][j]),MUL(ADD(CAST(A[i+1][j]),a),SUB(CAST(U[i+1][j]),u)));
-                        CAST(U[i][j]) = ADD(u,MUL(CAST(B[i][j]),ADD(SUB(CAST(Vx[i][j]),LOAD(Vx[i][j-1])),SUB(CAST(Vy[i][j]),CAST(Vy[i-1][j])))));
-                    }
+            // Array notation form - readable and fast
+            size_t m = iLast-iFirst;
+            size_t n = jLast-jFirst;
+            int i = iFirst;
+            int j = jFirst;
+            Vx[i:m][j:n] += (A[i:m][j:n]+A[i:m][j+1:n])*(U[i:m][j+1:n]-U[i:m][j:n]);
+            Vy[i:m][j:n] += (A[i:m][j:n]+A[i+1:m][j:n])*(U[i+1:m][j:n]-U[i:m][j:n]);
+            U[i:m][j:n] += B[i:m][j:n]*((Vx[i:m][j:n]-Vx[i:m][j-1:n])+(Vy[i:m][j:n]-Vy[i-1:m][j:n]));
+#elif USE_SSE && !HALF_FIELDS
+            // SSE form - less readable but fast
+            for( int i=iFirst; i<iLast; ++i ) {
+                for( int j=jFirst; j<jLast; j+=4 ) {
+                    __m128 u = CAST(U[i][j]);
+                    __m128 a = CAST(A[i][j]);
+                    CAST(Vx[i][j]) = ADD(CAST(Vx[i][j]),MUL(ADD(LOAD(A[i][j+1]),a),SUB(LOAD(U[i][j+1]),u)));
+                    CAST(Vy[i][j]) = ADD(CAST(Vy[i][j]),MUL(ADD(CAST(A[i+1][j]),a),SUB(CAST(U[i+1][j]),u)));
+                    CAST(U[i][j]) = ADD(u,MUL(CAST(B[i][j]),ADD(SUB(CAST(Vx[i][j]),LOAD(Vx[i][j-1])),SUB(CAST(Vy[i][j]),CAST(Vy[i-1][j])))));
                 }
+            }
 #else
-                // Scalar form - more readable but slow
-                for( int i=iFirst; i<iLast; ++i ) {
-                    for( int j=jFirst; j<jLast; ++j ) {
-                        float u = U[i][j];
-                        Vx[i][j] += (A[i][j+1]+A[i][j])*(U[i][j+1]-u);
-                        Vy[i][j] += (A[i+1][j]+A[i][j])*(U[i+1][j]-u);
-                        U [i][j] = u + B[i][j]*((Vx[i][j]-Vx[i][j-1]) + (Vy[i][j]-Vy[i-1][j]));
-                    }
+            // Scalar form - more readable but slow
+            for( int i=iFirst; i<iLast; ++i ) {
+                for( int j=jFirst; j<jLast; ++j ) {
+                    float u = U[i][j];
+                    Vx[i][j] += (A[i][j+1]+A[i][j])*(U[i][j+1]-u);
+                    Vy[i][j] += (A[i+1][j]+A[i][j])*(U[i+1][j]-u);
+                    U [i][j] = u + B[i][j]*((Vx[i][j]-Vx[i][j-1]) + (Vy[i][j]-Vy[i-1][j]));
                 }
-#endif
-                break;
             }
-            case TT_Right:
-                // PML region on right side.
-                for( int i=iFirst; i<iLast; ++i ) {
-                    for( int j=jFirst, l=j-leftJofRightRegion; j<jLast; ++j, ++l ) {
-                        // Uniaxial PML along X axis
-                        float u = U[i][j];
-                        Vx[i][j] = D1[l]*Vx[i][j]+D3[l]*(A[i][j+1]+A[i][j])*(U[i][j+1]-u);
-                        Vy[i][j] =       Vy[i][j]+      (A[i+1][j]+A[i][j])*(U[i+1][j]-u);
-                        U [i][j] = D0[l]*u       +B[i][j]*(D2[l]*((Vx[i][j]-Vx[i][j-1])+Pr[i][l]) + (Vy[i][j]-Vy[i-1][j]));
-                        Pr[i][l] = D6   *Pr[i][l]+         D4[l]*                                   (Vy[i][j]-Vy[i-1][j]);
-                    }
+#endif
+            break;
+        }
+        case TT_Right:
+            // PML region on right side.
+            for( int i=iFirst; i<iLast; ++i ) {
+                for( int j=jFirst, l=j-leftJofRightRegion; j<jLast; ++j, ++l ) {
+                    // Uniaxial PML along X axis
+                    float u = U[i][j];
+                    Vx[i][j] = D1[l]*Vx[i][j]+D3[l]*(A[i][j+1]+A[i][j])*(U[i][j+1]-u);
+                    Vy[i][j] =       Vy[i][j]+      (A[i+1][j]+A[i][j])*(U[i+1][j]-u);
+                    U [i][j] = D0[l]*u       +B[i][j]*(D2[l]*((Vx[i][j]-Vx[i][j-1])+Pr[i][l]) + (Vy[i][j]-Vy[i-1][j]));
+                    Pr[i][l] = D6   *Pr[i][l]+         D4[l]*                                   (Vy[i][j]-Vy[i-1][j]);
                 }
-                break;
-            case TT_BottomLeft:
-                // PML region for bottom left corner.
-                for( int i=iFirst, k=i-topIofBottomRegion; i<iLast; ++i, ++k ) {
-                    for( int j=jFirst, l=DampSize-1-jFirst; j<jLast; ++j, --l ) {
-                        Assert(0<=k && k<DampSize);
-                        // Uniaxial PML along X and Y axis
-                        float u = U[i][j];
-                        Vx[i][j] = D0[l]*Vx[i][j]+D2[l]*(A[i][j+1]+A[i][j])*(U[i][j+1]-u);
-                        Vy[i][j] = D1[k]*Vy[i][j]+D3[k]*(A[i+1][j]+A[i][j])*(U[i+1][j]-u);
-                        U [i][j] = D0[k]*D1[l]*u       +B[i][j]*(D3[l]*((Vx[i][j]-Vx[i][j-1])+Pl[i][l]) + D2[k]*((Vy[i][j]-Vy[i-1][j])+Pb[k][j]));
-                        Pb[k][j] = D6   *Pb[k][j]+D4[k]*(Vx[i][j]-Vx[i][j-1]);
-                        Pl[i][l] = D6   *Pl[i][l]+D5[l]*(Vy[i][j]-Vy[i-1][j]);
-                    }
+            }
+            break;
+        case TT_BottomLeft:
+            // PML region for bottom left corner.
+            for( int i=iFirst, k=i-topIofBottomRegion; i<iLast; ++i, ++k ) {
+                for( int j=jFirst; j<jLast; ++j ) {
+                    Assert(0<=k && k<DampSize);
+                    // Uniaxial PML along X and Y axis
+                    float u = U[i][j];
+                    Vx[i][j] = DL0[j]*Vx[i][j]+DL2[j]*(A[i][j+1]+A[i][j])*(U[i][j+1]-u);
+                    Vy[i][j] = D1[k] *Vy[i][j]+D3[k] *(A[i+1][j]+A[i][j])*(U[i+1][j]-u);
+                    U [i][j] = D0[k]*DL1[j]*u       +B[i][j]*(DL3[j]*((Vx[i][j]-Vx[i][j-1])+Pl[i][j]) + D2[k]*((Vy[i][j]-Vy[i-1][j])+Pb[k][j]));
+                    Pb[k][j] = D6    *Pb[k][j]+D4[k] *(Vx[i][j]-Vx[i][j-1]);
+                    Pl[i][j] = D6    *Pl[i][j]+DL5[j]*(Vy[i][j]-Vy[i-1][j]);
                 }
-                break;
-            case TT_Bottom:
-                // PML region on bottom.
-                for( int i=iFirst, k=i-topIofBottomRegion; i<iLast; ++i, ++k ) {
-                    for( int j=jFirst; j<jLast; ++j ) {
-                        Assert(0<=k && k<DampSize);
-                        Assert(A[i][j]!=0);
-                        // FIXME - does not damp very high frequencies.
-                        // Uniaxial PML along Y axis
-                        float u = U[i][j];
-                        Vx[i][j] =       Vx[i][j]+      (A[i][j+1]+A[i][j])*(U[i][j+1]-u);
-                        Vy[i][j] = D1[k]*Vy[i][j]+D3[k]*(A[i+1][j]+A[i][j])*(U[i+1][j]-u);
-                        U [i][j] = D0[k]*u       +B[i][j]*((Vx[i][j]-Vx[i][j-1])+D2[k]*((Vy[i][j]-Vy[i-1][j])+Pb[k][j]));
-                        Pb[k][j] = D6   *Pb[k][j]+D4[k]*   (Vx[i][j]-Vx[i][j-1]);
-                    }
+            }
+            break;
+        case TT_Bottom:
+            // PML region on bottom.
+            for( int i=iFirst, k=i-topIofBottomRegion; i<iLast; ++i, ++k ) {
+                for( int j=jFirst; j<jLast; ++j ) {
+                    Assert(0<=k && k<DampSize);
+                    Assert(A[i][j]!=0);
+                    // FIXME - does not damp very high frequencies.
+                    // Uniaxial PML along Y axis
+                    float u = U[i][j];
+                    Vx[i][j] =       Vx[i][j]+      (A[i][j+1]+A[i][j])*(U[i][j+1]-u);
+                    Vy[i][j] = D1[k]*Vy[i][j]+D3[k]*(A[i+1][j]+A[i][j])*(U[i+1][j]-u);
+                    U [i][j] = D0[k]*u       +B[i][j]*((Vx[i][j]-Vx[i][j-1])+D2[k]*((Vy[i][j]-Vy[i-1][j])+Pb[k][j]));
+                    Pb[k][j] = D6   *Pb[k][j]+D4[k]*   (Vx[i][j]-Vx[i][j-1]);
                 }
-                break;
-            case TT_BottomRight: {
-                // PML region for bottom right corner.
-                for( int i=iFirst, k=i-topIofBottomRegion; i<iLast; ++i, ++k ) {
-                    for( int j=jFirst, l=j-leftJofRightRegion; j<jLast; ++j, ++l ) {
-                        Assert(0<=k && k<DampSize);
-                        // Uniaxial PML along X and Y axis
-                        float u = U[i][j];
-                        Vx[i][j] = D1[l]*Vx[i][j]+D3[l]*(A[i][j+1]+A[i][j])*(U[i][j+1]-u);
-                        Vy[i][j] = D1[k]*Vy[i][j]+D3[k]*(A[i+1][j]+A[i][j])*(U[i+1][j]-u);
-                        U [i][j] = D0[k]*D0[l]*u       +B[i][j]*(D2[l]*((Vx[i][j]-Vx[i][j-1])+Pr[i][l]) + D2[k]*((Vy[i][j]-Vy[i-1][j])+Pb[k][j]));
-                        Pb[k][j] = D6   *Pb[k][j]+D4[k]*(Vx[i][j]-Vx[i][j-1]);
-                        Pr[i][l] = D6   *Pr[i][l]+D4[l]*(Vy[i][j]-Vy[i-1][j]);
-                    }
+            }
+            break;
+        case TT_BottomRight: {
+            // PML region for bottom right corner.
+            for( int i=iFirst, k=i-topIofBottomRegion; i<iLast; ++i, ++k ) {
+                for( int j=jFirst, l=j-leftJofRightRegion; j<jLast; ++j, ++l ) {
+                    Assert(0<=k && k<DampSize);
+                    // Uniaxial PML along X and Y axis
+                    float u = U[i][j];
+                    Vx[i][j] = D1[l]*Vx[i][j]+D3[l]*(A[i][j+1]+A[i][j])*(U[i][j+1]-u);
+                    Vy[i][j] = D1[k]*Vy[i][j]+D3[k]*(A[i+1][j]+A[i][j])*(U[i+1][j]-u);
+                    U [i][j] = D0[k]*D0[l]*u       +B[i][j]*(D2[l]*((Vx[i][j]-Vx[i][j-1])+Pr[i][l]) + D2[k]*((Vy[i][j]-Vy[i-1][j])+Pb[k][j]));
+                    Pb[k][j] = D6   *Pb[k][j]+D4[k]*(Vx[i][j]-Vx[i][j-1]);
+                    Pr[i][l] = D6   *Pr[i][l]+D4[l]*(Vy[i][j]-Vy[i-1][j]);
                 }
-                break;
             }
+            break;
+        }
+    }
+}
+
+//! Advance Vx and Vy of row i, columns [jFirst,jLast), by one timestep with fourth-order differences.
+/** Reads U of the previous timestep in rows [i-1,i+2] and columns [jFirst-1,jLast+1].  The PML formulas are
+    those of UpdateTile, with the fourth-order differences in place of the second-order ones, so the PML regions
+    are fourth order too.  Only the surface row 0 is second order. */
+void WavefieldState::UpdateVelocityRow4( int i, int jFirst, int jLast ) {
+    LOCAL_FIELDS(*this);
+    if( i==0 ) {
+        // Reflection boundary condition at top, which has no rows above it for a wider difference.
+        for( int j=Max(jFirst,DampSize); j<Min(jLast,LeftJofRightRegion); ++j )
+            Vy[0][j] += 4*A[1][j]*U[1][j];
+        return;
+    }
+    const WaveValue* u0 = U[i-1];
+    const WaveValue* u1 = U[i];
+    const WaveValue* u2 = U[i+1];
+    const WaveValue* u3 = U[i+2];
+    const float* a1 = A[i];
+    const float* a2 = A[i+1];
+    WaveValue* vx = Vx[i];
+    WaveValue* vy = Vy[i];
+    // Damping along y, which is none above the bottom PML region.
+    const int k = i-TopIofBottomRegion;
+    Assert( k<DampSize );
+    const float d1 = k>=0 ? D1[k] : 1;
+    const float d3 = k>=0 ? D3[k] : 1;
+    const int jLeft = Min(jLast,DampSize);
+    const int jRight = Max(jFirst,LeftJofRightRegion);
+    for( int j=jFirst; j<jLeft; ++j ) {
+        // Uniaxial PML along X axis
+        float dx = C1*(u1[j+1]-u1[j])+C2*(u1[j+2]-u1[j-1]);
+        float dy = C1*(u2[j]-u1[j])+C2*(u3[j]-u0[j]);
+        vx[j] = DL0[j]*vx[j]+DL2[j]*(a1[j+1]+a1[j])*dx;
+        vy[j] = d1*vy[j]+d3*(a2[j]+a1[j])*dy;
+    }
+    int j = Max(jFirst,DampSize);
+    const int jEnd = Min(jLast,LeftJofRightRegion);
+    if( k<0 ) {
+#if USE_AVX
+        if( VelocityKernel4 )
+            j = VelocityKernel4( *this, i, j, jEnd );
+#endif /* USE_AVX */
+#if USE_SSE && !HALF_FIELDS
+        // SSE form of the loop below, with no damping.
+        const __m128 c1 = _mm_set1_ps(C1), c2 = _mm_set1_ps(C2);
+        for( ; j+4<=jEnd; j+=4 ) {
+            __m128 u = LOAD(u1[j]);
+            __m128 a = LOAD(a1[j]);
+            __m128 dx = ADD(MUL(c1,SUB(LOAD(u1[j+1]),u)),MUL(c2,SUB(LOAD(u1[j+2]),LOAD(u1[j-1]))));
+            __m128 dy = ADD(MUL(c1,SUB(LOAD(u2[j]),u)),MUL(c2,SUB(LOAD(u3[j]),LOAD(u0[j]))));
+            _mm_storeu_ps(&vx[j],ADD(LOAD(vx[j]),MUL(ADD(LOAD(a1[j+1]),a),dx)));
+            _mm_storeu_ps(&vy[j],ADD(LOAD(vy[j]),MUL(ADD(LOAD(a2[j]),a),dy)));
+        }
+#endif /* USE_SSE && !HALF_FIELDS */
+    }
+    for( ; j<jEnd; ++j ) {
+        float dx = C1*(u1[j+1]-u1[j])+C2*(u1[j+2]-u1[j-1]);
+        float dy = C1*(u2[j]-u1[j])+C2*(u3[j]-u0[j]);
+        vx[j] += (a1[j+1]+a1[j])*dx;
+        vy[j] = d1*vy[j]+d3*(a2[j]+a1[j])*dy;
+    }
+    for( int j=jRight, l=j-LeftJofRightRegion; j<jLast; ++j, ++l ) {
+        // Uniaxial PML along X axis
+        float dx = C1*(u1[j+1]-u1[j])+C2*(u1[j+2]-u1[j-1]);
+        float dy = C1*(u2[j]-u1[j])+C2*(u3[j]-u0[j]);
+        vx[j] = D1[l]*vx[j]+D3[l]*(a1[j+1]+a1[j])*dx;
+        vy[j] = d1*vy[j]+d3*(a2[j]+a1[j])*dy;
+    }
+}
+
+//! Advance U and the PML "psi" fields of row i, columns [jFirst,jLast), by one timestep with fourth-order differences.
+/** Reads velocities of the same timestep in rows [i-2,i+1] and columns [jFirst-2,jLast].  As in UpdateVelocityRow4,
+    the PML regions use the fourth-order differences, and only row 1 is second order along y. */
+void WavefieldState::UpdatePressureRow4( int i, int jFirst, int jLast ) {
+    LOCAL_FIELDS(*this);
+    LOCAL_PSI_FIELDS(*this);
+    Assert( 1<=i );
+    // Row 1 has only the surface row of Vy above it, so its difference along y is second order.
+    const float c1 = i>1 ? C1 : 1;
+    const float c2 = i>1 ? C2 : 0;
+    const WaveValue* vx = Vx[i];
+    const WaveValue* vy0 = Vy[i>1 ? i-2 : i-1];
+    const WaveValue* vy1 = Vy[i-1];
+    const WaveValue* vy2 = Vy[i];
+    const WaveValue* vy3 = Vy[i+1];
+    const float* b = B[i];
+    WaveValue* u = U[i];
+    float* pl = Pl[i];
+    float* pr = Pr[i];
+    // Damping along y, which is none above the bottom PML region.
+    const int k = i-TopIofBottomRegion;
+    Assert( k<DampSize );
+    const bool bottom = k>=0;
+    const float d0 = bottom ? D0[k] : 1;
+    const float d2 = bottom ? D2[k] : 1;
+    const float d4 = bottom ? D4[k] : 0;
+    float* pb = bottom ? Pb[k] : nullptr;
+    const int jLeft = Min(jLast,DampSize);
+    const int jRight = Max(jFirst,LeftJofRightRegion);
+    for( int j=jFirst; j<jLeft; ++j ) {
+        // Uniaxial PML along X axis
+        float dx = C1*(vx[j]-vx[j-1])+C2*(vx[j+1]-vx[j-2]);
+        float dy = c1*(vy2[j]-vy1[j])+c2*(vy3[j]-vy0[j]);
+        u[j] = d0*DL1[j]*u[j]+b[j]*(DL3[j]*(dx+pl[j]) + d2*(dy+(bottom ? pb[j] : 0)));
+        if( bottom )
+            pb[j] = D6*pb[j]+d4*dx;
+        pl[j] = D6*pl[j]+DL5[j]*dy;
+    }
+    const int j0 = Max(jFirst,DampSize);
+    const int j1 = Min(jLast,LeftJofRightRegion);
+    if( bottom ) {
+        // Uniaxial PML along Y axis
+        for( int j=j0; j<j1; ++j ) {
+            float dx = C1*(vx[j]-vx[j-1])+C2*(vx[j+1]-vx[j-2]);
+            float dy = c1*(vy2[j]-vy1[j])+c2*(vy3[j]-vy0[j]);
+            u[j] = d0*u[j]+b[j]*(dx+d2*(dy+pb[j]));
+            pb[j] = D6*pb[j]+d4*dx;
+        }
+    } else {
+        int j = j0;
+#if USE_AVX
+        if( PressureKernel4 )
+            j = PressureKernel4( *this, i, j, j1 );
+#endif /* USE_AVX */
+#if USE_SSE && !HALF_FIELDS
+        // SSE form of the loop below.
+        const __m128 c1x = _mm_set1_ps(C1), c2x = _mm_set1_ps(C2);
+        const __m128 c1y = _mm_set1_ps(c1), c2y = _mm_set1_ps(c2);
+        for( ; j+4<=j1; j+=4 ) {
+            __m128 dx = ADD(MUL(c1x,SUB(LOAD(vx[j]),LOAD(vx[j-1]))),MUL(c2x,SUB(LOAD(vx[j+1]),LOAD(vx[j-2]))));
+            __m128 dy = ADD(MUL(c1y,SUB(LOAD(vy2[j]),LOAD(vy1[j]))),MUL(c2y,SUB(LOAD(vy3[j]),LOAD(vy0[j]))));
+            _mm_storeu_ps(&u[j],ADD(LOAD(u[j]),MUL(LOAD(b[j]),ADD(dx,dy))));
+        }
+#endif /* USE_SSE && !HALF_FIELDS */
+        for( ; j<j1; ++j ) {
+            float dx = C1*(vx[j]-vx[j-1])+C2*(vx[j+1]-vx[j-2]);
+            float dy = c1*(vy2[j]-vy1[j])+c2*(vy3[j]-vy0[j]);
+            u[j] = u[j]+b[j]*(dx+dy);
+        }
+    }
+    for( int j=jRight, l=j-LeftJofRightRegion; j<jLast; ++j, ++l ) {
+        // Uniaxial PML along X axis
+        float dx = C1*(vx[j]-vx[j-1])+C2*(vx[j+1]-vx[j-2]);
+        float dy = c1*(vy2[j]-vy1[j])+c2*(vy3[j]-vy0[j]);
+        u[j] = d0*D0[l]*u[j]+b[j]*(D2[l]*(dx+pr[l]) + d2*(dy+(bottom ? pb[j] : 0)));
+        if( bottom )
+            pb[j] = D6*pb[j]+d4*dx;
+        pr[l] = D6*pr[l]+D4[l]*dy;
+    }
+}
+
+//! Shift [iFirst,iLast) x [jFirst,jLast), the velocities that UpdateTile4 updates for a tile, to the cells of U that it updates.
+/** U lags a row and a column behind, except at the edges of the grid, where there is nothing left to lag behind,
+    and in row 0, which is fixed. */
+inline void WavefieldState::LagToU( int& iFirst, int& iLast, int& jFirst, int& jLast ) const {
+    iFirst = Max( iFirst-1, 1 );
+    if( iLast<PanelLastI[NumPanel-1] )
+        iLast -= 1;
+    jFirst = Max( jFirst-1, 0 );
+    if( jLast<WavefieldWidth )
+        jLast -= 1;
+}
+
+//! Advance the velocities, or U and the PML "psi" fields, of row i in columns [jFirst,jLast) by one timestep.
+inline void WavefieldState::UpdateSpan4( int i, int jFirst, int jLast, bool velocity ) {
+    if( jFirst>=jLast )
+        return;
+    if( velocity )
+        UpdateVelocityRow4( i, jFirst, jLast );
+    else
+        UpdatePressureRow4( i, jFirst, jLast );
+}
+
+//! Advance the velocities, or U and the PML "psi" fields, of row i in columns [jFirst,jLast) of panel p by one timestep.
+/** If p>=0, skips the interior cells outside the causal cone and in quiescent blocks.  PML regions are never
+    skipped.  At the edges of a tile, the velocities and U of a cell belong to different tiles, so cells are
+    skipped one by one, lest only half of a cell be updated. */
+inline void WavefieldState::UpdateRow4( int p, int i, int jFirst, int jLast, bool velocity ) {
+    // Interior columns [kFirst,kLast) may be skipped.
+    int kFirst = Max( jFirst, DampSize );
+    int kLast = Min( jLast, LeftJofRightRegion );
+    if( p<0 || i>=TopIofBottomRegion || kFirst>=kLast ) {
+        UpdateSpan4( i, jFirst, jLast, velocity );
+        return;
+    }
+    UpdateSpan4( i, jFirst, kFirst, velocity );
+    UpdateSpan4( i, kLast, jLast, velocity );
+#if RESTRICT_TO_CAUSAL_CONE
+    if( ConeRadius>=0 ) {
+        const int r = ConeRadius-std::abs( i-(ConeY+PanelFirstI[p]-PanelFirstY[p]) );
+        kFirst = Max( kFirst, ConeJ-r );
+        kLast = Min( kLast, ConeJ+r+1 );
+    }
+#endif /* RESTRICT_TO_CAUSAL_CONE */
+#if SKIP_QUIESCENT_TILES
+    if( SkipThisFrame && 1<=i ) {
+        const char* awake = &BlockAwake[BlockRowOfYPlus1[i+PanelFirstY[p]-PanelFirstI[p]+1]*BlockColCount];
+        for( int j0=kFirst; j0<kLast; ) {
+            const int c = j0/ActivityBlockWidth;
+            const int j1 = Min( kLast, (c+1)*ActivityBlockWidth );
+            if( awake[c] )
+                UpdateSpan4( i, j0, j1, velocity );
+            j0 = j1;
+        }
+        return;
+    }
+#endif /* SKIP_QUIESCENT_TILES */
+    UpdateSpan4( i, kFirst, kLast, velocity );
+}
+
+//! Advance tile t of panel p by one timestep with the fourth-order stencil.
+/** U needs the velocities of the same timestep one row below and one column to the right, so it lags behind
+    them as described by LagToU.  The tiles of a timestep still partition the cells of U.  Each row of
+    velocities is followed by the row of U above it.  The tag does not matter, because each row splits at
+    the PML regions itself.  Updates every cell if p<0. */
+void WavefieldState::UpdateTile4( Tile t, int p ) {
+    const int iFirst = t.iFirst;
+    const int iLast = iFirst+t.iLen;
+    const int jFirst = t.jFirstOver8*8;
+    const int jLast = jFirst+t.jLenOver8*8;
+    int uiFirst = iFirst, uiLast = iLast, ujFirst = jFirst, ujLast = jLast;
+    LagToU( uiFirst, uiLast, ujFirst, ujLast );
+    for( int i=iFirst; i<iLast; ++i ) {
+        UpdateRow4( p, i, jFirst, jLast, /*velocity=*/true );
+        if( i-1>=uiFirst )
+            UpdateRow4( p, i-1, ujFirst, ujLast, /*velocity=*/false );
+    }
+    for( int i=Max(iLast-1,uiFirst); i<uiLast; ++i )
+        UpdateRow4( p, i, ujFirst, ujLast, /*velocity=*/false );
+}
+
+void WavefieldState::WavefieldUpdatePanel( int p ) {
+    const int airgunJ = AirgunX+HIDDEN_BORDER_SIZE;
+    const int airgunI = (AirgunY-PanelFirstY[p])+PanelFirstI[p];
+    const Tile* tFirst = PanelFirstTile[p];
+    const Tile* tLast = PanelLastTile[p];
+    const Tile* tHalo = PanelHaloTile[p];
+    if( p>0 && PanelTransferCount>0 )
+        ExchangeZone(p);
+    for( const Tile* ptr=tFirst; ptr<tLast; ++ptr ) {
+        if( ptr==tHalo && PanelTransferCount>0 )
+            ExchangeZone(p+1);
+        Tile t = *ptr;
+        int iFirst = t.iFirst;
+        int iLast = iFirst+t.iLen;
+        int jFirst = t.jFirstOver8*8;
+        int jLast = jFirst+t.jLenOver8*8;
+#if RESTRICT_TO_CAUSAL_CONE
+        // UpdateTile4 updates U one row above and one column left of the tile.
+        if( ConeRadius>=0 && IsInteriorTile(t) && !IsInCone( p, iFirst-TileLag(), iLast, jFirst-TileLag(), jLast ) )
+            continue;
+#endif /* RESTRICT_TO_CAUSAL_CONE */
+#if SKIP_QUIESCENT_TILES
+        const TileActivity& a = TileActivityArray[ptr-TileArray.data()];
+        if( SkipThisFrame && a.skippable && !IsAwake(a) )
+            continue;
+#endif /* SKIP_QUIESCENT_TILES */
+        if( SpatialOrder==4 ) {
+            UpdateTile4( t, p );
+            // The airgun drives U, and the activity of a cell is final only once U and the velocities both are.
+            LagToU( iFirst, iLast, jFirst, jLast );
+        } else {
+            UpdateTile(t);
         }
         if( iFirst<=airgunI && airgunI<iLast && jFirst<=airgunJ && airgunJ<jLast ) {
             Assert( 0<=AirgunImpulseCounter[p] && AirgunImpulseCounter[p]<PumpFactor );
             U[airgunI][airgunJ] += AirgunImpulseValue[AirgunImpulseCounter[p]++];
         }
+#if SKIP_QUIESCENT_TILES
+        if( a.last && SkipQuiescent )
+            MarkActivity( p, iFirst, iLast, jFirst, jLast );
+#endif /* SKIP_QUIESCENT_TILES */
     }
 }
 
-void WavefieldCopySurface( float* output, int w ) {
-    Assert(w==WavefieldWidth-2*HIDDEN_BORDER_SIZE);
-    for( int j=HIDDEN_BORDER_SIZE; j<w+HIDDEN_BORDER_SIZE; ++j )
-        *output++ = Vy[1][j];
+//! Advance only the velocities, or only U and the PML "psi" fields, of the half-row tile t by one timestep.
+/** Together the two halves compute the same values as UpdateTile.  Half rows are never in the top row
+    or the bottom PML region. */
+void WavefieldState::UpdateHalfRow( Tile t, bool velocity ) {
+    LOCAL_FIELDS(*this);
+    LOCAL_PSI_FIELDS(*this);
+    const int leftJofRightRegion = LeftJofRightRegion;
+    const int i = t.iFirst;
+    int jFirst = t.jFirstOver8*8;
+    int jLast = jFirst+t.jLenOver8*8;
+    Assert( t.iLen==0 );
+    switch( t.tag ) {
+        case TT_Left:
+            for( int j=jFirst; j<jLast; ++j )
+                if( velocity ) {
+                    float u = U[i][j];
+                    Vx[i][j] = DL0[j]*Vx[i][j]+DL2[j]*(A[i][j+1]+A[i][j])*(U[i][j+1]-u);
+                    Vy[i][j] =        Vy[i][j]+       (A[i+1][j]+A[i][j])*(U[i+1][j]-u);
+                } else {
+                    U [i][j] = DL1[j]*U[i][j]+B[i][j]*(DL3[j]*((Vx[i][j]-Vx[i][j-1])+Pl[i][j]) + (Vy[i][j]-Vy[i-1][j]));
+                    Pl[i][j] = D6    *Pl[i][j]+         DL5[j]*                                   (Vy[i][j]-Vy[i-1][j]);
+                }
+            break;
+        case TT_HeterogeneousInterior:
+#if USE_AVX
+            if( TileKernelOfTag[TT_HeterogeneousInterior] ) {
+                // Fuse each multiply-add like the AVX kernels, so that split tiling rounds like the other schedules.
+                if( velocity )
+                    HalfRowVelocityAVX2( *this, i, jFirst, jLast );
+                else
+                    HalfRowPressureAVX2( *this, i, jFirst, jLast );
+                break;
+            }
+#endif /* USE_AVX */
+            for( int j=jFirst; j<jLast; ++j )
+                if( velocity ) {
+                    float u = U[i][j];
+                    Vx[i][j] += (A[i][j+1]+A[i][j])*(U[i][j+1]-u);
+                    Vy[i][j] += (A[i+1][j]+A[i][j])*(U[i+1][j]-u);
+                } else {
+                    U [i][j] = U[i][j] + B[i][j]*((Vx[i][j]-Vx[i][j-1]) + (Vy[i][j]-Vy[i-1][j]));
+                }
+            break;
+        case TT_Right:
+            for( int j=jFirst, l=j-leftJofRightRegion; j<jLast; ++j, ++l )
+                if( velocity ) {
+                    float u = U[i][j];
+                    Vx[i][j] = D1[l]*Vx[i][j]+D3[l]*(A[i][j+1]+A[i][j])*(U[i][j+1]-u);
+                    Vy[i][j] =       Vy[i][j]+      (A[i+1][j]+A[i][j])*(U[i+1][j]-u);
+                } else {
+                    U [i][j] = D0[l]*U[i][j]+B[i][j]*(D2[l]*((Vx[i][j]-Vx[i][j-1])+Pr[i][l]) + (Vy[i][j]-Vy[i-1][j]));
+                    Pr[i][l] = D6   *Pr[i][l]+         D4[l]*                                   (Vy[i][j]-Vy[i-1][j]);
+                }
+            break;
+        default:
+            Assert(false);
+    }
 }
 
-static float WaveClutShowsGeology;
-static float WaveClutShowsSeismic;
-static ColorFunc WaveClutColorFunc;
-
-static NimblePixel WaveClut[RockTypeMax+2][SAMPLE_CLUT_SIZE];
+//! Update panel p (phase 0) or the diamond between panels p-1 and p (phase 1) with split tiling.
+/** Panels can be updated in parallel, and then the diamonds can be updated in parallel. */
+void WavefieldState::WavefieldUpdateSplit( int p, int phase ) {
+    Assert( SplitTiling );
+    const int airgunJ = AirgunX+HIDDEN_BORDER_SIZE;
+    const int airgunI = IofY(AirgunY);
+    const Tile* tFirst = phase==0 ? PanelFirstTile[p] : BoundaryFirstTile[p];
+    const Tile* tLast = phase==0 ? PanelLastTile[p] : BoundaryLastTile[p];
+    for( const Tile* ptr=tFirst; ptr<tLast; ++ptr ) {
+        Tile t = *ptr;
+        int iFirst = t.iFirst;
+        int iLast = iFirst+t.iLen;
+        int jFirst = t.jFirstOver8*8;
+        int jLast = jFirst+t.jLenOver8*8;
+        if( t.iLen==0 ) {
+            UpdateHalfRow( t, /*velocity=*/phase==0 );
+            // Only the U-only half row completes the timestep for its cells.
+            if( phase==0 )
+                continue;
+            iLast = iFirst+1;
+        } else {
+            UpdateTile(t);
+        }
+        if( iFirst<=airgunI && airgunI<iLast && jFirst<=airgunJ && airgunJ<jLast ) {
+            Assert( 0<=AirgunImpulseCounter[0] && AirgunImpulseCounter[0]<PumpFactor );
+            U[airgunI][airgunJ] += AirgunImpulseValue[AirgunImpulseCounter[0]++];
+        }
+    }
+}
 
-static void ComputeWaveClut( const NimblePixMap& map, float showGeology, float showSeismic, ColorFunc colorFunc ) {
+void WavefieldState::ComputeWaveClut( const NimblePixMap& map, float showGeology, float showSeismic, ColorFunc colorFunc ) {
     Assert(0<=showGeology && showGeology<=1);
     Assert(0<=showSeismic && showSeismic<=1);
     // Check against current CLUT
@@ -764,7 +2585,69 @@ static void ComputeWaveClut( const NimblePixMap& map, float showGeology, float s
         ColorFuncMakeClut( WaveClut[r], r, map, showGeology, showSeismic, colorFunc );
 }
 
-static void WavefieldDrawPanel( int p, const NimblePixMap& map ) {
+#if USE_AVX
+//! Kernel that colors w pixels of a row, given the wave samples and rock types of the row.
+/** clut points to the entry for sample 0 of the subCLUT for rock type 0, so that a subCLUT is found by adding
+    the rock type shifted left by SAMPLE_CLUT_LG_SIZE.  w must be a multiple of 4. */
+typedef void (*DrawRowKernel)( const WaveValue* in, const byte* rock, NimblePixel* out, int w, const NimblePixel* clut );
+
+// The draw kernels clamp and round exactly like the SSE code in WavefieldDrawPanel, so the pixels are the same.
+
+//! Color pixels [j,w) of a row one at a time, for the columns left over by the wider kernels.
+static inline void DrawRowTail( const WaveValue* in, const byte* rock, NimblePixel* out, int j, int w, const NimblePixel* clut ) {
+    const __m128 upperLimit = _mm_set_ss(SAMPLE_CLUT_SIZE/2-1);
+    const __m128 lowerLimit = _mm_set_ss(-SAMPLE_CLUT_SIZE/2);
+    for( ; j<w; ++j ) {
+        __m128 v = _mm_max_ss(_mm_min_ss(_mm_set_ss(float(in[j])),upperLimit),lowerLimit);
+        out[j] = clut[_mm_cvt_ss2si(v)+int((rock[j>>2]>>(2*(j&3))&3)<<SAMPLE_CLUT_LG_SIZE)];
+    }
+}
+
+TARGET_AVX2 static void DrawRowAVX2( const WaveValue* in, const byte* rock, NimblePixel* out, int w, const NimblePixel* clut ) {
+    const __m256 upperLimit = _mm256_set1_ps(SAMPLE_CLUT_SIZE/2-1);
+    const __m256 lowerLimit = _mm256_set1_ps(-SAMPLE_CLUT_SIZE/2);
+    int j = 0;
+    for( ; j+8<=w; j+=8 ) {
+        __m256 v = _mm256_max_ps(_mm256_min_ps(LOADW8(in[j]),upperLimit),lowerLimit);
+        __m256i r = _mm256_slli_epi32(UnpackRock8(rock[j>>2] | rock[(j>>2)+1]<<8),SAMPLE_CLUT_LG_SIZE);
+        __m256i k = _mm256_add_epi32(_mm256_cvtps_epi32(v),r);
+        _mm256_storeu_si256((__m256i*)(out+j),_mm256_i32gather_epi32((const int*)clut,k,4));
+    }
+    DrawRowTail( in, rock, out, j, w, clut );
+}
+
+TARGET_AVX512 static void DrawRowAVX512( const WaveValue* in, const byte* rock, NimblePixel* out, int w, const NimblePixel* clut ) {
+    const __m512 upperLimit = _mm512_set1_ps(SAMPLE_CLUT_SIZE/2-1);
+    const __m512 lowerLimit = _mm512_set1_ps(-SAMPLE_CLUT_SIZE/2);
+    int j = 0;
+    for( ; j+16<=w; j+=16 ) {
+        __m512 v = _mm512_max_ps(_mm512_min_ps(LOADW16(0xFFFF,in[j]),upperLimit),lowerLimit);
+        __m512i r = _mm512_slli_epi32(UnpackRock16(RockBits(rock,j)),SAMPLE_CLUT_LG_SIZE);
+        __m512i k = _mm512_add_epi32(_mm512_cvtps_epi32(v),r);
+        _mm512_storeu_si512(out+j,_mm512_i32gather_epi32(k,clut,4));
+    }
+    DrawRowTail( in, rock, out, j, w, clut );
+}
+
+static_assert( sizeof(NimblePixel)==4, "draw kernels gather 32-bit pixels" );
+
+//! Return the widest draw kernel that the host supports, or nullptr if the SSE code in WavefieldDrawPanel should be used.
+static DrawRowKernel ChooseDrawRowKernel() {
+    switch( SimdLevelOfHost() ) {
+        case SIMD_AVX512:
+            return DrawRowAVX512;
+        case SIMD_AVX2:
+            return DrawRowAVX2;
+        default:
+            return nullptr;
+    }
+}
+
+static const DrawRowKernel DrawRowKernelOfHost = ChooseDrawRowKernel();
+#endif /* USE_AVX */
+
+//! Draw the visible rows of panel p from source, which is U, or a copy made by CopyPanelForDraw if copied is true.
+void WavefieldState::WavefieldDrawPanel( int p, const NimblePixMap& map, const WaveFieldType& source, bool copied ) const {
     const int w = map.width();
     const int h = map.height();
     Assert( h>0 );
@@ -779,23 +2662,40 @@ static void WavefieldDrawPanel( int p, const NimblePixMap& map ) {
 #endif /* USE_SSE */
 
     const NimblePixel* clut = WaveClut[0]+SAMPLE_CLUT_SIZE/2;
+    const WaveFieldType::View U(source);
+    const int jFirst = copied ? 0 : HIDDEN_BORDER_SIZE;
     int firstY = Max(0,PanelFirstY[p]);
     int lastY = Min(PanelFirstY[p+1],h);
     for( int y=firstY; y<lastY; ++y ) {
         int i = IofY(y);
         const byte* rock = &RockMap[i][HIDDEN_BORDER_SIZE>>2];
-#if USE_SSE
-        const __m128* in = (__m128*)&U[i][HIDDEN_BORDER_SIZE];
+        const int k = copied ? y : i;
+#if HALF_FIELDS
+        const WaveValue* in = &U[k][jFirst];
+#elif USE_SSE
+        const __m128* in = (__m128*)&U[k][jFirst];
 #else
-        const float* in = &U[i][HIDDEN_BORDER_SIZE];
+        const float* in = &U[k][jFirst];
 #endif
         NimblePixel* out = (NimblePixel*)map.at(0,y);
+#if USE_AVX
+        if( DrawRowKernelOfHost ) {
+            // The kernels gather from all of WaveClut, which holds the subCLUTs one after another.
+            DrawRowKernelOfHost( &U[k][jFirst], rock, out, w, clut );
+            continue;
+        }
+#endif /* USE_AVX */
 #pragma ivdep
         for( int j=0; j<w; j+=4, ++rock ) {
             unsigned r = *rock<<SAMPLE_CLUT_LG_SIZE;
             const unsigned SUBCLUT_MASK = 3<<SAMPLE_CLUT_LG_SIZE;
 #if USE_SSE
+#if HALF_FIELDS
+            __m128 v = _mm_max_ps(_mm_min_ps(_mm_cvtph_ps(_mm_loadl_epi64((const __m128i*)in)),upperLimit),lowerLimit);
+            in += 4;
+#else
             __m128 v = _mm_max_ps(_mm_min_ps(*in++,upperLimit),lowerLimit);
+#endif /* HALF_FIELDS */
             // The redundant cast to int works around a bug in Apple LLVM version 7.0.0 (clang-700.1.76)
             // that otherwise causes Seismic Duck to crash.
 #define STEP(k) out[k] = clut[int(_mm_cvt_ss2si(_mm_shuffle_ps(v,v,k))+(r>>(2*k)&SUBCLUT_MASK))]
@@ -818,8 +2718,21 @@ static void WavefieldDrawPanel( int p, const NimblePixMap& map ) {
     }
 }
 
+//! Copy the visible rows of panel p of U to DrawCopy[DrawCopyBack].
+/** Leaves clamping and color lookup to the drawing, so that the update spends as little time on it as possible. */
+void WavefieldState::CopyPanelForDraw( int p, const NimblePixMap& map ) {
+    const int w = map.width();
+    const int h = map.height();
+    WaveFieldType& copy = DrawCopy[DrawCopyBack];
+    Assert( w==copy.width() && h==copy.height() );
+    int firstY = Max(0,PanelFirstY[p]);
+    int lastY = Min(PanelFirstY[p+1],h);
+    for( int y=firstY; y<lastY; ++y )
+        std::memcpy( copy[y], &U[IofY(y)][HIDDEN_BORDER_SIZE], w*sizeof(WaveValue) );
+}
+
 #if DRAW_TILES
-static void WavefieldDrawTiles( int p, const NimblePixMap& map ) {
+void WavefieldState::WavefieldDrawTiles( int p, const NimblePixMap& map ) const {
     const int h = WavefieldHeight;
     const int w = WavefieldWidth;
     Assert(w==map.width()+2*HIDDEN_BORDER_SIZE);
@@ -868,31 +2781,76 @@ static void WavefieldDrawTiles( int p, const NimblePixMap& map ) {
 #endif /* DRAW_TILES */
 
 //! Operations required by parallel_ghost_cell template.
+/** The panels exchange their overlap zones themselves, in WavefieldUpdatePanel, so that the copies
+    run in parallel with the interiors of other panels.  The caller must call ResetZones first. */
 class UpdateOps {
+    WavefieldState& state;
     const NimblePixMap& map;
     const NimbleRequest request;
+    //! Panel for chunk 0.  Nonzero for a part other than the first of a partitioned engine.
+    const int firstPanel;
+    //! If true, a draw request copies U for pipelined drawing instead of drawing.
+    const bool copy;
 public:
-    void exchangeBorders( int p ) const {
-        Assert(0<p);
-        Assert(p<NumPanel);
-        ReplicateZone(p,/*all=*/false);
-    }
+    void exchangeBorders( int ) const {}
 
-    void updateInterior( int p ) const {
+    void updateInterior( int k ) const {
+        const int p = firstPanel+k;
+        TraceEvent1("updateInterior",p);
         if( request&NimbleUpdate )
-            WavefieldUpdatePanel( p );
+            state.WavefieldUpdatePanel( p );
         if( request&NimbleDraw ) {
-            WavefieldDrawPanel( p, map );
+            if( copy ) {
+                state.CopyPanelForDraw( p, map );
+            } else {
+                state.WavefieldDrawPanel( p, map, state.U, /*copied=*/false );
 #if DRAW_TILES
-            WavefieldDrawTiles( p, map );
+                state.WavefieldDrawTiles( p, map );
 #endif /* DRAW_TILES */
+            }
         }
     }
-    UpdateOps( const NimblePixMap& map_, NimbleRequest request_ ) : map(map_), request(request_) {}
+    UpdateOps( WavefieldState& state_, const NimblePixMap& map_, NimbleRequest request_, int firstPanel_, bool copy_ ) :
+        state(state_), map(map_), request(request_), firstPanel(firstPanel_), copy(copy_) {}
+};
+
+//! Operations for drawing the previous frame from its copy, for parallel_ghost_cell.
+/** Chunk k draws the rows of panel firstPanel+k. */
+class DrawCopyOps {
+    const WavefieldState& state;
+    const NimblePixMap& map;
+    const int firstPanel;
+public:
+    void exchangeBorders( int ) const {}
+    void updateInterior( int k ) const {
+        const int p = firstPanel+k;
+        TraceEvent1("drawCopy",p);
+        state.WavefieldDrawPanel( p, map, state.DrawCopy[1-state.DrawCopyBack], /*copied=*/true );
+#if DRAW_TILES
+        state.WavefieldDrawTiles( p, map );
+#endif /* DRAW_TILES */
+    }
+    DrawCopyOps( const WavefieldState& state_, const NimblePixMap& map_, int firstPanel_ ) :
+        state(state_), map(map_), firstPanel(firstPanel_) {}
+};
+
+//! Operations for one phase of split tiling, for parallel_ghost_cell.
+/** There are no overlap zones to exchange.  Phase 1 has nothing to do for panel 0, which has no diamond above it. */
+class SplitOps {
+    WavefieldState& state;
+    const int phase;
+public:
+    void exchangeBorders( int ) const {}
+    void updateInterior( int p ) const {
+        TraceEvent1("updateSplit",p);
+        if( phase==0 || p>0 )
+            state.WavefieldUpdateSplit( p, phase );
+    }
+    SplitOps( WavefieldState& state_, int phase_ ) : state(state_), phase(phase_) {}
 };
 
 #if DRAW_COLOR_SCALE
-static void DrawColorScale( const NimblePixMap& map ) {
+void WavefieldState::DrawColorScale( const NimblePixMap& map ) const {
     int xScale = 3;
     int xLimit = Min(SAMPLE_CLUT_SIZE/xScale,map.width());
     for( int y=0; y<24; ++y ) {
@@ -903,22 +2861,897 @@ static void DrawColorScale( const NimblePixMap& map ) {
 }
 #endif /* DRAW_COLOR_SCALE */
 
-void WavefieldUpdateDraw( const NimblePixMap& map, NimbleRequest request, float showGeology, float showSeismic, ColorFunc colorFunc ) {
-    ComputeWaveClut( map, showGeology, showSeismic, colorFunc );
-    ComputeTiling();
+//! Update and/or draw panels [pFirst,pLast).  If copy is true, copy U for pipelined drawing instead of drawing.
+void WavefieldState::UpdatePanels( const NimblePixMap& map, NimbleRequest request, bool copy, int pFirst, int pLast ) {
     if( request&NimbleUpdate ) {
+        ++FrameCount;
         int i = IofY(AirgunY);
         int j = AirgunX+HIDDEN_BORDER_SIZE;
         float a = A[i][j];
         for( int k=0; k<PumpFactor; ++k )
-            AirgunImpulseValue[k] = AirgunGetImpulse( a );
+            AirgunImpulseValue[k] = TheAirgun.getImpulse( a );
         for( int p=0; p<NumPanel; ++p )
             AirgunImpulseCounter[p] = 0;
+        ResetZones();
+        if( PartCount>1 )
+            ExchangeHalos( pFirst, pLast );
+#if RESTRICT_TO_CAUSAL_CONE
+        UpdateCone();
+#endif /* RESTRICT_TO_CAUSAL_CONE */
+#if SKIP_QUIESCENT_TILES
+        WakeBlocks();
+#endif /* SKIP_QUIESCENT_TILES */
+        if( SplitTiling ) {
+            // Each phase must finish before the next one starts.
+            parallel_ghost_cell(NumPanel,SplitOps(*this,0));
+            parallel_ghost_cell(NumPanel,SplitOps(*this,1));
+            request = request-NimbleUpdate;
+        }
+    }
+    UpdateOps g(*this,map,request,pFirst,copy);
+    parallel_ghost_cell(pLast-pFirst,g);
+}
+
+void WavefieldState::UpdateDraw( const NimblePixMap& map, NimbleRequest request, float showGeology, float showSeismic, ColorFunc colorFunc ) {
+    if( request&NimbleDraw )
+        ComputeWaveClut( map, showGeology, showSeismic, colorFunc );
+    ComputeTiling();
+    // Panels that this engine updates.
+    Assert( PartCount==1 || (!SplitTiling && PartCount<=NumPanel) );
+    const int pFirst = NumPanel*PartIndex/PartCount;
+    const int pLast = NumPanel*(PartIndex+1)/PartCount;
+    if( PipelinedDraw && (request&NimbleUpdate) && (request&NimbleDraw) ) {
+        if( !DrawCopyValid || map.width()!=DrawCopy[0].width() || map.height()!=DrawCopy[0].height() ) {
+            // Start the pipeline with a copy of the current wavefield, so that no frame is skipped.
+            for( WaveFieldType& b: DrawCopy )
+                b.resize( map.height(), map.width(), /*zero=*/false );
+            UpdatePanels( map, NimbleDraw, /*copy=*/true, pFirst, pLast );
+            DrawCopyBack = 1-DrawCopyBack;
+        }
+        // Draw the current wavefield from its copy while the update computes the next one and copies it.
+        ParallelInvoke( [&]{parallel_ghost_cell( pLast-pFirst, DrawCopyOps(*this,map,pFirst) );},
+                        [&]{UpdatePanels( map, request, /*copy=*/true, pFirst, pLast );} );
+        DrawCopyBack = 1-DrawCopyBack;
+        DrawCopyValid = true;
+    } else {
+        // The copies do not follow updates outside the pipeline.
+        if( request&NimbleUpdate )
+            DrawCopyValid = false;
+        UpdatePanels( map, request, /*copy=*/false, pFirst, pLast );
     }
-    UpdateOps g(map,request);
-    parallel_ghost_cell(NumPanel,g);
 #if DRAW_COLOR_SCALE
     if( request&NimbleDraw )
         DrawColorScale(map);
 #endif /* DRAW_COLOR_SCALE */
 }
+
+//! Return name of host processor.
+static std::string HostCpuModel() {
+    char brand[49] = {};
+#if USE_AVX
+    unsigned r[4];      // eax, ebx, ecx, edx
+#if _MSC_VER
+    __cpuidex( (int*)r, int(0x80000000), 0 );
+#else
+    __cpuid_count( 0x80000000, 0, r[0], r[1], r[2], r[3] );
+#endif
+    if( r[0]>=0x80000004 )
+        for( unsigned k=0; k<3; ++k ) {
+#if _MSC_VER
+            __cpuidex( (int*)r, int(0x80000002+k), 0 );
+#else
+            __cpuid_count( 0x80000002+k, 0, r[0], r[1], r[2], r[3] );
+#endif
+            std::memcpy( brand+16*k, r, 16 );
+        }
+#endif /* USE_AVX */
+    const char* b = brand;
+    while( *b==' ' )
+        ++b;
+    return *b ? b : "unknown";
+}
+
+//! Return path of file that caches the tilings chosen by Autotune, or empty string if there is no place for it.
+/** Environment variable SEISMIC_DUCK_TILING_CACHE overrides the default location. */
+static std::string TilingCachePath() {
+    if( const char* path = std::getenv("SEISMIC_DUCK_TILING_CACHE") )
+        return path;
+#if _WIN32
+    const char* dir = std::getenv("LOCALAPPDATA");
+    return dir ? std::string(dir)+"\\SeismicDuckTiling.txt" : "";
+#else
+    if( const char* dir = std::getenv("XDG_CACHE_HOME") )
+        return std::string(dir)+"/seismic-duck-tiling.txt";
+    const char* home = std::getenv("HOME");
+    return home ? std::string(home)+"/.cache/seismic-duck-tiling.txt" : "";
+#endif
+}
+
+//! Tiling parameters chosen by Autotune.
+struct TilingChoice {
+    int tileHeight;
+    int tileWidth;
+    int numPanel;
+};
+
+//! Parse line of tiling cache, which has the form "tileHeight tileWidth numPanel key".
+/** Return true if the line is well formed and the parameters are within limits. */
+static bool ParseTilingLine( const char* line, TilingChoice& c, std::string& key ) {
+    int n = 0;
+    if( std::sscanf( line, "%d %d %d %n", &c.tileHeight, &c.tileWidth, &c.numPanel, &n )!=3 || n==0 )
+        return false;
+    key = line+n;
+    while( !key.empty() && (key.back()=='\n' || key.back()=='\r') )
+        key.pop_back();
+    return 1<=c.tileHeight && c.tileHeight<=15 && 8<=c.tileWidth && c.tileWidth<=8*63 && c.tileWidth%8==0
+           && 1<=c.numPanel && c.numPanel<=NUM_PANEL_MAX;
+}
+
+//! Look up the tiling cached for key.  Return true if found.
+static bool ReadCachedTiling( const std::string& key, TilingChoice& c ) {
+    std::string path = TilingCachePath();
+    FILE* f = path.empty() ? nullptr : std::fopen( path.c_str(), "r" );
+    if( !f )
+        return false;
+    bool found = false;
+    char line[512];
+    std::string k;
+    TilingChoice t;
+    while( !found && std::fgets( line, sizeof(line), f ) )
+        if( ParseTilingLine( line, t, k ) && k==key ) {
+            c = t;
+            found = true;
+        }
+    std::fclose(f);
+    return found;
+}
+
+//! Record the tiling for key in the cache, replacing any previous entry for key.
+/** Writes a temporary file and renames it, so that a crash or a concurrent writer never leaves a truncated cache.
+    Concurrent writers may lose each other's new entry.  Failure to write the cache is not an error, because it
+    only costs tuning again. */
+static void WriteCachedTiling( const std::string& key, const TilingChoice& c ) {
+    std::string path = TilingCachePath();
+    if( path.empty() )
+        return;
+    std::vector<std::string> lines;
+    if( FILE* f = std::fopen( path.c_str(), "r" ) ) {
+        char line[512];
+        std::string k;
+        TilingChoice t;
+        while( std::fgets( line, sizeof(line), f ) )
+            if( !ParseTilingLine( line, t, k ) || k!=key )
+                lines.push_back(line);
+        std::fclose(f);
+    }
+    // The temporary file is unique to this process, so that concurrent writers do not clobber it.
+#if _WIN32
+    const long long id = std::chrono::steady_clock::now().time_since_epoch().count();
+#else
+    const long long id = getpid();
+#endif
+    const std::string temp = path+"."+std::to_string(id)+".tmp";
+    FILE* f = std::fopen( temp.c_str(), "w" );
+    if( !f )
+        return;
+    for( const std::string& l: lines )
+        std::fputs( l.c_str(), f );
+    std::fprintf( f, "%d %d %d %s\n", c.tileHeight, c.tileWidth, c.numPanel, key.c_str() );
+    bool ok = !std::ferror(f);
+    if( std::fclose(f)!=0 )
+        ok = false;
+#if _WIN32
+    // Windows does not rename over an existing file.
+    if( ok )
+        std::remove( path.c_str() );
+#endif
+    if( !ok || std::rename( temp.c_str(), path.c_str() )!=0 )
+        std::remove( temp.c_str() );
+}
+
+//! Return the fastest time in seconds of a few runs of the given number of frames.
+/** Updates without drawing or airgun impulses, and without skipping quiescent tiles. */
+double WavefieldState::TimeUpdates( int frames ) {
+    using namespace std::chrono;
+    ComputeTiling();
+    Assert( !SplitTiling );
+#if SKIP_QUIESCENT_TILES
+    SkipThisFrame = false;
+#endif /* SKIP_QUIESCENT_TILES */
+    for( int k=0; k<PumpFactor; ++k )
+        AirgunImpulseValue[k] = 0;
+    NimblePixMap noMap;
+    UpdateOps g(*this,noMap,NimbleUpdate,0,/*copy=*/false);
+    double best = DBL_MAX;
+    for( int r=0; r<3; ++r ) {
+        auto start = steady_clock::now();
+        for( int f=0; f<frames; ++f ) {
+            for( int p=0; p<NumPanel; ++p )
+                AirgunImpulseCounter[p] = 0;
+            ResetZones();
+            parallel_ghost_cell(NumPanel,g);
+        }
+        best = Min( best, duration<double>(steady_clock::now()-start).count() );
+    }
+    return best;
+}
+
+//! Choose TileHeight, TileWidth and TrapezoidNumPanel for the host and the size of g, when running the given number of threads.
+/** The caller must let that many threads run while this times candidates.
+    Uses the choice cached for this processor model, thread count, size, and spatial order if there is one.
+    Otherwise times candidates with the real kernels, one parameter at a time, starting from
+    the current values, and caches the fastest.  Times trapezoid tiling even if PumpFactor
+    calls for split tiling.  Leaves the fields in a meaningless state. */
+void WavefieldState::Autotune( const Geology& g, int threads ) {
+    if( g.width()==TunedWidth && g.height()==TunedHeight )
+        return;
+    TunedWidth = g.width();
+    TunedHeight = g.height();
+    char prefix[64];
+    // Entries of the form "... threads ..." were tuned with however many threads happened to be active, so ignore them.
+    std::snprintf( prefix, sizeof(prefix), "%dx%d %d workers ", g.width(), g.height(), threads );
+    // The fourth-order stencil has its own entries.
+    if( SpatialOrder!=2 )
+        std::snprintf( prefix+std::strlen(prefix), sizeof(prefix)-std::strlen(prefix), "order %d ", SpatialOrder );
+    std::string key = prefix+HostCpuModel();
+    TilingChoice best;
+    if( ReadCachedTiling( key, best ) ) {
+        TileHeight = best.tileHeight;
+        TileWidth = best.tileWidth;
+        TrapezoidNumPanel = best.numPanel;
+        return;
+    }
+
+    const int pumpFactor = PumpFactor;
+    PumpFactor = Min(PumpFactor,PUMP_FACTOR_MAX);
+    Initialize(g);
+    // Choose frames per measurement so that each run takes roughly 10 msec.
+    int frames = Min( 20, Max( 2, int(0.01/Max(TimeUpdates(1),1E-6))+1 ) );
+    best = {TileHeight, TileWidth, TrapezoidNumPanel};
+    double bestTime = TimeUpdates(frames);
+    // Require a candidate to be clearly faster, so that timing noise does not move the choice.
+    auto consider = [&]( const TilingChoice& c ) {
+        double t = TimeUpdates(frames);
+        if( t<bestTime*0.98 ) {
+            best = c;
+            bestTime = t;
+        }
+    };
+
+    static const int heights[] = {4, 5, 6, 7, 9, 11, 13, 15};
+    for( int h: heights )
+        if( h!=best.tileHeight ) {
+            TileHeight = h;
+            currentPumpFactor = 0;
+            consider( {h, best.tileWidth, best.numPanel} );
+        }
+    TileHeight = best.tileHeight;
+
+    static const int widths[] = {56, 80, 112, 168, 248, 336, 504};
+    for( int w: widths )
+        if( w!=best.tileWidth ) {
+            TileWidth = w;
+            currentPumpFactor = 0;
+            consider( {best.tileHeight, w, best.numPanel} );
+        }
+    TileWidth = best.tileWidth;
+
+    // Keep the bottom PML region within the last panel.
+    for( int p=2; p<=NUM_PANEL_MAX && (g.height()+1)/p>=DampSize+StencilReach()*PUMP_FACTOR_MAX; ++p )
+        if( p!=best.numPanel ) {
+            TrapezoidNumPanel = p;
+            Initialize(g);
+            consider( {best.tileHeight, best.tileWidth, p} );
+        }
+    TrapezoidNumPanel = best.numPanel;
+    PumpFactor = pumpFactor;
+    currentPumpFactor = 0;
+
+    WriteCachedTiling( key, best );
+}
+
+//! Sections of a snapshot file.
+enum SnapshotSection {
+    //! Chunks in the chunk sections, as pairs of int32_t: the y coordinate of the row and the index of the block of columns.
+    SS_Chunks,
+    //! Chunk sections, with SnapshotBlockWidth columns per chunk.
+    SS_U, SS_Vx, SS_Vy,
+    //! Row sections for every row.  They are small, so deltas have them too.
+    SS_Pl, SS_Pr,
+    //! Row sections for every row, which never change, and so are only in full snapshots.
+    SS_A, SS_B, SS_RockMap,
+    //! Every row of the bottom PML "psi" field.
+    SS_Pb,
+    //! BlockActive, if the build tracks activity.
+    SS_Activity,
+    SS_N
+};
+
+//! Columns per chunk of a snapshot.  Narrow enough that the PML regions, which update every frame, do not make every chunk of a row change.
+static const int SnapshotBlockWidth = 64;
+
+//! Sections start on page boundaries, so that a restore pages in only what it copies.
+static const size_t SnapshotAlignment = 4096;
+
+//! Header at the start of a snapshot file, in host byte order.
+/** The sections follow at the given offsets.  Rows and chunks are in the format of the fields, so a restore
+    maps the file and copies them instead of parsing it.  Rows are identified by y coordinate, so that
+    snapshots do not depend on the layout of panels. */
+struct SnapshotHeader {
+    char magic[8];                  // "SDSNAP04"
+    std::uint64_t chain;            // same for a full snapshot and the deltas on top of it
+    std::int32_t sequence;          // 0 for a full snapshot, k for the k-th delta after it
+    std::int32_t waveValueBytes;    // sizeof(WaveValue)
+    std::int32_t width;             // WavefieldWidth
+    std::int32_t height;            // WavefieldHeight
+    std::int32_t dampSize;
+    std::int32_t blockWidth;        // SnapshotBlockWidth
+    std::int32_t pumpFactor;
+    std::int32_t spatialOrder;
+    std::int32_t trapezoidNumPanel;
+    std::int32_t tileHeight;
+    std::int32_t tileWidth;
+    std::int32_t skipQuiescent;
+    std::int32_t trackCone;
+    std::int32_t airgunX;
+    std::int32_t airgunY;
+    std::int32_t quiescent;         // causal cone
+    std::int32_t coneRadius;
+    std::int32_t coneY;
+    std::int32_t coneJ;
+    std::int32_t chunkCount;        // chunks in each chunk section
+    std::int32_t activityBytes;     // bytes in SS_Activity
+    std::int64_t frameCount;
+    AirgunState airgun;
+    std::uint64_t offset[SS_N];     // start of each section, or 0 if absent
+};
+
+//! Number of blocks of columns in a row of width w.
+static int SnapshotBlockCount( int w ) {
+    return (w+SnapshotBlockWidth-1)/SnapshotBlockWidth;
+}
+
+//! Bytes per row or chunk of section k.
+static size_t SnapshotItemBytes( const SnapshotHeader& h, int k ) {
+    switch( k ) {
+        case SS_Chunks: return 2*sizeof(std::int32_t);
+        case SS_U: case SS_Vx: case SS_Vy: return SnapshotBlockWidth*sizeof(WaveValue);
+        case SS_Pl: case SS_Pr: return DampSize*sizeof(float);
+        case SS_A: case SS_B: case SS_Pb: return h.width*sizeof(float);
+        case SS_RockMap: return h.width>>2;
+        default: return 1;
+    }
+}
+
+//! Bytes in section k.
+static size_t SnapshotSectionBytes( const SnapshotHeader& h, int k ) {
+    size_t n;
+    switch( k ) {
+        case SS_Chunks: case SS_U: case SS_Vx: case SS_Vy: n = h.chunkCount; break;
+        case SS_Pb: n = DampSize; break;
+        case SS_Activity: n = h.activityBytes; break;
+        default: n = h.height; break;
+    }
+    return n*SnapshotItemBytes(h,k);
+}
+
+//! True if a snapshot with header h has section k.
+static bool SnapshotHasSection( const SnapshotHeader& h, int k ) {
+    if( SS_A<=k && k<=SS_RockMap )
+        return h.sequence==0;
+    return k!=SS_Activity || h.activityBytes>0;
+}
+
+//! Read-only view of a whole file, mapped into memory where the platform allows.
+class MappedFile {
+public:
+    explicit MappedFile( const char* path );
+    ~MappedFile();
+    MappedFile( const MappedFile& ) = delete;
+    void operator=( const MappedFile& ) = delete;
+    const char* data() const {return myData;}
+    //! Size of the file, or 0 if it could not be read.
+    size_t size() const {return mySize;}
+private:
+    const char* myData = nullptr;
+    size_t mySize = 0;
+#if _WIN32
+    std::vector<char> myBuffer;
+#endif
+};
+
+#if _WIN32
+MappedFile::MappedFile( const char* path ) {
+    if( FILE* f = std::fopen( path, "rb" ) ) {
+        char chunk[1<<16];
+        size_t n;
+        while( (n = std::fread( chunk, 1, sizeof(chunk), f ))>0 )
+            myBuffer.insert( myBuffer.end(), chunk, chunk+n );
+        std::fclose(f);
+        myData = myBuffer.data();
+        mySize = myBuffer.size();
+    }
+}
+
+MappedFile::~MappedFile() {}
+#else
+MappedFile::MappedFile( const char* path ) {
+    int fd = open( path, O_RDONLY );
+    if( fd<0 )
+        return;
+    struct stat s;
+    if( fstat( fd, &s )==0 && s.st_size>0 ) {
+        void* p = mmap( nullptr, size_t(s.st_size), PROT_READ, MAP_PRIVATE, fd, 0 );
+        if( p!=MAP_FAILED ) {
+            myData = static_cast<const char*>(p);
+            mySize = size_t(s.st_size);
+        }
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if( myData )
+        munmap( const_cast<char*>(myData), mySize );
+}
+#endif /* _WIN32 */
+
+//! Row i of the field for section k of a snapshot.
+char* WavefieldState::SnapshotRow( int k, int i ) const {
+    switch( k ) {
+        case SS_U: return reinterpret_cast<char*>(U[i]);
+        case SS_Vx: return reinterpret_cast<char*>(Vx[i]);
+        case SS_Vy: return reinterpret_cast<char*>(Vy[i]);
+        case SS_Pl: return reinterpret_cast<char*>(Pl[i]);
+        case SS_Pr: return reinterpret_cast<char*>(Pr[i]);
+        case SS_A: return reinterpret_cast<char*>(A[i]);
+        case SS_B: return reinterpret_cast<char*>(B[i]);
+        case SS_RockMap: return reinterpret_cast<char*>(RockMap[i]);
+        case SS_Pb: return reinterpret_cast<char*>(Pb[i]);
+        default: Assert(false); return nullptr;
+    }
+}
+
+//! Index in SnapshotBase of row y of chunk section k.
+size_t WavefieldState::SnapshotBaseRow( int k, int y ) const {
+    Assert( SS_U<=k && k<=SS_Vy );
+    return (size_t(y+1)*3+(k-SS_U))*WavefieldWidth;
+}
+
+//! True if U, Vx, or Vy in block c of the columns of row y differs from SnapshotBase.
+/** Compares bits, so that a delta holds every change, however small. */
+bool WavefieldState::ChunkChanged( int y, int c ) const {
+    const int j0 = c*SnapshotBlockWidth;
+    const size_t n = (Min( j0+SnapshotBlockWidth, WavefieldWidth )-j0)*sizeof(WaveValue);
+    for( int k=SS_U; k<=SS_Vy; ++k )
+        if( std::memcmp( SnapshotRow( k, IofY(y) )+j0*sizeof(WaveValue), &SnapshotBase[SnapshotBaseRow(k,y)+j0], n )!=0 )
+            return true;
+    return false;
+}
+
+//! Copy U, Vx, and Vy in block c of the columns of row y to SnapshotBase.
+void WavefieldState::RecordChunk( int y, int c ) {
+    const int j0 = c*SnapshotBlockWidth;
+    const size_t n = (Min( j0+SnapshotBlockWidth, WavefieldWidth )-j0)*sizeof(WaveValue);
+    for( int k=SS_U; k<=SS_Vy; ++k )
+        std::memcpy( &SnapshotBase[SnapshotBaseRow(k,y)+j0], SnapshotRow( k, IofY(y) )+j0*sizeof(WaveValue), n );
+}
+
+//! Save the rows of the panels, y=-1 through WavefieldHeight-2.
+/** The rows of the overlap zones are copies, which ComputeTiling makes again after a restore. */
+bool WavefieldState::SaveSnapshot( const char* path, bool delta ) {
+    if( delta && SnapshotChain==0 )
+        return false;
+    const int h = WavefieldHeight;
+    const int w = WavefieldWidth;
+    const int blocks = SnapshotBlockCount(w);
+    std::vector<std::int32_t> chunks;
+    for( int y=-1; y<h-1; ++y )
+        for( int c=0; c<blocks; ++c )
+            if( !delta || ChunkChanged( y, c ) ) {
+                chunks.push_back(y);
+                chunks.push_back(c);
+            }
+    // The initial noise evolves in every cell unless tiles are skipped, so a delta can cover most of the wavefield.
+    // Then it would save little over a full snapshot, and cost more to restore.
+    if( delta && chunks.size()/2>size_t(h)*blocks/2 )
+        return false;
+    SnapshotHeader s;
+    std::memset( &s, 0, sizeof(s) );
+    std::memcpy( s.magic, "SDSNAP04", sizeof(s.magic) );
+    if( delta ) {
+        s.chain = SnapshotChain;
+        s.sequence = SnapshotSequence+1;
+    } else {
+        // Any value that is unlikely to repeat will do, as long as it is nonzero.
+        s.chain = (std::uint64_t(std::chrono::high_resolution_clock::now().time_since_epoch().count())*0x9e3779b97f4a7c15u
+                   ^ std::uint64_t(reinterpret_cast<std::uintptr_t>(this))) | 1;
+        s.sequence = 0;
+    }
+    s.waveValueBytes = sizeof(WaveValue);
+    s.width = w;
+    s.height = h;
+    s.dampSize = DampSize;
+    s.blockWidth = SnapshotBlockWidth;
+    s.pumpFactor = PumpFactor;
+    s.spatialOrder = SpatialOrder;
+    s.trapezoidNumPanel = TrapezoidNumPanel;
+    s.tileHeight = TileHeight;
+    s.tileWidth = TileWidth;
+    s.skipQuiescent = SkipQuiescent;
+    s.trackCone = TrackCone;
+    s.airgunX = AirgunX;
+    s.airgunY = AirgunY;
+#if RESTRICT_TO_CAUSAL_CONE
+    s.quiescent = Quiescent;
+    s.coneRadius = ConeRadius;
+    s.coneY = ConeY;
+    s.coneJ = ConeJ;
+#endif /* RESTRICT_TO_CAUSAL_CONE */
+    s.chunkCount = int(chunks.size()/2);
+#if SKIP_QUIESCENT_TILES
+    s.activityBytes = int(BlockActive.size());
+#endif /* SKIP_QUIESCENT_TILES */
+    s.frameCount = FrameCount;
+    TheAirgun.saveState( s.airgun );
+    size_t offset = sizeof(s);
+    for( int k=0; k<SS_N; ++k )
+        if( SnapshotHasSection(s,k) ) {
+            offset = (offset+SnapshotAlignment-1) & ~(SnapshotAlignment-1);
+            s.offset[k] = offset;
+            offset += SnapshotSectionBytes(s,k);
+        }
+
+    const std::string temp = std::string(path)+".tmp";
+    FILE* f = std::fopen( temp.c_str(), "wb" );
+    if( !f )
+        return false;
+    bool ok = std::fwrite( &s, sizeof(s), 1, f )==1;
+    offset = sizeof(s);
+    static const char zeros[SnapshotAlignment] = {};
+    for( int k=0; k<SS_N && ok; ++k ) {
+        if( !s.offset[k] )
+            continue;
+        ok = std::fwrite( zeros, 1, s.offset[k]-offset, f )==s.offset[k]-offset;
+        const size_t n = SnapshotItemBytes(s,k);
+        switch( k ) {
+            case SS_Chunks:
+                ok &= std::fwrite( chunks.data(), n, s.chunkCount, f )==size_t(s.chunkCount);
+                break;
+            case SS_U: case SS_Vx: case SS_Vy:
+                for( size_t r=0; r<chunks.size() && ok; r+=2 ) {
+                    // The last block of a row may be partial, and is padded with zeros.
+                    const int j0 = chunks[r+1]*SnapshotBlockWidth;
+                    const size_t m = (Min( j0+SnapshotBlockWidth, w )-j0)*sizeof(WaveValue);
+                    ok = std::fwrite( SnapshotRow( k, IofY(chunks[r]) )+j0*sizeof(WaveValue), 1, m, f )==m
+                         && std::fwrite( zeros, 1, n-m, f )==n-m;
+                }
+                break;
+            case SS_Pb:
+                for( int i=0; i<DampSize && ok; ++i )
+                    ok = std::fwrite( SnapshotRow( k, i ), n, 1, f )==1;
+                break;
+#if SKIP_QUIESCENT_TILES
+            case SS_Activity:
+                ok &= std::fwrite( BlockActive.data(), 1, BlockActive.size(), f )==BlockActive.size();
+                break;
+#endif /* SKIP_QUIESCENT_TILES */
+            default:
+                for( int y=-1; y<h-1 && ok; ++y )
+                    ok = std::fwrite( SnapshotRow( k, IofY(y) ), n, 1, f )==1;
+                break;
+        }
+        offset = s.offset[k]+SnapshotSectionBytes(s,k);
+    }
+    if( std::fclose(f)!=0 )
+        ok = false;
+#if _WIN32
+    // Windows does not rename over an existing file.
+    if( ok )
+        std::remove( path );
+#endif
+    if( !ok || std::rename( temp.c_str(), path )!=0 ) {
+        std::remove( temp.c_str() );
+        return false;
+    }
+    SnapshotChain = s.chain;
+    SnapshotSequence = s.sequence;
+    SnapshotBase.resize( size_t(h)*3*w );
+    for( size_t r=0; r<chunks.size(); r+=2 )
+        RecordChunk( chunks[r], chunks[r+1] );
+    return true;
+}
+
+bool WavefieldState::RestoreSnapshot( const char* path ) {
+    MappedFile file( path );
+    SnapshotHeader s;
+    if( file.size()<sizeof(s) )
+        return false;
+    std::memcpy( &s, file.data(), sizeof(s) );
+    const bool delta = s.sequence!=0;
+    // Check everything before changing anything.
+    if( std::memcmp( s.magic, "SDSNAP04", sizeof(s.magic) )!=0 || s.waveValueBytes!=int(sizeof(WaveValue))
+        || s.dampSize!=DampSize || s.blockWidth!=SnapshotBlockWidth )
+        return false;
+    if( delta ) {
+        if( SnapshotChain==0 || s.chain!=SnapshotChain || s.sequence!=SnapshotSequence+1
+            || s.width!=WavefieldWidth || s.height!=WavefieldHeight || s.trapezoidNumPanel!=TrapezoidNumPanel
+            || s.spatialOrder!=SpatialOrder )
+            return false;
+    } else {
+        if( s.width<4 || s.width>WavefieldWidthMax || s.width%8!=0 || s.height<4 || s.height>WavefieldHeightMax
+            || s.trapezoidNumPanel<1 || s.trapezoidNumPanel>NUM_PANEL_MAX || (s.spatialOrder!=2 && s.spatialOrder!=4) )
+            return false;
+    }
+    const int pulseSizeMax = int(sizeof(s.airgun.pulse)/sizeof(float));
+    const int blocks = SnapshotBlockCount(s.width);
+    if( s.pumpFactor<1 || s.pumpFactor>PUMP_FACTOR_SPLIT_MAX
+        || (s.spatialOrder==4 && s.pumpFactor>PUMP_FACTOR_MAX)
+        || s.tileHeight<1 || s.tileHeight>15 || s.tileWidth<8 || s.tileWidth>8*63 || s.tileWidth%8!=0
+        || s.chunkCount<0 || s.chunkCount>s.height*blocks || (!delta && s.chunkCount!=s.height*blocks) || s.activityBytes<0
+        || s.airgun.pulseSize<0 || s.airgun.pulseSize>pulseSizeMax || s.airgun.counter<0 || s.airgun.counter>pulseSizeMax )
+        return false;
+    for( int k=0; k<SS_N; ++k )
+        if( SnapshotHasSection(s,k) && (s.offset[k]<sizeof(s) || s.offset[k]>file.size() || SnapshotSectionBytes(s,k)>file.size()-s.offset[k]) )
+            return false;
+    std::vector<std::int32_t> chunks( 2*size_t(s.chunkCount) );
+    std::memcpy( chunks.data(), file.data()+s.offset[SS_Chunks], chunks.size()*sizeof(std::int32_t) );
+    for( size_t r=0; r<chunks.size(); r+=2 )
+        if( chunks[r]<-1 || chunks[r]>=s.height-1 || chunks[r+1]<0 || chunks[r+1]>=blocks )
+            return false;
+
+    if( !delta ) {
+        WavefieldWidth = s.width;
+        WavefieldHeight = s.height;
+        TrapezoidNumPanel = s.trapezoidNumPanel;
+        PumpFactor = s.pumpFactor;
+        SpatialOrder = s.spatialOrder;
+        InitializeRockCoefficients();
+        InitializePanelMap();
+#if SKIP_QUIESCENT_TILES
+        InitializeActivityMap();
+#endif /* SKIP_QUIESCENT_TILES */
+        AllocateFields();
+        if( SplitTiling )
+            ClearRow( PanelLastI[NumPanel-1] );
+    } else if( s.pumpFactor!=PumpFactor ) {
+        PumpFactor = s.pumpFactor;
+        ChangeLayout();
+    }
+    TileHeight = s.tileHeight;
+    TileWidth = s.tileWidth;
+    for( int k=SS_U; k<SS_N; ++k ) {
+        if( !SnapshotHasSection(s,k) || k==SS_Activity )
+            continue;
+        const size_t n = SnapshotItemBytes(s,k);
+        const char* src = file.data()+s.offset[k];
+        switch( k ) {
+            case SS_U: case SS_Vx: case SS_Vy:
+                for( size_t r=0; r<chunks.size(); r+=2, src+=n ) {
+                    const int j0 = chunks[r+1]*SnapshotBlockWidth;
+                    std::memcpy( SnapshotRow( k, IofY(chunks[r]) )+j0*sizeof(WaveValue), src,
+                                 (Min( j0+SnapshotBlockWidth, s.width )-j0)*sizeof(WaveValue) );
+                }
+                break;
+            case SS_Pb:
+                for( int i=0; i<DampSize; ++i, src+=n )
+                    std::memcpy( SnapshotRow( k, i ), src, n );
+                break;
+            default:
+                for( int y=-1; y<s.height-1; ++y, src+=n )
+                    std::memcpy( SnapshotRow( k, IofY(y) ), src, n );
+                break;
+        }
+    }
+#if SKIP_QUIESCENT_TILES
+    // A snapshot from a build with another activity map leaves every block active, which is safe.
+    if( size_t(s.activityBytes)==BlockActive.size() )
+        std::memcpy( BlockActive.data(), file.data()+s.offset[SS_Activity], BlockActive.size() );
+    else
+        std::fill( BlockActive.begin(), BlockActive.end(), 1 );
+#endif /* SKIP_QUIESCENT_TILES */
+    SkipQuiescent = s.skipQuiescent!=0;
+    TrackCone = s.trackCone!=0;
+    AirgunX = s.airgunX;
+    AirgunY = s.airgunY;
+    TheAirgun.restoreState( s.airgun );
+#if RESTRICT_TO_CAUSAL_CONE
+    Quiescent = s.quiescent!=0;
+    ConeRadius = s.coneRadius;
+    ConeY = s.coneY;
+    ConeJ = s.coneJ;
+#endif /* RESTRICT_TO_CAUSAL_CONE */
+    FrameCount = s.frameCount;
+    // A full snapshot has every chunk.
+    SnapshotBase.resize( size_t(s.height)*3*s.width );
+    for( size_t r=0; r<chunks.size(); r+=2 )
+        RecordChunk( chunks[r], chunks[r+1] );
+    SnapshotChain = s.chain;
+    SnapshotSequence = s.sequence;
+    DrawCopyValid = false;
+    // Force the overlap zones and tiling to be recomputed.
+    currentPumpFactor = 0;
+    return true;
+}
+
+WavefieldEngine::WavefieldEngine() : myState(new WavefieldState) {}
+
+WavefieldEngine::~WavefieldEngine() {
+    delete myState;
+}
+
+void WavefieldEngine::initialize( const Geology& g ) {
+    myState->Initialize(g);
+}
+
+void WavefieldEngine::autotune( const Geology& g ) {
+#if HAVE_WORKER_THROTTLE
+    // Time with every worker, because the panel count limits how many of the workers that ThrottleWorkers adds later can help.
+    const int workers = WorkerCount();
+    const int threads = MaxWorkerCount();
+    const ThrottleSettings settings = GetThrottleSettings();
+    ThrottleSettings quiet = settings;
+    quiet.log = false;
+    SetThrottleSettings( quiet );
+    SetWorkerCount( threads );
+#if USE_TBB
+    ThrottledArena().execute( [&]{myState->Autotune(g,threads);} );
+#else
+    myState->Autotune(g,threads);
+#endif
+    SetWorkerCount( workers );
+    SetThrottleSettings( settings );
+#else
+    myState->Autotune(g,1);
+#endif /* HAVE_WORKER_THROTTLE */
+}
+
+void WavefieldEngine::updateDraw( const NimblePixMap& map, NimbleRequest request, float showGeology, float showSeismic, ColorFunc colorFunc ) {
+    myState->UpdateDraw( map, request, showGeology, showSeismic, colorFunc );
+}
+
+void WavefieldEngine::copySurface( float* output, int w ) const {
+    const WavefieldState& s = *myState;
+    Assert(w==s.WavefieldWidth-2*HIDDEN_BORDER_SIZE);
+    for( int j=HIDDEN_BORDER_SIZE; j<w+HIDDEN_BORDER_SIZE; ++j )
+        *output++ = s.Vy[1][j];
+}
+
+void WavefieldEngine::setImpulseLocation( int x, int y ) {
+    myState->AirgunY = y;
+    myState->AirgunX = x;
+}
+
+void WavefieldEngine::fireAirgun( int x, int y ) {
+    if( myState->TheAirgun.fire() )
+        setImpulseLocation( x, y );
+}
+
+Airgun& WavefieldEngine::airgun() {
+    return myState->TheAirgun;
+}
+
+int WavefieldEngine::pumpFactor() const {
+    return myState->PumpFactor;
+}
+
+void WavefieldEngine::setPumpFactor( int d ) {
+    Assert(1<=d && d<=PUMP_FACTOR_SPLIT_MAX);
+    myState->PumpFactor = d;
+}
+
+int WavefieldEngine::spatialOrder() const {
+    return myState->SpatialOrder;
+}
+
+void WavefieldEngine::setSpatialOrder( int order ) {
+    Assert( order==2 || order==4 );
+    myState->SpatialOrder = order;
+}
+
+float WavefieldEngine::timestep() const {
+    return TimestepOfOrder( myState->SpatialOrder );
+}
+
+void WavefieldEngine::setPartition( int k, int n, WavefieldHaloLink* link ) {
+    Assert( 0<=k && k<n && n<=NUM_PANEL_MAX );
+    Assert( n==1 || link );
+    WavefieldState& s = *myState;
+    s.PartIndex = k;
+    s.PartCount = n;
+    s.HaloLink = n>1 ? link : nullptr;
+    // Every part needs at least one panel.
+    s.TrapezoidNumPanel = Max( s.TrapezoidNumPanel, n );
+    if( n>1 ) {
+        s.SkipQuiescent = false;
+        s.TrackCone = false;
+    }
+}
+
+size_t WavefieldEngine::haloBytesMax( int width ) {
+    return STENCIL_REACH_MAX*PUMP_FACTOR_MAX*HaloRowBytes(width);
+}
+
+long long WavefieldEngine::frameCount() const {
+    return myState->FrameCount;
+}
+
+bool WavefieldEngine::saveSnapshot( const char* path, bool delta ) {
+    return myState->SaveSnapshot( path, delta );
+}
+
+bool WavefieldEngine::restoreSnapshot( const char* path ) {
+    return myState->RestoreSnapshot( path );
+}
+
+void WavefieldEngine::setTileSkipping( bool enable ) {
+    myState->SkipQuiescent = enable;
+}
+
+void WavefieldEngine::setConeTracking( bool enable ) {
+    myState->TrackCone = enable;
+}
+
+void WavefieldEngine::setPipelinedDraw( bool enable ) {
+    myState->PipelinedDraw = enable;
+    myState->DrawCopyValid = false;
+}
+
+void WavefieldEngine::getTileKinds( std::vector<WavefieldTileKind>& kinds ) {
+    WavefieldState& s = *myState;
+    s.ComputeTiling();
+    kinds.resize(TT_NumTileTag);
+    for( int k=0; k<TT_NumTileTag; ++k ) {
+        kinds[k].name = TileTagName[k];
+        kinds[k].tileCount = 0;
+        kinds[k].cellsPerFrame = 0;
+        kinds[k].bytesPerCell = TileTagBytesPerCell[k];
+    }
+    for( const Tile& t: s.TileArray ) {
+        WavefieldTileKind& k = kinds[t.tag];
+        ++k.tileCount;
+        k.cellsPerFrame += t.iLen*t.jLenOver8*8;
+    }
+}
+
+void WavefieldEngine::updateTileKind( int k ) {
+    Assert( 0<=k && k<TT_NumTileTag );
+    WavefieldState& s = *myState;
+    s.ComputeTiling();
+    for( const Tile& t: s.TileArray )
+        if( t.tag==k )
+            s.UpdateTile(t);
+}
+
+WavefieldEngine TheWavefieldEngine;
+
+void WavefieldInitialize( const Geology& g ) {
+#if AUTOTUNE_TILING
+    TheWavefieldEngine.autotune(g);
+#endif /* AUTOTUNE_TILING */
+    TheWavefieldEngine.initialize(g);
+}
+
+void WavefieldUpdateDraw( const NimblePixMap& map, NimbleRequest request, float showGeology, float showSeismic, ColorFunc colorFunc ) {
+    TheWavefieldEngine.updateDraw( map, request, showGeology, showSeismic, colorFunc );
+}
+
+void WavefieldCopySurface( float* output, int w ) {
+    TheWavefieldEngine.copySurface( output, w );
+}
+
+void WavefieldSetImpulseLocation( int x, int y ) {
+    TheWavefieldEngine.setImpulseLocation( x, y );
+}
+
+int WavefieldGetPumpFactor() {
+    return TheWavefieldEngine.pumpFactor();
+}
+
+void WavefieldSetPumpFactor( int d ) {
+    TheWavefieldEngine.setPumpFactor(d);
+}
+
+void WavefieldSetPipelinedDraw( bool enable ) {
+    TheWavefieldEngine.setPipelinedDraw(enable);
+}
@@ -17,6 +17,10 @@
  Wave physics and rendering for Seismic Duck
 *******************************************************************************/
 
+#pragma once
+#ifndef Wavefield_H
+#define Wavefield_H
+
 #include "ColorFunc.h"
 #include "NimbleDraw.h"
 
@@ -29,7 +33,154 @@ enum RockType {
     RockTypeMax = Shale
 };
 
-//! Initialize fields for wave simulation.
+#include <vector>
+
+class Airgun;
+class WavefieldState;
+
+//! Statistics about one kind of tile, for benchmarks.
+struct WavefieldTileKind {
+    const char* name;
+    //! Number of tiles of this kind, over all panels.
+    int tileCount;
+    //! Number of cell updates per frame by tiles of this kind, including overlap zones.
+    double cellsPerFrame;
+    //! Bytes of fields read and written per cell update, if none of them were in cache.
+    int bytesPerCell;
+};
+
+//! Channel between engines that each update some of the panels of one simulation, such as engines in different processes.
+/** The parts are numbered from the surface down.  Messages in each direction must arrive in the order sent. */
+class WavefieldHaloLink {
+public:
+    //! Send n bytes to the part above if up is true, or to the part below.
+    virtual void send( bool up, const void* data, size_t n ) = 0;
+    //! Receive n bytes from the part above if up is true, or from the part below.
+    virtual void receive( bool up, void* data, size_t n ) = 0;
+protected:
+    ~WavefieldHaloLink() {}
+};
+
+//! One wave simulation, with its own grids, tiling, and airgun.
+/** Independent engines can be updated concurrently.  They share the thread pool in Parallel.h. */
+class WavefieldEngine {
+public:
+    WavefieldEngine();
+    ~WavefieldEngine();
+    WavefieldEngine( const WavefieldEngine& ) = delete;
+    void operator=( const WavefieldEngine& ) = delete;
+
+    //! Initialize fields for wave simulation.
+    void initialize( const Geology& g );
+
+    //! Choose tiling parameters for the host and the size of g, by timing candidates on first use.
+    /** Times with the maximum number of workers, and restores the worker count afterwards.  The choice is cached
+        per processor model and worker count, so later runs skip the timing.
+        Leaves the wavefield in a meaningless state, so call initialize afterwards. */
+    void autotune( const Geology& g );
+
+    //! Update the wavefield and/or draw it.
+    void updateDraw( const NimblePixMap& map, NimbleRequest request, float showGeology, float showSeismic, ColorFunc colorFunc );
+
+    //! Copy values from surface of wavefield into out[].
+    /** w is the width of the visible portion of the wavefield. */
+    void copySurface( float* out, int w ) const;
+
+    //! Coordinates (x,y) are in the coordinate system of the "map" argument to updateDraw.
+    void setImpulseLocation( int x, int y );
+
+    //! Start a pulse from the airgun at (x,y), unless the previous pulse is still in progress.
+    void fireAirgun( int x, int y );
+
+    //! Airgun that supplies the impulses.
+    Airgun& airgun();
+
+    //! Get "pump factor", which is number of timesteps per video frame.
+    int pumpFactor() const;
+
+    //! Set "pump factor".  Value should be in closed interval [1,PUMP_FACTOR_SPLIT_MAX]
+    /** Values above PUMP_FACTOR_MAX switch from trapezoid tiling to split tiling, which has no
+        redundant work in overlap zones but updates every tile, and may use fewer panels. */
+    void setPumpFactor( int d );
+
+    //! Get the order of accuracy in space of the stencil, 2 or 4.
+    int spatialOrder() const;
+
+    //! Set the order of accuracy in space.  The default is 2.  Call before initialize.
+    /** The fourth-order stencil has much less numerical dispersion on the same grid.  Only its interior has SIMD
+        kernels, and it does twice the arithmetic, so on grids of 1024x720 to 1920x720 it ran 2.5-3 times slower per
+        cell than the second-order stencil.  Its overlap zones are three times as deep.  It needs a timestep 0.85
+        times as long, and is second order at the free surface.  Requires static trapezoid tiling, so the pump
+        factor must be at most PUMP_FACTOR_MAX. */
+    void setSpatialOrder( int order );
+
+    //! Length of a timestep relative to that of the second-order stencil.  Depends only on the spatial order.
+    float timestep() const;
+
+    //! Update only part k of n of the panels, exchanging overlap zones with the other parts through link.
+    /** Call before initialize.  All n parts must be set up with the same geology, pump factor, and airgun,
+        and be updated in lockstep.  Requires static trapezoid tiling, so the pump factor must be at most
+        PUMP_FACTOR_MAX.  Turns off tile skipping, which would need the activity of the other parts, and cone tracking.
+        Only part 0 has the surface for copySurface, and each part draws only its own panels.
+        n==1 restores the default of updating every panel. */
+    void setPartition( int k, int n, WavefieldHaloLink* link );
+
+    //! Largest message that an engine for a grid of the given width sends through a WavefieldHaloLink.
+    static size_t haloBytesMax( int width );
+
+    //! Number of frames updated since initialize, counting those before the snapshot that was restored.
+    long long frameCount() const;
+
+    //! Write the state of the simulation to a snapshot file.  Return false if the file was not written.
+    /** The state is the fields, the rock coefficients, the airgun, and the tiling parameters.
+        If delta is true, writes only the blocks of rows that changed at all since the snapshot that this engine
+        saved or restored last, which must exist; the delta can be restored only on top of that snapshot.
+        Writes no delta, and returns false, if more than half of the blocks changed, so that the caller can write
+        a full snapshot instead.  Without tile skipping, that is usually the case, because the initial noise evolves
+        everywhere.  Keeps a copy of the fields as of the last snapshot to compare with.
+        Writes a temporary file and renames it, so an interrupted save leaves any old file intact. */
+    bool saveSnapshot( const char* path, bool delta );
+
+    //! Restore a full snapshot, or apply a delta snapshot on top of the snapshot saved or restored last.
+    /** A full snapshot needs no geology or initialize.  Return false, leaving the engine unchanged,
+        if the file is not a snapshot for this build or a delta does not follow the last snapshot. */
+    bool restoreSnapshot( const char* path );
+
+    //! Enable or disable skipping of tiles where the wavefield is quiescent.  Disabled by default.
+    /** Skips interior tiles with no activity nearby.  Skipping is not exact: it freezes every cell whose
+        magnitude is below a threshold of 1e-3, far too small to see but not to measure, and the result depends on
+        setPartition, which turns skipping off.  So the game enables it, but tools that record the wavefield do not.
+        With cone tracking, it also lets a shot into a wavefield that has become quiescent again start a new cone. */
+    void setTileSkipping( bool enable );
+
+    //! Enable or disable restricting updates to the causal cone of a shot.  Disabled by default.
+    /** After a shot into a wavefield that holds only the initial noise, updates only the interior tiles that the
+        shot's wave could have reached, until the cone covers the grid.  The PML regions are always updated.
+        Outside the cone, the noise of about 1e-6 that initialize leaves is frozen instead of evolving, so the
+        results are exact only down to that noise floor.  Without tile skipping, only the first shot after
+        initialize gets a cone.  setPartition turns tracking off. */
+    void setConeTracking( bool enable );
+
+    //! Enable or disable pipelined drawing.  Disabled by default.
+    /** When enabled, updateDraw with both NimbleUpdate and NimbleDraw draws the wavefield as it was before
+        the update, from samples of the visible part that the previous call saved, while the update runs.
+        Drawing is then off the critical path of the update, and the picture is a frame behind. */
+    void setPipelinedDraw( bool enable );
+
+    //! Set kinds[k] to statistics about tiles of kind k, for the current tiling.
+    void getTileKinds( std::vector<WavefieldTileKind>& kinds );
+
+    //! Update only the tiles of kind k, for one frame, on the calling thread.
+    /** For benchmarks.  Leaves the wavefield in a physically meaningless state. */
+    void updateTileKind( int k );
+private:
+    WavefieldState* myState;
+};
+
+//! Engine for the game.  The free functions below operate on it.
+extern WavefieldEngine TheWavefieldEngine;
+
+//! Initialize fields for wave simulation, after tuning the tiling if AUTOTUNE_TILING is set.
 void WavefieldInitialize( const Geology& g );
 
 //! Update the wavefield and/or draw it.
@@ -45,5 +196,10 @@ void WavefieldSetImpulseLocation( int x, int y );
 //! Get "pump factor", which is number of timesteps per video frame.
 int WavefieldGetPumpFactor();
 
-//! Set "pump factor".  Value should be in closed interval [d,PUMP_FACTOR_MAX]
+//! Set "pump factor".  Value should be in closed interval [1,PUMP_FACTOR_SPLIT_MAX]
 void WavefieldSetPumpFactor( int d );
+
+//! Enable or disable pipelined drawing by WavefieldUpdateDraw.
+void WavefieldSetPipelinedDraw( bool enable );
+
+#endif /* Wavefield_H */